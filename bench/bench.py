@@ -0,0 +1,229 @@
+#!/usr/bin/env python3
+"""Benchmark driver for lily-postgres.
+
+This creates a throwaway PostgreSQL cluster that only listens on a Unix socket
+in a temporary directory, runs each Lily workload against it, and prints the
+results as JSON. Workloads connect with `Conn.open()` and find the cluster
+through the usual libpq environment variables.
+
+Each workload prints `start <ops>` once it is ready, then `tick` after every
+`<ops>` operations. Latencies are measured between ticks, so p50/p99 describe
+the cost of one operation averaged over a tick. With only a few ticks, p99 is
+little more than the slowest tick, so `compare` only flags p99 when both runs
+have at least `--min-p99-samples` ticks (100 by default).
+
+    bench.py run --lily lily --library src/postgres.so [--output out.json]
+    bench.py compare baseline.json current.json [--threshold 0.10]
+"""
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+WORKLOAD_DIR = os.path.join(HERE, "workloads")
+
+# Run in this order. Setup is not timed.
+WORKLOADS = [
+    "point_select",
+    "scan",
+    "scan_spill",
+    "bulk_insert",
+    "copy_binary",
+    "copy_telemetry",
+    "wide_row",
+]
+
+
+def percentile(values, pct):
+    ordered = sorted(values)
+    index = int(round((pct / 100.0) * (len(ordered) - 1)))
+    return ordered[index]
+
+
+class Cluster:
+    def __init__(self, bindir):
+        self.bindir = bindir
+        self.root = tempfile.mkdtemp(prefix="lily-postgres-bench-")
+        self.data = os.path.join(self.root, "data")
+        self.socket = os.path.join(self.root, "socket")
+
+    def tool(self, name):
+        if self.bindir:
+            return os.path.join(self.bindir, name)
+
+        return name
+
+    def start(self):
+        os.mkdir(self.socket)
+        subprocess.run([self.tool("initdb"), "-D", self.data, "-A", "trust",
+                        "-U", "postgres", "--no-sync"],
+                       check=True, stdout=subprocess.DEVNULL)
+        options = "-k %s -c listen_addresses='' -c fsync=off" % self.socket
+        subprocess.run([self.tool("pg_ctl"), "-D", self.data, "-w", "-s",
+                        "-l", os.path.join(self.root, "server.log"),
+                        "-o", options, "start"], check=True)
+
+    def stop(self):
+        if os.path.exists(os.path.join(self.data, "postmaster.pid")):
+            subprocess.run([self.tool("pg_ctl"), "-D", self.data, "-w", "-s",
+                            "-m", "immediate", "stop"])
+
+        shutil.rmtree(self.root, ignore_errors=True)
+
+    def environ(self):
+        env = dict(os.environ)
+        env["PGHOST"] = self.socket
+        env["PGUSER"] = "postgres"
+        env["PGDATABASE"] = "postgres"
+        env.pop("PGPORT", None)
+        return env
+
+
+def run_workload(lily, workdir, name, env):
+    script = os.path.join(workdir, name + ".lily")
+    proc = subprocess.Popen([lily, script], cwd=workdir, env=env,
+                            stdout=subprocess.PIPE, universal_newlines=True)
+    ops_per_tick = None
+    last = None
+    samples = []
+    started = None
+
+    for line in proc.stdout:
+        now = time.perf_counter()
+        words = line.split()
+
+        if not words:
+            continue
+        elif words[0] == "start":
+            ops_per_tick = int(words[1])
+            started = now
+            last = now
+        elif words[0] == "tick":
+            samples.append((now - last) / ops_per_tick)
+            last = now
+
+    if proc.wait() != 0 or not samples:
+        raise RuntimeError("workload %s failed." % name)
+
+    elapsed = last - started
+    ops = ops_per_tick * len(samples)
+
+    return {
+        "ops": ops,
+        "seconds": elapsed,
+        "ops_per_sec": ops / elapsed,
+        "p50_ms": percentile(samples, 50) * 1000.0,
+        "p99_ms": percentile(samples, 99) * 1000.0,
+        "samples": len(samples),
+    }
+
+
+def command_run(args):
+    cluster = Cluster(args.pg_bindir)
+    workdir = tempfile.mkdtemp(prefix="lily-postgres-workloads-")
+
+    # Lily looks for `import postgres` beside the first file, so the workloads
+    # and the library are put together.
+    for entry in os.listdir(WORKLOAD_DIR):
+        shutil.copy(os.path.join(WORKLOAD_DIR, entry), workdir)
+
+    shutil.copy(args.library, os.path.join(workdir, "postgres.so"))
+    names = args.only or WORKLOADS
+    results = {}
+
+    try:
+        cluster.start()
+        env = cluster.environ()
+        subprocess.run([args.lily, os.path.join(workdir, "setup.lily")],
+                       cwd=workdir, env=env, check=True)
+
+        for name in names:
+            results[name] = run_workload(args.lily, workdir, name, env)
+    finally:
+        cluster.stop()
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    text = json.dumps({"workloads": results}, indent=4, sort_keys=True)
+
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+
+    print(text)
+    return 0
+
+
+def command_compare(args):
+    with open(args.baseline) as f:
+        baseline = json.load(f)["workloads"]
+
+    with open(args.current) as f:
+        current = json.load(f)["workloads"]
+
+    regressed = False
+    report = {}
+
+    for name, old in sorted(baseline.items()):
+        new = current.get(name)
+
+        if new is None:
+            continue
+
+        throughput = new["ops_per_sec"] / old["ops_per_sec"] - 1.0
+        p99 = new["p99_ms"] / old["p99_ms"] - 1.0
+        # Results from before samples were recorded count as too few.
+        samples = min(old.get("samples", 0), new.get("samples", 0))
+        p99_checked = samples >= args.min_p99_samples
+        flagged = (throughput < -args.threshold or
+                   (p99_checked and p99 > args.threshold))
+        regressed = regressed or flagged
+        report[name] = {
+            "ops_per_sec_change": throughput,
+            "p99_change": p99,
+            "p99_checked": p99_checked,
+            "regression": flagged,
+        }
+
+    print(json.dumps({"threshold": args.threshold, "workloads": report},
+                     indent=4, sort_keys=True))
+    return 1 if regressed else 0
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    sub = parser.add_subparsers(dest="command")
+    sub.required = True
+
+    run = sub.add_parser("run", help="Run workloads and print JSON results.")
+    run.add_argument("--lily", default="lily")
+    run.add_argument("--library", required=True,
+                     help="Path to the built postgres.so.")
+    run.add_argument("--pg-bindir", default=None,
+                     help="Directory holding initdb and pg_ctl.")
+    run.add_argument("--output", default=None)
+    run.add_argument("--only", nargs="*", choices=WORKLOADS)
+    run.set_defaults(func=command_run)
+
+    compare = sub.add_parser("compare",
+                             help="Flag regressions against a baseline.")
+    compare.add_argument("baseline")
+    compare.add_argument("current")
+    compare.add_argument("--threshold", type=float, default=0.10,
+                         help="Allowed relative change (default 0.10).")
+    compare.add_argument("--min-p99-samples", type=int, default=100,
+                         help="Ticks both runs need before p99 is flagged "
+                              "(default 100).")
+    compare.set_defaults(func=command_compare)
+
+    args = parser.parse_args()
+    return args.func(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,91 @@
+/* Helpers shared by the server-less checks.
+
+   Each check program includes the binding and then this. A check that does not
+   match prints what it expected and what it found, and the program exits with
+   a failure once every check has run. */
+
+#ifndef LILY_CHECK_H
+# define LILY_CHECK_H
+
+# include <stdlib.h>
+# include <string.h>
+
+# include "lily.h"
+
+static int failures;
+
+static void expect_integer(const char *what, int64_t found, int64_t expected)
+{
+    if (found == expected)
+        return;
+
+    printf("%s: expected %ld, found %ld.\n", what, (long)expected,
+           (long)found);
+    failures++;
+}
+
+static void expect_string(const char *what, const char *found,
+        const char *expected)
+{
+    if (strcmp(found, expected) == 0)
+        return;
+
+    printf("%s: expected '%s', found '%s'.\n", what, expected, found);
+    failures++;
+}
+
+/* Call `fn` with the arguments set by mock_set_args. Returns 1 if it raised,
+   with the message in mock_error_message. */
+static int call_raises(lily_state *s, void (*fn)(lily_state *))
+{
+    jmp_buf jump;
+
+    if (setjmp(jump)) {
+        mock_error_jump = NULL;
+        return 1;
+    }
+
+    mock_error_jump = &jump;
+    fn(s);
+    mock_error_jump = NULL;
+    return 0;
+}
+
+static void expect_raise(const char *what, lily_state *s,
+        void (*fn)(lily_state *), const char *expected)
+{
+    if (call_raises(s, fn) == 0) {
+        printf("%s: expected '%s', but nothing was raised.\n", what,
+               expected);
+        failures++;
+        return;
+    }
+
+    expect_string(what, mock_error_message, expected);
+}
+
+static lily_value *string_value(lily_state *s, const char *text)
+{
+    lily_push_string(s, text);
+    lily_return_top(s);
+    return mock_take_result(s);
+}
+
+/* An empty List, for the `values` of Conn.query and similar methods. */
+static lily_value *empty_list_value(lily_state *s)
+{
+    lily_push_list(s, 0);
+    lily_return_top(s);
+    return mock_take_result(s);
+}
+
+static int check_exit(void)
+{
+    if (failures)
+        return EXIT_FAILURE;
+
+    puts("All checks passed.");
+    return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,538 @@
+/* Server-less checks for the binding.
+
+   These build results with PQmakeEmptyPGresult/PQsetvalue, like the synthetic
+   benchmark, and run the binding against the same mock of the Lily api. Each
+   check prints what it found and the run fails if any do not match. */
+
+#include "lily_postgres.c"
+#include "check.h"
+
+/* A Cursor with one column of `type` holding `values` (NULL for null). */
+static lily_value *make_cursor(lily_state *s, Oid type,
+        const char *const *values, int count)
+{
+    PGresult *result = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+    PGresAttDesc attr = {"value", 0, 0, 0, type, -1, -1};
+    int row;
+
+    PQsetResultAttrs(result, 1, &attr);
+
+    for (row = 0;row < count;row++) {
+        const char *value = values[row];
+
+        PQsetvalue(result, row, 0, (char *)value,
+                   value ? (int)strlen(value) : -1);
+    }
+
+    push_cursor(s, result);
+    lily_return_top(s);
+    return mock_take_result(s);
+}
+
+static lily_value *make_double_cursor(lily_state *s, const char **values,
+        int count)
+{
+    return make_cursor(s, FLOAT8OID, values, count);
+}
+
+static void check_histogram(lily_state *s, const char *what,
+        const char **values, int count, int buckets, const int64_t *expected)
+{
+    lily_value *cursor = make_double_cursor(s, values, count);
+    lily_value *column = mock_integer_value(0);
+    lily_value *bucket_count = mock_integer_value(buckets);
+    lily_value *args[] = {cursor, column, bucket_count};
+    char name[128];
+    int i;
+
+    mock_set_args(s, args, 3);
+    lily_postgres_Cursor_histogram(s);
+
+    lily_value *result = mock_take_result(s);
+    lily_container_val *counts = lily_as_container(result);
+
+    expect_integer(what, lily_con_size(counts), buckets);
+
+    for (i = 0;i < buckets && i < lily_con_size(counts);i++) {
+        snprintf(name, sizeof(name), "%s, bucket %d", what, i);
+        expect_integer(name, lily_as_integer(lily_con_get(counts, i)),
+                       expected[i]);
+    }
+
+    mock_free_value(result);
+    free(bucket_count);
+    free(column);
+    mock_free_value(cursor);
+}
+
+static void check_histogram_buckets(lily_state *s, int64_t buckets)
+{
+    const char *values[] = {"1"};
+    lily_value *cursor = make_double_cursor(s, values, 1);
+    lily_value *column = mock_integer_value(0);
+    lily_value *bucket_count = mock_integer_value(buckets);
+    lily_value *args[] = {cursor, column, bucket_count};
+    char expected[64];
+
+    snprintf(expected, sizeof(expected),
+             "ValueError: Bucket count %ld is not valid.", (long)buckets);
+    mock_set_args(s, args, 3);
+    expect_raise(expected, s, lily_postgres_Cursor_histogram, expected);
+    mock_free_value(bucket_count);
+    mock_free_value(column);
+    mock_free_value(cursor);
+}
+
+static void check_histograms(lily_state *s)
+{
+    const char *plain[] = {"0", "1", "2", "3", NULL, "NaN"};
+    const int64_t plain_counts[] = {2, 2};
+
+    check_histogram(s, "histogram", plain, 6, 2, plain_counts);
+
+    const char *infinite[] = {"Infinity", "-Infinity", "0", "10", "4"};
+    const int64_t infinite_counts[] = {2, 1};
+
+    check_histogram(s, "histogram with infinity", infinite, 5, 2,
+                    infinite_counts);
+
+    const char *only_infinite[] = {"Infinity", "-Infinity"};
+    const int64_t only_infinite_counts[] = {0, 0, 0};
+
+    check_histogram(s, "histogram of only infinity", only_infinite, 2, 3,
+                    only_infinite_counts);
+
+    const char *extreme[] = {"-1.7e308", "1.7e308", "0"};
+    const int64_t extreme_counts[] = {1, 2};
+
+    check_histogram(s, "histogram of the whole range", extreme, 3, 2,
+                    extreme_counts);
+
+    check_histogram_buckets(s, 0);
+    check_histogram_buckets(s, INT32_MAX);
+    check_histogram_buckets(s, HISTOGRAM_MAX_BUCKETS + 1);
+}
+
+/* Writing csv to a full disk, or from a closed Cursor, raises. */
+static void check_csv_errors(lily_state *s)
+{
+    const char *values[] = {"1.5", NULL, "2"};
+    lily_value *cursor = make_double_cursor(s, values, 3);
+    FILE *f = fopen("/dev/full", "w");
+
+    if (f == NULL) {
+        puts("Skipping csv checks: /dev/full is not available.");
+        mock_free_value(cursor);
+        return;
+    }
+
+    lily_file_val *file = mock_new_file(f);
+    lily_value *file_value = mock_file_value(file);
+    lily_value *args[] = {cursor, file_value};
+
+    mock_set_args(s, args, 2);
+    expect_raise("csv to a full disk", s, lily_postgres_Cursor_write_csv,
+                 "IOError: Unable to write csv to the file.");
+
+    close_cursor(mock_value_foreign(cursor));
+    mock_set_args(s, args, 2);
+    expect_raise("csv from a closed Cursor", s,
+                 lily_postgres_Cursor_write_csv,
+                 "ValueError: Cursor is closed.");
+
+    fclose(f);
+    free(file);
+    mock_free_value(file_value);
+    mock_free_value(cursor);
+}
+
+/* A field's text, the path for the JSON methods, and what reading it should
+   give: the error raised, "None", or the value in the Some. */
+typedef struct {
+    const char *text;
+    const char *path;
+    const char *expected;
+} field_case;
+
+#define CASE_COUNT(cases) (int)(sizeof(cases) / sizeof(cases[0]))
+
+/* Write `value`, which is read as `kind`, to the end of `out`. Strings in a
+   List are quoted, so that empty strings show. */
+static void describe_value(char *out, size_t size, lily_value *value,
+        int kind, int quote)
+{
+    size_t used = strlen(out);
+
+    out += used;
+    size -= used;
+
+    if (kind == VALUE_BOOLEAN)
+        snprintf(out, size, "%s", lily_as_boolean(value) ? "true" : "false");
+    else if (kind == VALUE_DOUBLE)
+        snprintf(out, size, "%g", lily_as_double(value));
+    else if (kind == VALUE_INTEGER)
+        snprintf(out, size, "%ld", (long)lily_as_integer(value));
+    else if (quote)
+        snprintf(out, size, "\"%s\"", lily_as_string_raw(value));
+    else
+        snprintf(out, size, "%s", lily_as_string_raw(value));
+}
+
+/* Read the only field of a Cursor of `type` holding each case's text with
+   `fn`, which returns an Option of `kind`, or an Option of a List of
+   Option[kind] if `is_list` is set. */
+static void check_fields(lily_state *s, const char *what, Oid type,
+        void (*fn)(lily_state *), int kind, int is_list,
+        const field_case *cases, int count)
+{
+    int i;
+
+    for (i = 0;i < count;i++) {
+        const field_case *c = &cases[i];
+        lily_value *cursor = make_cursor(s, type, &c->text, 1);
+        lily_value *index = mock_integer_value(0);
+        lily_value *path = c->path ? string_value(s, c->path) : NULL;
+        lily_value *args[] = {cursor, index, index, path};
+        char found[256] = "", name[256];
+
+        mock_set_args(s, args, path ? 4 : 3);
+
+        if (call_raises(s, fn))
+            snprintf(found, sizeof(found), "%s", mock_error_message);
+        else {
+            lily_value *result = mock_take_result(s);
+
+            if (mock_is_none(result))
+                strcpy(found, "None");
+            else if (is_list) {
+                lily_container_val *list = lily_as_container(
+                        lily_con_get(lily_as_container(result), 0));
+                int j;
+
+                strcpy(found, "[");
+
+                for (j = 0;j < lily_con_size(list);j++) {
+                    lily_value *element = lily_con_get(list, j);
+
+                    if (j)
+                        strcat(found, ", ");
+
+                    if (mock_is_none(element))
+                        strcat(found, "None");
+                    else
+                        describe_value(found, sizeof(found),
+                                lily_con_get(lily_as_container(element), 0),
+                                kind, 1);
+                }
+
+                strcat(found, "]");
+            }
+            else
+                describe_value(found, sizeof(found),
+                        lily_con_get(lily_as_container(result), 0), kind, 0);
+
+            mock_free_value(result);
+        }
+
+        snprintf(name, sizeof(name), "%s of '%s'%s%s", what,
+                 c->text ? c->text : "NULL", c->path ? " at " : "",
+                 c->path ? c->path : "");
+        expect_string(name, found, c->expected);
+
+        if (path)
+            mock_free_value(path);
+
+        mock_free_value(index);
+        mock_free_value(cursor);
+    }
+}
+
+static void check_arrays(lily_state *s)
+{
+    const field_case strings[] = {
+        {"{a,b,c}", NULL, "[\"a\", \"b\", \"c\"]"},
+        {"{}", NULL, "[]"},
+        {NULL, NULL, "None"},
+        {"{\"a,b\",\"c\\\"d\",\"e\\\\f\"}", NULL,
+         "[\"a,b\", \"c\"d\", \"e\\f\"]"},
+        {"{\"{}\",\"}\"}", NULL, "[\"{}\", \"}\"]"},
+        {"{NULL,\"NULL\"}", NULL, "[None, \"NULL\"]"},
+        {"{\"\",\" \"}", NULL, "[\"\", \" \"]"},
+        {"[0:1]={x,y}", NULL, "[\"x\", \"y\"]"},
+        {"{{a,NULL},{\"b c\",d}}", NULL, "[\"a\", None, \"b c\", \"d\"]"},
+        {"[1:2][1:1]={{1},{2}}", NULL, "[\"1\", \"2\"]"},
+    };
+
+    check_fields(s, "string list", 1009, lily_postgres_Cursor_get_string_list,
+                 VALUE_STRING, 1, strings, CASE_COUNT(strings));
+
+    const field_case integers[] = {
+        {"{1,NULL,-3}", NULL, "[1, None, -3]"},
+        {"[-1:0]={5,6}", NULL, "[5, 6]"},
+        {"{{1,2},{3,4}}", NULL, "[1, 2, 3, 4]"},
+    };
+
+    check_fields(s, "integer list", 1007,
+                 lily_postgres_Cursor_get_integer_list, VALUE_INTEGER, 1,
+                 integers, CASE_COUNT(integers));
+}
+
+static void check_json(lily_state *s)
+{
+    const char *invalid = "ValueError: Field is not valid JSON.";
+    const char *doc = "{\"a\": {\"b\": [10, {\"c\": \"x\"}], \"n\": null}}";
+    const field_case paths[] = {
+        {doc, "a.b.1.c", "\"x\""},
+        {doc, "a.b.0", "10"},
+        {doc, "a.n", "null"},
+        {doc, "a.b.2", "None"},
+        {doc, "a.b.x", "None"},
+        {doc, "a.z", "None"},
+        {doc, "a.b.0.c", "None"},
+        {doc, "", doc},
+        {NULL, "a", "None"},
+        {"[1, [2, 3]]", "1.1", "3"},
+        {"{\"a\\u0062\": 1}", "ab", "1"},
+        {"{\"a\\\"\": 1, \"b\": 2}", "b", "2"},
+        {"{\"a\" 1}", "a", invalid},
+        {"{\"a\": 1", "b", invalid},
+        {"{\"a\": \"x", "a", invalid},
+        {"{\"a\": nope, \"b\": 1}", "b", invalid},
+        {"{\"a\": 1e, \"b\": 1}", "b", invalid},
+        {"{a: 1}", "a", invalid},
+        {"[1, 2", "5", invalid},
+    };
+
+    check_fields(s, "json path", TEXTOID, lily_postgres_Cursor_get_json_path,
+                 VALUE_STRING, 0, paths, CASE_COUNT(paths));
+
+    const char *not_number = "ValueError: JSON value is not a number.";
+    const field_case doubles[] = {
+        {"{\"a\": 1.5e2}", "a", "150"},
+        {"{\"a\": -0.25}", "a", "-0.25"},
+        {"{\"a\": null}", "a", "None"},
+        {"{\"a\": \"1\"}", "a", not_number},
+        {"{\"a\": true}", "a", not_number},
+        {"{\"a\": nan}", "a", invalid},
+        {"{\"a\": null1}", "a", invalid},
+        {"{\"a\": 0x10}", "a", invalid},
+        {"{\"a\": Infinity}", "a", invalid},
+        {"{\"a\": -Infinity}", "a", invalid},
+        {"{\"a\": 1.}", "a", invalid},
+        {"{\"a\": .5}", "a", invalid},
+    };
+
+    check_fields(s, "json double", TEXTOID,
+                 lily_postgres_Cursor_get_json_double, VALUE_DOUBLE, 0,
+                 doubles, CASE_COUNT(doubles));
+
+    const char *not_integer = "ValueError: JSON value is not an Integer.";
+    const field_case integers[] = {
+        {"{\"a\": -42}", "a", "-42"},
+        {"{\"a\": 0}", "a", "0"},
+        {"{\"a\": 1.0}", "a", not_integer},
+        {"{\"a\": 1e3}", "a", not_integer},
+        {"{\"a\": 99999999999999999999}", "a", not_integer},
+        {"{\"a\": 01}", "a", invalid},
+    };
+
+    check_fields(s, "json integer", TEXTOID,
+                 lily_postgres_Cursor_get_json_integer, VALUE_INTEGER, 0,
+                 integers, CASE_COUNT(integers));
+
+    const char *not_boolean = "ValueError: JSON value is not a boolean.";
+    const field_case booleans[] = {
+        {"[true]", "0", "true"},
+        {"[false]", "0", "false"},
+        {"[null]", "0", "None"},
+        {"[\"true\"]", "0", not_boolean},
+        {"[nul]", "0", invalid},
+        {"[truex]", "0", invalid},
+    };
+
+    check_fields(s, "json boolean", TEXTOID,
+                 lily_postgres_Cursor_get_json_boolean, VALUE_BOOLEAN, 0,
+                 booleans, CASE_COUNT(booleans));
+
+    const char *not_string = "ValueError: JSON value is not a string.";
+    const field_case strings[] = {
+        {"{\"a\": \"x\\ty\\u00e9\\ud83d\\ude00\"}", "a",
+         "x\ty\xc3\xa9\xf0\x9f\x98\x80"},
+        {"{\"a\": \"\"}", "a", ""},
+        {"{\"a\": null}", "a", "None"},
+        {"{\"a\": 1}", "a", not_string},
+        {"{\"a\": \"\\q\"}", "a", not_string},
+    };
+
+    check_fields(s, "json string", TEXTOID,
+                 lily_postgres_Cursor_get_json_string, VALUE_STRING, 0,
+                 strings, CASE_COUNT(strings));
+}
+
+static void check_times(lily_state *s)
+{
+    const field_case timestamps[] = {
+        {"1970-01-01 00:00:00", NULL, "0"},
+        {"2000-01-01 12:00:00.5", NULL, "946728000500000"},
+        {"0001-01-01 00:00:00 BC", NULL, "-62167219200000000"},
+        {"0044-03-15 00:00:00 BC", NULL, "-63517824000000000"},
+        {"infinity", NULL, "9223372036854775807"},
+        {"-infinity", NULL, "-9223372036854775808"},
+        {"1999-13-01 00:00:00", NULL,
+         "ValueError: '1999-13-01 00:00:00' is not a valid timestamp."},
+        {"1999-01-01", NULL,
+         "ValueError: '1999-01-01' is not a valid timestamp."},
+    };
+
+    check_fields(s, "timestamp", TIMESTAMPOID,
+                 lily_postgres_Cursor_get_epoch_micros, VALUE_INTEGER, 0,
+                 timestamps, CASE_COUNT(timestamps));
+
+    const field_case zoned[] = {
+        {"1970-01-01 01:00:00+01", NULL, "0"},
+        {"1970-01-01 00:00:00-05:30", NULL, "19800000000"},
+        {"0001-01-01 00:00:00+00 BC", NULL, "-62167219200000000"},
+    };
+
+    check_fields(s, "timestamptz", TIMESTAMPTZOID,
+                 lily_postgres_Cursor_get_epoch_micros, VALUE_INTEGER, 0,
+                 zoned, CASE_COUNT(zoned));
+
+    const field_case dates[] = {
+        {"1970-01-02", NULL, "1"},
+        {"0001-01-01 BC", NULL, "-719528"},
+        {"0001-12-31 BC", NULL, "-719163"},
+        {"infinity", NULL, "9223372036854775807"},
+    };
+
+    check_fields(s, "date", DATEOID, lily_postgres_Cursor_get_date,
+                 VALUE_INTEGER, 0, dates, CASE_COUNT(dates));
+
+    const field_case intervals[] = {
+        {"00:00:00", NULL, "0"},
+        {"1 day -02:00:00", NULL, "79200000000"},
+        {"-1 days +02:03:04.5", NULL, "-79015500000"},
+        {"-00:00:00.5", NULL, "-500000"},
+        {"1 year -2 mons", NULL, "25920000000000"},
+        {"-1 years -2 mons +3 days -04:05:06", NULL, "-36497106000000"},
+        {"1 fortnight", NULL,
+         "ValueError: '1 fortnight' is not a valid interval."},
+        {"", NULL, "ValueError: '' is not a valid interval."},
+    };
+
+    check_fields(s, "interval", INTERVALOID,
+                 lily_postgres_Cursor_get_interval_micros, VALUE_INTEGER, 0,
+                 intervals, CASE_COUNT(intervals));
+}
+
+/* Add rows of different sizes to a row store, and check that what memory and
+   the offsets have allocated stays within the limit after every row. */
+static void check_row_store_limit(uint64_t limit)
+{
+    PGresAttDesc attrs[] = {
+        {"id", 0, 0, 0, TEXTOID, -1, -1},
+        {"note", 0, 0, 0, TEXTOID, -1, -1},
+    };
+    char text[128], what[64];
+    row_store *store = NULL;
+    int row;
+
+    snprintf(what, sizeof(what), "row store with a limit of %ld",
+             (long)limit);
+
+    for (row = 0;row < 2000;row++) {
+        PGresult *result = PQmakeEmptyPGresult(NULL, PGRES_SINGLE_TUPLE);
+
+        PQsetResultAttrs(result, 2, attrs);
+        snprintf(text, sizeof(text), "%d", row);
+        PQsetvalue(result, 0, 0, text, (int)strlen(text));
+        memset(text, 'x', row % 100);
+        PQsetvalue(result, 0, 1, text, row % 100);
+
+        if (store == NULL)
+            store = new_row_store(result, limit);
+
+        expect_integer(what, row_store_add(store, result), 1);
+        PQclear(result);
+
+        uint64_t allocated = store->row_space * sizeof(uint64_t);
+
+        /* Once rows spill, memory also holds the row being built. */
+        if (store->spill == NULL)
+            allocated += store->memory_size;
+
+        if (allocated > limit) {
+            printf("%s: %ld bytes allocated at row %d.\n", what,
+                   (long)allocated, row);
+            failures++;
+            break;
+        }
+    }
+
+    expect_integer(what, row_store_finish(store), 1);
+    expect_integer(what, store->row_count, 2000);
+    free_row_store(store);
+}
+
+static void check_row_stores(void)
+{
+    check_row_store_limit(0);
+    check_row_store_limit(100);
+    check_row_store_limit(5000);
+    check_row_store_limit(70000);
+    check_row_store_limit(1 << 20);
+}
+
+#define RESERVE_THREADS 8
+#define RESERVE_LIMIT 1000
+
+static _Atomic int reserved_count;
+
+static void *reserve_loop(void *data)
+{
+    int i;
+
+    for (i = 0;i < RESERVE_LIMIT;i++)
+        if (reserve_result_bytes(1))
+            atomic_fetch_add(&reserved_count, 1);
+
+    return NULL;
+}
+
+/* Threads that reserve at the same time must not pass the limit together. */
+static void check_reserve_threads(void)
+{
+    pthread_t threads[RESERVE_THREADS];
+    uint64_t base = live_result_bytes;
+    int i;
+
+    result_byte_limit = base + RESERVE_LIMIT;
+
+    for (i = 0;i < RESERVE_THREADS;i++)
+        pthread_create(&threads[i], NULL, reserve_loop, NULL);
+
+    for (i = 0;i < RESERVE_THREADS;i++)
+        pthread_join(threads[i], NULL);
+
+    expect_integer("reservations from threads", reserved_count,
+                   RESERVE_LIMIT);
+    expect_integer("bytes reserved from threads", live_result_bytes - base,
+                   RESERVE_LIMIT);
+    live_result_bytes -= RESERVE_LIMIT;
+    result_byte_limit = 0;
+}
+
+int main(void)
+{
+    lily_state *s = mock_new_state();
+
+    check_histograms(s);
+    check_arrays(s);
+    check_json(s);
+    check_times(s);
+    check_row_stores();
+    check_csv_errors(s);
+    check_reserve_threads();
+    mock_free_state(s);
+    return check_exit();
+}
@@ -0,0 +1,135 @@
+/* A stand-in for lily.h, used only by the synthetic benchmark.
+
+   This implements just enough of the Lily api for the binding's functions to
+   run outside of an interpreter. Values are plain structs that are freed as
+   soon as they leave the stack, and every allocation made on behalf of a value
+   is counted so that the benchmark can report allocations per row. */
+
+#ifndef LILY_MOCK_H
+# define LILY_MOCK_H
+
+# include <setjmp.h>
+# include <stdint.h>
+# include <stdio.h>
+
+typedef struct lily_state_ lily_state;
+typedef struct lily_value_ lily_value;
+typedef struct lily_container_val_ lily_container_val;
+typedef struct lily_string_val_ lily_string_val;
+typedef struct lily_string_val_ lily_bytestring_val;
+typedef struct lily_function_val_ lily_function_val;
+typedef struct lily_file_val_ lily_file_val;
+typedef struct lily_msgbuf_ lily_msgbuf;
+
+typedef void (*lily_destroy_func)(void *);
+typedef void (*lily_call_entry_func)(lily_state *);
+
+# define LILY_FOREIGN_HEADER \
+    uint32_t refcount; \
+    uint16_t class_id; \
+    uint16_t do_not_use; \
+    lily_destroy_func destroy_func;
+
+/* Mock-only: Functions called through lily_call are C functions that receive
+   the arguments pushed before the call. */
+typedef void (*mock_function)(lily_state *, lily_value **, int);
+
+struct lily_function_val_ {
+    mock_function func;
+};
+
+lily_state *mock_new_state(void);
+void mock_free_state(lily_state *);
+void mock_set_args(lily_state *, lily_value **, int);
+lily_value *mock_foreign_value(void *);
+lily_value *mock_function_value(lily_function_val *);
+lily_value *mock_integer_value(int64_t);
+lily_file_val *mock_new_file(FILE *);
+lily_value *mock_file_value(lily_file_val *);
+void mock_free_value(lily_value *);
+lily_value *mock_take_result(lily_state *);
+void *mock_value_foreign(lily_value *);
+int mock_is_none(lily_value *);
+int mock_is_failure(lily_value *);
+uint64_t mock_allocation_count(void);
+
+/* Mock-only: Raising an error writes its message to `mock_error_message`. If
+   `mock_error_jump` is set, it is cleared and jumped to. Otherwise, the
+   message is printed and the program exits. */
+extern jmp_buf *mock_error_jump;
+extern char mock_error_message[256];
+
+uint16_t lily_cid_at(lily_state *, int);
+void *lily_push_foreign(lily_state *, uint16_t, lily_destroy_func, size_t);
+
+int lily_arg_count(lily_state *);
+void *lily_arg_generic(lily_state *, int);
+int lily_arg_boolean(lily_state *, int);
+lily_bytestring_val *lily_arg_bytestring(lily_state *, int);
+lily_container_val *lily_arg_container(lily_state *, int);
+double lily_arg_double(lily_state *, int);
+lily_file_val *lily_arg_file(lily_state *, int);
+lily_function_val *lily_arg_function(lily_state *, int);
+int64_t lily_arg_integer(lily_state *, int);
+lily_string_val *lily_arg_string(lily_state *, int);
+char *lily_arg_string_raw(lily_state *, int);
+lily_value *lily_arg_value(lily_state *, int);
+
+int lily_as_boolean(lily_value *);
+lily_container_val *lily_as_container(lily_value *);
+double lily_as_double(lily_value *);
+int64_t lily_as_integer(lily_value *);
+char *lily_as_string_raw(lily_value *);
+
+char *lily_bytestring_raw(lily_bytestring_val *);
+int lily_bytestring_length(lily_bytestring_val *);
+char *lily_string_raw(lily_string_val *);
+int lily_string_length(lily_string_val *);
+FILE *lily_file_for_write(lily_state *, lily_file_val *);
+
+void lily_push_boolean(lily_state *, int);
+void lily_push_bytestring(lily_state *, const char *, int);
+void lily_push_double(lily_state *, double);
+void lily_push_integer(lily_state *, int64_t);
+lily_container_val *lily_push_list(lily_state *, int);
+void lily_push_none(lily_state *);
+lily_container_val *lily_push_some(lily_state *);
+lily_container_val *lily_push_failure(lily_state *);
+lily_container_val *lily_push_success(lily_state *);
+lily_container_val *lily_push_tuple(lily_state *, int);
+void lily_push_string(lily_state *, const char *);
+void lily_push_string_sized(lily_state *, const char *, int);
+void lily_push_unit(lily_state *);
+
+lily_value *lily_con_get(lily_container_val *, int);
+void lily_con_set_from_stack(lily_state *, lily_container_val *, int);
+int lily_con_size(lily_container_val *);
+
+void lily_return_boolean(lily_state *, int);
+void lily_return_double(lily_state *, double);
+void lily_return_integer(lily_state *, int64_t);
+void lily_return_none(lily_state *);
+void lily_return_top(lily_state *);
+void lily_return_unit(lily_state *);
+
+void lily_stack_drop_top(lily_state *);
+
+void lily_call_prepare(lily_state *, lily_function_val *);
+void lily_call(lily_state *, int);
+lily_value *lily_call_result(lily_state *);
+void mock_call_return(lily_state *, lily_value *);
+
+lily_msgbuf *lily_msgbuf_get(lily_state *);
+void lily_mb_add(lily_msgbuf *, const char *);
+void lily_mb_add_char(lily_msgbuf *, char);
+void lily_mb_add_fmt(lily_msgbuf *, const char *, ...);
+void lily_mb_add_slice(lily_msgbuf *, const char *, int, int);
+void lily_mb_flush(lily_msgbuf *);
+const char *lily_mb_raw(lily_msgbuf *);
+
+void lily_IndexError(lily_state *, const char *, ...);
+void lily_IOError(lily_state *, const char *, ...);
+void lily_RuntimeError(lily_state *, const char *, ...);
+void lily_ValueError(lily_state *, const char *, ...);
+
+#endif
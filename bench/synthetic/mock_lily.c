@@ -0,0 +1,637 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lily.h"
+
+enum {
+    V_UNIT,
+    V_INTEGER,
+    V_DOUBLE,
+    V_BOOLEAN,
+    V_STRING,
+    V_BYTESTRING,
+    V_CONTAINER,
+    V_SOME,
+    V_SUCCESS,
+    V_FAILURE,
+    V_NONE,
+    V_FOREIGN,
+    V_FUNCTION,
+    V_FILE
+};
+
+typedef struct {
+    LILY_FOREIGN_HEADER
+} mock_foreign;
+
+struct lily_string_val_ {
+    int size;
+    char *string;
+};
+
+struct lily_container_val_ {
+    int num_values;
+    lily_value **values;
+};
+
+struct lily_file_val_ {
+    FILE *inner_file;
+};
+
+struct lily_value_ {
+    int kind;
+    union {
+        int64_t integer;
+        double doubleval;
+        lily_string_val *string;
+        lily_container_val *container;
+        mock_foreign *foreign;
+        lily_function_val *function;
+        lily_file_val *file;
+    } value;
+};
+
+struct lily_msgbuf_ {
+    char *buffer;
+    int pos;
+    int size;
+};
+
+#define STACK_SIZE 256
+
+struct lily_state_ {
+    lily_value *stack[STACK_SIZE];
+    int top;
+    lily_value **args;
+    int arg_count;
+    lily_value *result;
+    lily_value *call_result;
+    lily_function_val *call_function;
+    lily_msgbuf msgbuf;
+};
+
+/* Each thread counts its own, so that checks can run the binding on several
+   threads at once. */
+static _Thread_local uint64_t allocations = 0;
+
+static void *mock_malloc(size_t size)
+{
+    allocations++;
+    return malloc(size);
+}
+
+uint64_t mock_allocation_count(void)
+{
+    return allocations;
+}
+
+jmp_buf *mock_error_jump = NULL;
+char mock_error_message[256];
+
+static void mock_raise(void)
+{
+    jmp_buf *jump = mock_error_jump;
+
+    if (jump == NULL) {
+        fprintf(stderr, "%s\n", mock_error_message);
+        exit(EXIT_FAILURE);
+    }
+
+    mock_error_jump = NULL;
+    longjmp(*jump, 1);
+}
+
+#define MOCK_ERROR(name) \
+void lily_##name(lily_state *s, const char *fmt, ...) \
+{ \
+    va_list ap; \
+    int size = snprintf(mock_error_message, sizeof(mock_error_message), \
+                        "%s: ", #name); \
+    va_start(ap, fmt); \
+    vsnprintf(mock_error_message + size, sizeof(mock_error_message) - size, \
+              fmt, ap); \
+    va_end(ap); \
+    mock_raise(); \
+}
+
+MOCK_ERROR(IndexError)
+MOCK_ERROR(IOError)
+MOCK_ERROR(RuntimeError)
+MOCK_ERROR(ValueError)
+
+static lily_value *new_value(int kind)
+{
+    lily_value *v = mock_malloc(sizeof(*v));
+    v->kind = kind;
+    return v;
+}
+
+static lily_string_val *new_string(const char *source, int size)
+{
+    lily_string_val *sv = mock_malloc(sizeof(*sv));
+    sv->string = mock_malloc(size + 1);
+    memcpy(sv->string, source, size);
+    sv->string[size] = '\0';
+    sv->size = size;
+    return sv;
+}
+
+static lily_container_val *new_container(int size)
+{
+    lily_container_val *cv = mock_malloc(sizeof(*cv));
+    cv->num_values = size;
+    cv->values = mock_malloc(size * sizeof(*cv->values));
+
+    int i;
+    for (i = 0;i < size;i++)
+        cv->values[i] = NULL;
+
+    return cv;
+}
+
+void mock_free_value(lily_value *v)
+{
+    if (v == NULL)
+        return;
+
+    switch (v->kind) {
+        case V_STRING:
+        case V_BYTESTRING:
+            free(v->value.string->string);
+            free(v->value.string);
+            break;
+        case V_CONTAINER:
+        case V_SOME:
+        case V_SUCCESS:
+        case V_FAILURE: {
+            lily_container_val *cv = v->value.container;
+            int i;
+            for (i = 0;i < cv->num_values;i++)
+                mock_free_value(cv->values[i]);
+
+            free(cv->values);
+            free(cv);
+            break;
+        }
+        case V_FOREIGN:
+            v->value.foreign->destroy_func(v->value.foreign);
+            free(v->value.foreign);
+            break;
+        default:
+            break;
+    }
+
+    free(v);
+}
+
+lily_state *mock_new_state(void)
+{
+    lily_state *s = calloc(1, sizeof(*s));
+
+    s->msgbuf.size = 64;
+    s->msgbuf.buffer = malloc(s->msgbuf.size);
+    s->msgbuf.buffer[0] = '\0';
+    return s;
+}
+
+void mock_free_state(lily_state *s)
+{
+    while (s->top)
+        lily_stack_drop_top(s);
+
+    mock_free_value(s->result);
+    mock_free_value(s->call_result);
+    free(s->msgbuf.buffer);
+    free(s);
+}
+
+void mock_set_args(lily_state *s, lily_value **args, int count)
+{
+    s->args = args;
+    s->arg_count = count;
+}
+
+lily_value *mock_foreign_value(void *foreign)
+{
+    lily_value *v = new_value(V_FOREIGN);
+    v->value.foreign = foreign;
+    return v;
+}
+
+lily_value *mock_function_value(lily_function_val *function)
+{
+    lily_value *v = new_value(V_FUNCTION);
+    v->value.function = function;
+    return v;
+}
+
+lily_value *mock_integer_value(int64_t i)
+{
+    lily_value *v = new_value(V_INTEGER);
+    v->value.integer = i;
+    return v;
+}
+
+lily_file_val *mock_new_file(FILE *f)
+{
+    lily_file_val *file = malloc(sizeof(*file));
+    file->inner_file = f;
+    return file;
+}
+
+lily_value *mock_file_value(lily_file_val *file)
+{
+    lily_value *v = new_value(V_FILE);
+    v->value.file = file;
+    return v;
+}
+
+void *mock_value_foreign(lily_value *v)
+{
+    return v->value.foreign;
+}
+
+int mock_is_none(lily_value *v)
+{
+    return v->kind == V_NONE;
+}
+
+int mock_is_failure(lily_value *v)
+{
+    return v->kind == V_FAILURE;
+}
+
+lily_value *mock_take_result(lily_state *s)
+{
+    lily_value *result = s->result;
+    s->result = NULL;
+    return result;
+}
+
+static void push(lily_state *s, lily_value *v)
+{
+    if (s->top == STACK_SIZE)
+        lily_RuntimeError(s, "Mock stack overflow.");
+
+    s->stack[s->top] = v;
+    s->top++;
+}
+
+static lily_value *pop(lily_state *s)
+{
+    s->top--;
+    return s->stack[s->top];
+}
+
+uint16_t lily_cid_at(lily_state *s, int index)
+{
+    return (uint16_t)index;
+}
+
+void *lily_push_foreign(lily_state *s, uint16_t id, lily_destroy_func func,
+        size_t size)
+{
+    mock_foreign *f = mock_malloc(size);
+    f->refcount = 1;
+    f->class_id = id;
+    f->destroy_func = func;
+    push(s, mock_foreign_value(f));
+    return f;
+}
+
+int lily_arg_count(lily_state *s)
+{
+    return s->arg_count;
+}
+
+lily_value *lily_arg_value(lily_state *s, int index)
+{
+    return s->args[index];
+}
+
+void *lily_arg_generic(lily_state *s, int index)
+{
+    return s->args[index]->value.foreign;
+}
+
+int lily_arg_boolean(lily_state *s, int index)
+{
+    return (int)s->args[index]->value.integer;
+}
+
+lily_bytestring_val *lily_arg_bytestring(lily_state *s, int index)
+{
+    return s->args[index]->value.string;
+}
+
+lily_container_val *lily_arg_container(lily_state *s, int index)
+{
+    return s->args[index]->value.container;
+}
+
+double lily_arg_double(lily_state *s, int index)
+{
+    return s->args[index]->value.doubleval;
+}
+
+lily_file_val *lily_arg_file(lily_state *s, int index)
+{
+    return s->args[index]->value.file;
+}
+
+lily_function_val *lily_arg_function(lily_state *s, int index)
+{
+    return s->args[index]->value.function;
+}
+
+int64_t lily_arg_integer(lily_state *s, int index)
+{
+    return s->args[index]->value.integer;
+}
+
+lily_string_val *lily_arg_string(lily_state *s, int index)
+{
+    return s->args[index]->value.string;
+}
+
+char *lily_arg_string_raw(lily_state *s, int index)
+{
+    return s->args[index]->value.string->string;
+}
+
+int lily_as_boolean(lily_value *v)
+{
+    return (int)v->value.integer;
+}
+
+lily_container_val *lily_as_container(lily_value *v)
+{
+    return v->value.container;
+}
+
+double lily_as_double(lily_value *v)
+{
+    return v->value.doubleval;
+}
+
+int64_t lily_as_integer(lily_value *v)
+{
+    return v->value.integer;
+}
+
+char *lily_as_string_raw(lily_value *v)
+{
+    return v->value.string->string;
+}
+
+char *lily_bytestring_raw(lily_bytestring_val *bv)
+{
+    return bv->string;
+}
+
+int lily_bytestring_length(lily_bytestring_val *bv)
+{
+    return bv->size;
+}
+
+char *lily_string_raw(lily_string_val *sv)
+{
+    return sv->string;
+}
+
+int lily_string_length(lily_string_val *sv)
+{
+    return sv->size;
+}
+
+FILE *lily_file_for_write(lily_state *s, lily_file_val *file)
+{
+    return file->inner_file;
+}
+
+void lily_push_boolean(lily_state *s, int b)
+{
+    lily_value *v = new_value(V_BOOLEAN);
+    v->value.integer = b;
+    push(s, v);
+}
+
+void lily_push_bytestring(lily_state *s, const char *source, int size)
+{
+    lily_value *v = new_value(V_BYTESTRING);
+    v->value.string = new_string(source, size);
+    push(s, v);
+}
+
+void lily_push_double(lily_state *s, double d)
+{
+    lily_value *v = new_value(V_DOUBLE);
+    v->value.doubleval = d;
+    push(s, v);
+}
+
+void lily_push_integer(lily_state *s, int64_t i)
+{
+    push(s, mock_integer_value(i));
+}
+
+static lily_container_val *push_container(lily_state *s, int kind, int size)
+{
+    lily_value *v = new_value(kind);
+    v->value.container = new_container(size);
+    push(s, v);
+    return v->value.container;
+}
+
+lily_container_val *lily_push_list(lily_state *s, int size)
+{
+    return push_container(s, V_CONTAINER, size);
+}
+
+void lily_push_none(lily_state *s)
+{
+    push(s, new_value(V_NONE));
+}
+
+lily_container_val *lily_push_some(lily_state *s)
+{
+    return push_container(s, V_SOME, 1);
+}
+
+lily_container_val *lily_push_failure(lily_state *s)
+{
+    return push_container(s, V_FAILURE, 1);
+}
+
+lily_container_val *lily_push_success(lily_state *s)
+{
+    return push_container(s, V_SUCCESS, 1);
+}
+
+lily_container_val *lily_push_tuple(lily_state *s, int size)
+{
+    return lily_push_list(s, size);
+}
+
+void lily_push_string(lily_state *s, const char *source)
+{
+    lily_push_string_sized(s, source, strlen(source));
+}
+
+void lily_push_string_sized(lily_state *s, const char *source, int size)
+{
+    lily_value *v = new_value(V_STRING);
+    v->value.string = new_string(source, size);
+    push(s, v);
+}
+
+void lily_push_unit(lily_state *s)
+{
+    push(s, new_value(V_UNIT));
+}
+
+lily_value *lily_con_get(lily_container_val *cv, int index)
+{
+    return cv->values[index];
+}
+
+void lily_con_set_from_stack(lily_state *s, lily_container_val *cv, int index)
+{
+    mock_free_value(cv->values[index]);
+    cv->values[index] = pop(s);
+}
+
+int lily_con_size(lily_container_val *cv)
+{
+    return cv->num_values;
+}
+
+static void set_result(lily_state *s, lily_value *v)
+{
+    mock_free_value(s->result);
+    s->result = v;
+}
+
+void lily_return_boolean(lily_state *s, int b)
+{
+    lily_push_boolean(s, b);
+    set_result(s, pop(s));
+}
+
+void lily_return_double(lily_state *s, double d)
+{
+    lily_push_double(s, d);
+    set_result(s, pop(s));
+}
+
+void lily_return_integer(lily_state *s, int64_t i)
+{
+    set_result(s, mock_integer_value(i));
+}
+
+void lily_return_none(lily_state *s)
+{
+    set_result(s, new_value(V_NONE));
+}
+
+void lily_return_top(lily_state *s)
+{
+    set_result(s, pop(s));
+}
+
+void lily_return_unit(lily_state *s)
+{
+    set_result(s, new_value(V_UNIT));
+}
+
+void lily_stack_drop_top(lily_state *s)
+{
+    mock_free_value(pop(s));
+}
+
+void lily_call_prepare(lily_state *s, lily_function_val *function)
+{
+    s->call_function = function;
+}
+
+void lily_call(lily_state *s, int count)
+{
+    lily_value **args = s->stack + s->top - count;
+
+    s->call_function->func(s, args, count);
+
+    while (count) {
+        lily_stack_drop_top(s);
+        count--;
+    }
+}
+
+void mock_call_return(lily_state *s, lily_value *v)
+{
+    mock_free_value(s->call_result);
+    s->call_result = v;
+}
+
+lily_value *lily_call_result(lily_state *s)
+{
+    return s->call_result;
+}
+
+static void mb_reserve(lily_msgbuf *msgbuf, int extra)
+{
+    while (msgbuf->pos + extra + 1 > msgbuf->size) {
+        msgbuf->size *= 2;
+        msgbuf->buffer = realloc(msgbuf->buffer, msgbuf->size);
+    }
+}
+
+lily_msgbuf *lily_msgbuf_get(lily_state *s)
+{
+    lily_mb_flush(&s->msgbuf);
+    return &s->msgbuf;
+}
+
+void lily_mb_add_slice(lily_msgbuf *msgbuf, const char *text, int start,
+        int stop)
+{
+    int size = stop - start;
+
+    mb_reserve(msgbuf, size);
+    memcpy(msgbuf->buffer + msgbuf->pos, text + start, size);
+    msgbuf->pos += size;
+    msgbuf->buffer[msgbuf->pos] = '\0';
+}
+
+void lily_mb_add(lily_msgbuf *msgbuf, const char *text)
+{
+    lily_mb_add_slice(msgbuf, text, 0, strlen(text));
+}
+
+void lily_mb_add_char(lily_msgbuf *msgbuf, char ch)
+{
+    lily_mb_add_slice(msgbuf, &ch, 0, 1);
+}
+
+void lily_mb_add_fmt(lily_msgbuf *msgbuf, const char *fmt, ...)
+{
+    char buffer[256];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, ap);
+    va_end(ap);
+    lily_mb_add(msgbuf, buffer);
+}
+
+void lily_mb_flush(lily_msgbuf *msgbuf)
+{
+    msgbuf->pos = 0;
+    msgbuf->buffer[0] = '\0';
+}
+
+const char *lily_mb_raw(lily_msgbuf *msgbuf)
+{
+    return msgbuf->buffer;
+}
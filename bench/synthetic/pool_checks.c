@@ -0,0 +1,320 @@
+/* Server-less checks for the pool behind Conn.borrow and Conn.release.
+
+   The libpq calls that the pool makes are defined here, so connections are
+   fakes that only count how they were used. The last check borrows and
+   releases from several threads at once. Building with -fsanitize=thread
+   checks the pool's locking. */
+
+#include <stdatomic.h>
+
+#include "lily_postgres.c"
+#include "check.h"
+
+typedef struct {
+    int in_transaction;
+    int discard_fails;
+    /* Set while a check holds this connection through a Conn. */
+    _Atomic int held;
+} fake_conn;
+
+static _Atomic int opened;
+static _Atomic int closed;
+static _Atomic int discards;
+
+PGconn *PQsetdbLogin(const char *pghost, const char *pgport,
+        const char *pgoptions, const char *pgtty, const char *dbName,
+        const char *login, const char *pwd)
+{
+    atomic_fetch_add(&opened, 1);
+    return (PGconn *)calloc(1, sizeof(fake_conn));
+}
+
+ConnStatusType PQstatus(const PGconn *conn)
+{
+    return conn ? CONNECTION_OK : CONNECTION_BAD;
+}
+
+PGTransactionStatusType PQtransactionStatus(const PGconn *conn)
+{
+    return ((fake_conn *)conn)->in_transaction ? PQTRANS_INTRANS
+                                               : PQTRANS_IDLE;
+}
+
+void PQfinish(PGconn *conn)
+{
+    if (conn == NULL)
+        return;
+
+    atomic_fetch_add(&closed, 1);
+    free(conn);
+}
+
+PGresult *PQexec(PGconn *conn, const char *query)
+{
+    ExecStatusType status = PGRES_FATAL_ERROR;
+
+    if (strcmp(query, "DISCARD ALL") == 0) {
+        atomic_fetch_add(&discards, 1);
+
+        if (((fake_conn *)conn)->discard_fails == 0)
+            status = PGRES_COMMAND_OK;
+    }
+
+    return PQmakeEmptyPGresult(NULL, status);
+}
+
+/* Returns the result of Conn.borrow for `dbname`, which must be a Success. */
+static lily_value *borrow(lily_state *s, const char *dbname)
+{
+    lily_value *host = string_value(s, "");
+    lily_value *port = string_value(s, "");
+    lily_value *db = string_value(s, dbname);
+    lily_value *args[] = {host, port, db};
+
+    mock_set_args(s, args, 3);
+    lily_postgres_Conn_borrow(s);
+    mock_free_value(db);
+    mock_free_value(port);
+    mock_free_value(host);
+    return mock_take_result(s);
+}
+
+/* The Conn inside a result from borrow. */
+static lily_value *conn_of(lily_value *result)
+{
+    return lily_con_get(lily_as_container(result), 0);
+}
+
+static fake_conn *fake_of(lily_value *result)
+{
+    lily_postgres_Conn *conn_value = mock_value_foreign(conn_of(result));
+
+    return (fake_conn *)conn_value->conn;
+}
+
+static void release(lily_state *s, lily_value *result)
+{
+    lily_value *args[] = {conn_of(result)};
+
+    mock_set_args(s, args, 1);
+    lily_postgres_Conn_release(s);
+    mock_free_value(mock_take_result(s));
+}
+
+static void set_pool_size(lily_state *s, int64_t size)
+{
+    lily_value *size_value = mock_integer_value(size);
+    lily_value *args[] = {size_value};
+
+    mock_set_args(s, args, 1);
+    lily_postgres_Conn_set_pool_size(s);
+    mock_free_value(mock_take_result(s));
+    mock_free_value(size_value);
+}
+
+/* Returns one of the numbers from Conn.pool_stats. */
+static int64_t pool_stat(lily_state *s, int index)
+{
+    mock_set_args(s, NULL, 0);
+    lily_postgres_Conn_pool_stats(s);
+
+    lily_value *stats = mock_take_result(s);
+    int64_t result = lily_as_integer(lily_con_get(lily_as_container(stats),
+            index));
+
+    mock_free_value(stats);
+    return result;
+}
+
+#define STAT_BORROWS 0
+#define STAT_REUSES 1
+#define STAT_IDLE 2
+
+static void check_reuse(lily_state *s)
+{
+    int64_t reuses = pool_stat(s, STAT_REUSES);
+    lily_value *first = borrow(s, "one");
+    fake_conn *fake = fake_of(first);
+
+    expect_integer("reuse, opened", atomic_load(&opened), 1);
+    release(s, first);
+    expect_integer("reuse, idle", pool_stat(s, STAT_IDLE), 1);
+
+    /* Releasing again, or querying through a released Conn, does nothing. */
+    release(s, first);
+    expect_integer("reuse, second release", pool_stat(s, STAT_IDLE), 1);
+
+    lily_value *sql = string_value(s, "select 1");
+    lily_value *args[] = {conn_of(first), sql};
+
+    mock_set_args(s, args, 2);
+    lily_postgres_Conn_query_all(s);
+
+    lily_value *query_result = mock_take_result(s);
+
+    expect_integer("reuse, query after release",
+                   mock_is_failure(query_result), 1);
+    expect_string("reuse, query after release",
+                  lily_as_string_raw(lily_con_get(
+                          lily_as_container(query_result), 0)),
+                  "Conn is closed.\n");
+    mock_free_value(query_result);
+    mock_free_value(sql);
+
+    lily_value *second = borrow(s, "one");
+
+    expect_integer("reuse, same connection", fake_of(second) == fake, 1);
+    expect_integer("reuse, opened after reuse", atomic_load(&opened), 1);
+    expect_integer("reuse, reuses", pool_stat(s, STAT_REUSES), reuses + 1);
+
+    /* A connection is only reused for the same values. */
+    lily_value *other = borrow(s, "two");
+
+    expect_integer("reuse, other database", fake_of(other) != fake, 1);
+    expect_integer("reuse, opened for other", atomic_load(&opened), 2);
+
+    /* A Conn destroyed without a release gives its connection back. */
+    mock_free_value(second);
+    mock_free_value(other);
+    mock_free_value(first);
+    expect_integer("reuse, idle after destroy", pool_stat(s, STAT_IDLE), 2);
+    expect_integer("reuse, closed", atomic_load(&closed), 0);
+    set_pool_size(s, 0);
+}
+
+static void check_discard(lily_state *s)
+{
+    int start_closed = atomic_load(&closed);
+    int start_discards = atomic_load(&discards);
+    lily_value *result;
+
+    set_pool_size(s, 8);
+
+    /* A connection in a transaction is closed without DISCARD ALL. */
+    result = borrow(s, "one");
+    fake_of(result)->in_transaction = 1;
+    release(s, result);
+    mock_free_value(result);
+    expect_integer("in transaction, idle", pool_stat(s, STAT_IDLE), 0);
+    expect_integer("in transaction, closed", atomic_load(&closed),
+                   start_closed + 1);
+    expect_integer("in transaction, discards", atomic_load(&discards),
+                   start_discards);
+
+    /* So is one where DISCARD ALL fails. */
+    result = borrow(s, "one");
+    fake_of(result)->discard_fails = 1;
+    release(s, result);
+    mock_free_value(result);
+    expect_integer("discard fails, idle", pool_stat(s, STAT_IDLE), 0);
+    expect_integer("discard fails, closed", atomic_load(&closed),
+                   start_closed + 2);
+    expect_integer("discard fails, discards", atomic_load(&discards),
+                   start_discards + 1);
+}
+
+static void check_limit(lily_state *s)
+{
+    lily_value *results[3];
+    int start_closed = atomic_load(&closed);
+    int i;
+
+    set_pool_size(s, 2);
+
+    for (i = 0;i < 3;i++)
+        results[i] = borrow(s, "one");
+
+    for (i = 0;i < 3;i++) {
+        release(s, results[i]);
+        mock_free_value(results[i]);
+    }
+
+    expect_integer("idle limit, idle", pool_stat(s, STAT_IDLE), 2);
+    expect_integer("idle limit, closed", atomic_load(&closed),
+                   start_closed + 1);
+
+    set_pool_size(s, 1);
+    expect_integer("trim to 1, idle", pool_stat(s, STAT_IDLE), 1);
+    expect_integer("trim to 1, closed", atomic_load(&closed),
+                   start_closed + 2);
+
+    set_pool_size(s, 0);
+    expect_integer("trim to 0, idle", pool_stat(s, STAT_IDLE), 0);
+    expect_integer("trim to 0, closed", atomic_load(&closed),
+                   start_closed + 3);
+
+    lily_value *size_value = mock_integer_value(-1);
+    lily_value *args[] = {size_value};
+
+    mock_set_args(s, args, 1);
+    expect_raise("negative size", s, lily_postgres_Conn_set_pool_size,
+                 "ValueError: size must not be negative.");
+    mock_free_value(size_value);
+}
+
+#define THREAD_COUNT 8
+#define THREAD_LOOPS 2000
+
+static _Atomic int shared_holds;
+
+/* Each thread has its own interpreter, like interpreters on different threads
+   sharing the pool. */
+static void *borrow_loop(void *data)
+{
+    lily_state *s = mock_new_state();
+    int i;
+
+    for (i = 0;i < THREAD_LOOPS;i++) {
+        lily_value *result = borrow(s, "shared");
+        fake_conn *fake = fake_of(result);
+
+        if (atomic_exchange(&fake->held, 1))
+            atomic_fetch_add(&shared_holds, 1);
+
+        atomic_store(&fake->held, 0);
+        release(s, result);
+        mock_free_value(result);
+    }
+
+    mock_free_state(s);
+    return NULL;
+}
+
+static void check_threads(lily_state *s)
+{
+    pthread_t threads[THREAD_COUNT];
+    int64_t borrows = pool_stat(s, STAT_BORROWS);
+    int i;
+
+    set_pool_size(s, 4);
+
+    for (i = 0;i < THREAD_COUNT;i++)
+        pthread_create(&threads[i], NULL, borrow_loop, NULL);
+
+    for (i = 0;i < THREAD_COUNT;i++)
+        pthread_join(threads[i], NULL);
+
+    expect_integer("threads, shared connections",
+                   atomic_load(&shared_holds), 0);
+    expect_integer("threads, borrows", pool_stat(s, STAT_BORROWS),
+                   borrows + THREAD_COUNT * THREAD_LOOPS);
+    expect_integer("threads, open connections",
+                   atomic_load(&opened) - atomic_load(&closed),
+                   pool_stat(s, STAT_IDLE));
+
+    set_pool_size(s, 0);
+    expect_integer("threads, all closed",
+                   atomic_load(&opened) - atomic_load(&closed), 0);
+}
+
+int main(void)
+{
+    lily_state *s = mock_new_state();
+
+    check_reuse(s);
+    check_discard(s);
+    check_limit(s);
+    check_threads(s);
+    mock_free_state(s);
+    return check_exit();
+}
@@ -0,0 +1,473 @@
+/* Server-less checks for Conn.stream, and for the other queries that read each
+   result with PQgetResult.
+
+   The libpq functions that those use to talk to a server are defined here, so
+   the binding calls these instead of libpq's own. They act as a server that
+   returns a row at a time, and that can fail partway through, be cancelled, or
+   start a COPY. Building with -fsanitize=thread checks the queue between the
+   stream's I/O thread and the Lily thread. */
+
+#include <stdatomic.h>
+
+#include "lily_postgres.c"
+#include "check.h"
+
+enum {
+    SERVER_IDLE,
+    SERVER_ROWS,
+    SERVER_COPY,
+    SERVER_COPY_FAILED,
+    SERVER_COPY_DONE
+};
+
+/* Once a query is sent, only the thread reading results uses these, except
+   for `cancelled`. */
+static struct {
+    int state;
+    int row_count;
+    int fail_at;
+    ExecStatusType copy_status;
+    int rows_sent;
+    int copy_ended;
+    int live_cancels;
+    const char *error;
+    _Atomic int cancelled;
+} server;
+
+/* The next query returns `row_count` rows, then fails if it reaches
+   `fail_at`. If `copy_status` is not PGRES_EMPTY_QUERY, it is a COPY. */
+static void server_expect(int row_count, int fail_at,
+        ExecStatusType copy_status)
+{
+    server.row_count = row_count;
+    server.fail_at = fail_at;
+    server.copy_status = copy_status;
+    server.copy_ended = 0;
+}
+
+int PQsendQuery(PGconn *conn, const char *query)
+{
+    server.state = server.copy_status ? SERVER_COPY : SERVER_ROWS;
+    server.rows_sent = 0;
+    atomic_store(&server.cancelled, 0);
+    return 1;
+}
+
+int PQsetSingleRowMode(PGconn *conn)
+{
+    return 1;
+}
+
+#ifdef LIBPQ_HAS_CHUNK_MODE
+int PQsetChunkedRowsMode(PGconn *conn, int chunkSize)
+{
+    return 1;
+}
+#endif
+
+PGcancel *PQgetCancel(PGconn *conn)
+{
+    server.live_cancels++;
+    return malloc(1);
+}
+
+void PQfreeCancel(PGcancel *cancel)
+{
+    server.live_cancels--;
+    free(cancel);
+}
+
+int PQcancel(PGcancel *cancel, char *errbuf, int errbufsize)
+{
+    atomic_store(&server.cancelled, 1);
+    return 1;
+}
+
+int PQputCopyEnd(PGconn *conn, const char *errormsg)
+{
+    server.state = errormsg ? SERVER_COPY_FAILED : SERVER_COPY_DONE;
+    server.copy_ended = 1;
+    return 1;
+}
+
+int PQgetCopyData(PGconn *conn, char **buffer, int async)
+{
+    if (server.state == SERVER_COPY)
+        server.state = SERVER_COPY_DONE;
+
+    server.copy_ended = 1;
+    return -1;
+}
+
+/* Results made here have no connection to hold their message. */
+char *PQresultErrorMessage(const PGresult *result)
+{
+    if (PQresultStatus(result) == PGRES_FATAL_ERROR)
+        return (char *)server.error;
+
+    return "";
+}
+
+/* Rows are (id, note), where note is "even" or null. */
+static PGresult *row_result(int row)
+{
+    PGresult *result = PQmakeEmptyPGresult(NULL, PGRES_SINGLE_TUPLE);
+    PGresAttDesc attrs[] = {
+        {"id", 0, 0, 0, TEXTOID, -1, -1},
+        {"note", 0, 0, 0, TEXTOID, -1, -1},
+    };
+    char id[16];
+
+    snprintf(id, sizeof(id), "%d", row);
+    PQsetResultAttrs(result, 2, attrs);
+    PQsetvalue(result, 0, 0, id, (int)strlen(id));
+
+    if (row % 2)
+        PQsetvalue(result, 0, 1, NULL, -1);
+    else
+        PQsetvalue(result, 0, 1, "even", 4);
+
+    return result;
+}
+
+static PGresult *error_result(const char *message)
+{
+    server.error = message;
+    return PQmakeEmptyPGresult(NULL, PGRES_FATAL_ERROR);
+}
+
+PGresult *PQgetResult(PGconn *conn)
+{
+    int state = server.state;
+
+    server.state = SERVER_IDLE;
+
+    switch (state) {
+        case SERVER_IDLE:
+            return NULL;
+        case SERVER_COPY:
+            server.state = SERVER_COPY;
+            return PQmakeEmptyPGresult(NULL, server.copy_status);
+        case SERVER_COPY_FAILED:
+            return error_result("ERROR: COPY from stdin failed\n");
+        case SERVER_COPY_DONE:
+            return PQmakeEmptyPGresult(NULL, PGRES_COMMAND_OK);
+        default:
+            break;
+    }
+
+    if (atomic_load(&server.cancelled))
+        return error_result("ERROR: canceling statement\n");
+
+    if (server.rows_sent == server.fail_at)
+        return error_result("ERROR: division by zero\n");
+
+    if (server.rows_sent < server.row_count) {
+        server.state = SERVER_ROWS;
+        return row_result(server.rows_sent++);
+    }
+
+    return PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+}
+
+static lily_value *make_conn(lily_state *s)
+{
+    lily_postgres_Conn *conn_value = INIT_Conn(s);
+
+    conn_value->is_open = 1;
+    conn_value->conn = NULL;
+    conn_value->copy_writer = NULL;
+    conn_value->types = NULL;
+    conn_value->stream = NULL;
+    conn_value->pool_key = NULL;
+    lily_return_top(s);
+    return mock_take_result(s);
+}
+
+/* Call `fn` on `conn` with `query` and no values, and return its result. */
+static lily_value *call_query(lily_state *s, void (*fn)(lily_state *),
+        lily_value *conn, const char *query)
+{
+    lily_value *query_value = string_value(s, query);
+    lily_value *values = empty_list_value(s);
+    lily_value *args[] = {conn, query_value, values};
+
+    mock_set_args(s, args, 3);
+    fn(s);
+    mock_free_value(values);
+    mock_free_value(query_value);
+    return mock_take_result(s);
+}
+
+/* The RowStream inside the Success that Conn.stream returned. */
+static lily_value *stream_of(lily_value *result)
+{
+    return lily_con_get(lily_as_container(result), 0);
+}
+
+static lily_postgres_Conn *conn_of(lily_value *conn)
+{
+    return (lily_postgres_Conn *)mock_value_foreign(conn);
+}
+
+/* Call RowStream.next on `stream`. Returns the row, or NULL for None. */
+static lily_value *stream_next(lily_state *s, lily_value *stream)
+{
+    lily_value *args[] = {stream};
+
+    mock_set_args(s, args, 1);
+    lily_postgres_RowStream_next(s);
+
+    lily_value *result = mock_take_result(s);
+
+    if (mock_is_none(result)) {
+        mock_free_value(result);
+        return NULL;
+    }
+
+    return result;
+}
+
+static void stream_cancel(lily_state *s, lily_value *stream)
+{
+    lily_value *args[] = {stream};
+
+    mock_set_args(s, args, 1);
+    lily_postgres_RowStream_cancel(s);
+    mock_free_value(mock_take_result(s));
+}
+
+/* Check that `row` is the row that row_result made for `expected`. */
+static void expect_row(const char *what, lily_value *row, int expected)
+{
+    lily_container_val *fields = lily_as_container(lily_con_get(
+            lily_as_container(row), 0));
+    char id[16];
+
+    snprintf(id, sizeof(id), "%d", expected);
+    expect_string(what, lily_as_string_raw(lily_con_get(fields, 0)), id);
+    expect_string(what, lily_as_string_raw(lily_con_get(fields, 1)),
+                  expected % 2 ? "(null)" : "even");
+}
+
+static void expect_failure(const char *what, lily_value *result,
+        const char *expected)
+{
+    if (mock_is_failure(result) == 0) {
+        printf("%s: expected a Failure.\n", what);
+        failures++;
+        return;
+    }
+
+    expect_string(what, lily_as_string_raw(lily_con_get(
+            lily_as_container(result), 0)), expected);
+}
+
+static void check_full_read(lily_state *s, lily_value *conn)
+{
+    server_expect(1000, -1, PGRES_EMPTY_QUERY);
+
+    lily_value *result = call_query(s, lily_postgres_Conn_stream, conn, "");
+    lily_value *stream = stream_of(result);
+    lily_value *row;
+    int count = 0;
+
+    while ((row = stream_next(s, stream)) != NULL) {
+        expect_row("full read", row, count);
+        mock_free_value(row);
+        count++;
+    }
+
+    expect_integer("full read, rows", count, 1000);
+    expect_integer("full read, Conn freed", conn_of(conn)->stream == NULL, 1);
+    expect_integer("full read, cancels", server.live_cancels, 0);
+    expect_integer("full read, next after end",
+                   stream_next(s, stream) == NULL, 1);
+    mock_free_value(result);
+}
+
+static void check_busy(lily_state *s, lily_value *conn)
+{
+    server_expect(1000, -1, PGRES_EMPTY_QUERY);
+
+    lily_value *result = call_query(s, lily_postgres_Conn_stream, conn, "");
+    lily_value *busy;
+
+    busy = call_query(s, lily_postgres_Conn_stream, conn, "");
+    expect_failure("second stream", busy, "A stream is in progress.\n");
+    mock_free_value(busy);
+
+    busy = call_query(s, lily_postgres_Conn_query_all, conn, "");
+    expect_failure("query_all during a stream", busy,
+                   "A stream is in progress.\n");
+    mock_free_value(busy);
+
+    /* Destroying the stream cancels it and frees the Conn. */
+    mock_free_value(result);
+    expect_integer("destroyed stream, Conn freed",
+                   conn_of(conn)->stream == NULL, 1);
+    expect_integer("destroyed stream, cancelled",
+                   atomic_load(&server.cancelled), 1);
+}
+
+static void check_cancel(lily_state *s, lily_value *conn)
+{
+    server_expect(100000, -1, PGRES_EMPTY_QUERY);
+
+    lily_value *result = call_query(s, lily_postgres_Conn_stream, conn, "");
+    lily_value *stream = stream_of(result);
+    lily_value *row = stream_next(s, stream);
+
+    expect_row("cancel, first row", row, 0);
+    mock_free_value(row);
+    stream_cancel(s, stream);
+    expect_integer("cancel, cancelled", atomic_load(&server.cancelled), 1);
+    expect_integer("cancel, stopped early",
+                   server.rows_sent < server.row_count, 1);
+    expect_integer("cancel, Conn freed", conn_of(conn)->stream == NULL, 1);
+    expect_integer("cancel, next after cancel",
+                   stream_next(s, stream) == NULL, 1);
+
+    /* Cancelling again does nothing. */
+    stream_cancel(s, stream);
+    mock_free_value(result);
+    expect_integer("cancel, cancels", server.live_cancels, 0);
+}
+
+static void check_error(lily_state *s, lily_value *conn)
+{
+    server_expect(1000, 5, PGRES_EMPTY_QUERY);
+
+    lily_value *result = call_query(s, lily_postgres_Conn_stream, conn, "");
+    lily_value *stream = stream_of(result);
+    lily_value *args[] = {stream};
+    int i;
+
+    for (i = 0;i < 5;i++) {
+        lily_value *row = stream_next(s, stream);
+
+        expect_row("error partway, row", row, i);
+        mock_free_value(row);
+    }
+
+    mock_set_args(s, args, 1);
+    expect_raise("error partway", s, lily_postgres_RowStream_next,
+                 "RuntimeError: ERROR: division by zero\n");
+    expect_integer("error partway, Conn freed",
+                   conn_of(conn)->stream == NULL, 1);
+    expect_integer("error partway, next after error",
+                   stream_next(s, stream) == NULL, 1);
+    mock_free_value(result);
+}
+
+static void check_conn_destroyed(lily_state *s)
+{
+    lily_value *conn = make_conn(s);
+
+    server_expect(100000, -1, PGRES_EMPTY_QUERY);
+
+    lily_value *result = call_query(s, lily_postgres_Conn_stream, conn, "");
+    lily_value *stream = stream_of(result);
+
+    /* The I/O thread fills the queue and waits while the Conn goes away. */
+    mock_free_value(conn);
+    expect_integer("Conn destroyed, cancelled",
+                   atomic_load(&server.cancelled), 1);
+    expect_integer("Conn destroyed, next", stream_next(s, stream) == NULL, 1);
+    expect_integer("Conn destroyed, cancels", server.live_cancels, 0);
+    mock_free_value(result);
+}
+
+static void check_stream_copy(lily_state *s, lily_value *conn,
+        ExecStatusType status, const char *what)
+{
+    server_expect(0, -1, status);
+
+    lily_value *result = call_query(s, lily_postgres_Conn_stream, conn, "");
+    lily_value *args[] = {stream_of(result)};
+
+    mock_set_args(s, args, 1);
+    expect_raise(what, s, lily_postgres_RowStream_next,
+                 "RuntimeError: COPY is not supported by stream.\n");
+    expect_integer(what, server.copy_ended, 1);
+    expect_integer(what, conn_of(conn)->stream == NULL, 1);
+    mock_free_value(result);
+
+    /* A COPY that is never read still ends when the stream is destroyed. */
+    server_expect(0, -1, status);
+    result = call_query(s, lily_postgres_Conn_stream, conn, "");
+    mock_free_value(result);
+    expect_integer(what, server.copy_ended, 1);
+    expect_integer(what, conn_of(conn)->stream == NULL, 1);
+}
+
+static void check_query_copy(lily_state *s, lily_value *conn,
+        ExecStatusType status, const char *what)
+{
+    lily_value *result;
+    lily_value *limit = mock_integer_value(1024);
+    lily_value *query = string_value(s, "");
+    lily_value *values = empty_list_value(s);
+    lily_value *spill_args[] = {conn, limit, query, values};
+
+    server_expect(0, -1, status);
+    result = call_query(s, lily_postgres_Conn_query_all, conn, "");
+    expect_failure(what, result, "COPY is not supported by query_all.\n");
+    expect_integer(what, server.copy_ended, 1);
+    mock_free_value(result);
+
+    server_expect(0, -1, status);
+    mock_set_args(s, spill_args, 4);
+    lily_postgres_Conn_query_spill(s);
+    result = mock_take_result(s);
+    expect_failure(what, result, "COPY is not supported by query_spill.\n");
+    expect_integer(what, server.copy_ended, 1);
+    mock_free_value(result);
+    mock_free_value(values);
+    mock_free_value(query);
+    mock_free_value(limit);
+}
+
+/* A query during a copy would end the copy, so every query refuses. */
+static void check_copy_in_progress(lily_state *s, lily_value *conn)
+{
+    void (*queries[])(lily_state *) = {
+        lily_postgres_Conn_query,
+        lily_postgres_Conn_query_all,
+        lily_postgres_Conn_stream,
+    };
+    lily_postgres_CopyWriter writer;
+    int i;
+
+    conn_of(conn)->copy_writer = &writer;
+
+    for (i = 0;i < 3;i++) {
+        lily_value *result = call_query(s, queries[i], conn, "");
+
+        expect_failure("query during a copy", result,
+                       "A copy is already in progress.\n");
+        mock_free_value(result);
+    }
+
+    conn_of(conn)->copy_writer = NULL;
+}
+
+int main(void)
+{
+    lily_state *s = mock_new_state();
+    lily_value *conn = make_conn(s);
+
+    check_full_read(s, conn);
+    check_busy(s, conn);
+    check_cancel(s, conn);
+    check_error(s, conn);
+    check_conn_destroyed(s);
+    check_stream_copy(s, conn, PGRES_COPY_IN, "stream of COPY FROM STDIN");
+    check_stream_copy(s, conn, PGRES_COPY_OUT, "stream of COPY TO STDOUT");
+    check_query_copy(s, conn, PGRES_COPY_IN, "COPY FROM STDIN");
+    check_query_copy(s, conn, PGRES_COPY_OUT, "COPY TO STDOUT");
+    check_copy_in_progress(s, conn);
+    mock_free_value(conn);
+    mock_free_state(s);
+    return check_exit();
+}
@@ -0,0 +1,421 @@
+/* Server-less microbenchmarks for the binding.
+
+   Results are built with PQmakeEmptyPGresult/PQsetvalue, so every path can be
+   measured without a server. The binding is compiled against a mock of the
+   Lily api (see lily.h in this directory), so the numbers cover the binding's
+   own work: walking the PGresult and building values. They do not include the
+   cost of the interpreter. */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "lily_postgres.c"
+
+typedef struct {
+    int rows;
+    int columns;
+    int width;
+    double null_ratio;
+    int iterations;
+    int placeholders;
+} bench_options;
+
+typedef struct {
+    const char *name;
+    void (*run)(lily_state *, lily_value *, bench_options *);
+    /* How many units (rows or calls) one run covers. */
+    int per_row;
+} bench_path;
+
+/* Counts callback calls, which cost far more in the interpreter than here. */
+static uint64_t calls_seen;
+
+static void count_row(lily_state *s, lily_value **args, int count)
+{
+    calls_seen++;
+}
+
+static lily_function_val count_row_function = {count_row};
+
+static PGresult *make_result(bench_options *opt)
+{
+    PGresult *result = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+    PGresAttDesc *attrs = calloc(opt->columns, sizeof(*attrs));
+    char *field = malloc(opt->width + 1);
+    char name_buffer[32];
+    int row, col;
+
+    for (col = 0;col < opt->columns;col++) {
+        snprintf(name_buffer, sizeof(name_buffer), "column_%d", col);
+        attrs[col].name = strdup(name_buffer);
+        /* text */
+        attrs[col].typid = 25;
+        attrs[col].typlen = -1;
+        attrs[col].atttypmod = -1;
+    }
+
+    PQsetResultAttrs(result, opt->columns, attrs);
+
+    for (row = 0;row < opt->rows;row++) {
+        for (col = 0;col < opt->columns;col++) {
+            if ((double)rand() / RAND_MAX < opt->null_ratio) {
+                PQsetvalue(result, row, col, NULL, -1);
+                continue;
+            }
+
+            int i;
+            for (i = 0;i < opt->width;i++)
+                field[i] = 'a' + (row + col + i) % 26;
+
+            field[opt->width] = '\0';
+            PQsetvalue(result, row, col, field, opt->width);
+        }
+    }
+
+    for (col = 0;col < opt->columns;col++)
+        free(attrs[col].name);
+
+    free(attrs);
+    free(field);
+    return result;
+}
+
+static lily_value *make_cursor(lily_state *s, bench_options *opt)
+{
+    push_cursor(s, make_result(opt));
+    lily_return_top(s);
+    return mock_take_result(s);
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Measure how much memory Cursor.compact saves on a result of this shape. */
+static void report_memory(lily_state *s, bench_options *opt)
+{
+    lily_value *cursor = make_cursor(s, opt);
+    lily_postgres_Cursor *c = mock_value_foreign(cursor);
+    lily_value *args[] = {cursor};
+    uint64_t result_bytes = c->memory_bytes;
+
+    mock_set_args(s, args, 1);
+    lily_postgres_Cursor_compact(s);
+    printf("\"memory\": {\"result_bytes\": %lu, \"compact_bytes\": %lu}, ",
+           (unsigned long)result_bytes, (unsigned long)c->memory_bytes);
+    mock_free_value(cursor);
+}
+
+/* Time Cursor.compact on a fresh result. */
+static void report_compact(lily_state *s, bench_options *opt)
+{
+    lily_value *cursor = make_cursor(s, opt);
+    lily_value *args[] = {cursor};
+
+    mock_set_args(s, args, 1);
+
+    double start = now_ns();
+
+    lily_postgres_Cursor_compact(s);
+
+    double elapsed = now_ns() - start;
+
+    printf("\"compact_ns_per_row\": %.2f, ", elapsed / opt->rows);
+    mock_free_value(cursor);
+}
+
+static void run_each_row(lily_state *s, lily_value *cursor,
+        bench_options *opt)
+{
+    lily_value *fn = mock_function_value(&count_row_function);
+    lily_value *args[] = {cursor, fn};
+
+    mock_set_args(s, args, 2);
+    lily_postgres_Cursor_each_row(s);
+    free(fn);
+}
+
+/* Batched callbacks, at a few sizes to show how the cost per row falls. */
+static void run_each_batch(lily_state *s, lily_value *cursor, int size)
+{
+    lily_value *fn = mock_function_value(&count_row_function);
+    lily_value *batch_size = mock_integer_value(size);
+    lily_value *args[] = {cursor, batch_size, fn};
+
+    mock_set_args(s, args, 3);
+    lily_postgres_Cursor_each_batch(s);
+    free(batch_size);
+    free(fn);
+}
+
+static void run_each_batch_1(lily_state *s, lily_value *cursor,
+        bench_options *opt)
+{
+    run_each_batch(s, cursor, 1);
+}
+
+static void run_each_batch_16(lily_state *s, lily_value *cursor,
+        bench_options *opt)
+{
+    run_each_batch(s, cursor, 16);
+}
+
+static void run_each_batch_256(lily_state *s, lily_value *cursor,
+        bench_options *opt)
+{
+    run_each_batch(s, cursor, 256);
+}
+
+static void run_to_list(lily_state *s, lily_value *cursor,
+        bench_options *opt)
+{
+    lily_value *args[] = {cursor};
+
+    mock_set_args(s, args, 1);
+    lily_postgres_Cursor_to_list(s);
+    mock_free_value(mock_take_result(s));
+}
+
+static void run_write_csv(lily_state *s, lily_value *cursor,
+        bench_options *opt)
+{
+    static lily_value *file = NULL;
+
+    if (file == NULL)
+        file = mock_file_value(mock_new_file(fopen("/dev/null", "w")));
+
+    lily_value *args[] = {cursor, file};
+
+    mock_set_args(s, args, 2);
+    lily_postgres_Cursor_write_csv(s);
+}
+
+static void run_write_arrow(lily_state *s, lily_value *cursor,
+        bench_options *opt)
+{
+    static lily_value *path = NULL;
+
+    if (path == NULL) {
+        lily_push_string(s, "/dev/null");
+        lily_return_top(s);
+        path = mock_take_result(s);
+    }
+
+    lily_value *args[] = {cursor, path};
+
+    mock_set_args(s, args, 2);
+    lily_postgres_Cursor_write_arrow(s);
+}
+
+static lily_value *make_format(lily_state *s, bench_options *opt)
+{
+    lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+    int i;
+
+    lily_mb_add(msgbuf, "SELECT a, b, c FROM t WHERE ");
+    for (i = 0;i < opt->placeholders;i++)
+        lily_mb_add(msgbuf, "x = ? AND some_longer_column_name <> 'text' OR ");
+
+    lily_mb_add(msgbuf, "true");
+    lily_push_string(s, lily_mb_raw(msgbuf));
+    lily_return_top(s);
+    return mock_take_result(s);
+}
+
+static lily_value *make_values(lily_state *s, bench_options *opt)
+{
+    int i;
+    lily_container_val *values = lily_push_list(s, opt->placeholders);
+    for (i = 0;i < opt->placeholders;i++) {
+        lily_push_string(s, "12345");
+        lily_con_set_from_stack(s, values, i);
+    }
+
+    lily_return_top(s);
+    return mock_take_result(s);
+}
+
+/* A Conn with a NULL connection runs everything up to PQexec, which then fails
+   without touching the network. */
+static lily_value *make_null_conn(lily_state *s)
+{
+    lily_postgres_Conn *conn_value = INIT_Conn(s);
+
+    conn_value->is_open = 1;
+    conn_value->conn = NULL;
+    conn_value->copy_writer = NULL;
+    conn_value->types = NULL;
+    conn_value->stream = NULL;
+    conn_value->pool_key = NULL;
+    lily_return_top(s);
+    return mock_take_result(s);
+}
+
+static void run_query_format(lily_state *s, lily_value *cursor,
+        bench_options *opt)
+{
+    lily_value *conn = make_null_conn(s);
+    lily_value *fmt = make_format(s, opt);
+    lily_value *value_list = make_values(s, opt);
+    lily_value *args[] = {conn, fmt, value_list};
+    int iter;
+
+    mock_set_args(s, args, 3);
+
+    for (iter = 0;iter < opt->rows;iter++)
+        lily_postgres_Conn_query(s);
+
+    mock_free_value(conn);
+    mock_free_value(fmt);
+    mock_free_value(value_list);
+}
+
+static void run_query_template(lily_state *s, lily_value *cursor,
+        bench_options *opt)
+{
+    lily_value *conn = make_null_conn(s);
+    lily_value *fmt = make_format(s, opt);
+    lily_value *value_list = make_values(s, opt);
+    lily_value *compile_args[] = {conn, fmt};
+
+    mock_set_args(s, compile_args, 2);
+    lily_postgres_Conn_compile(s);
+
+    lily_value *template = mock_take_result(s);
+    lily_value *args[] = {conn, template, value_list};
+    int iter;
+
+    mock_set_args(s, args, 3);
+
+    for (iter = 0;iter < opt->rows;iter++)
+        lily_postgres_Conn_query_template(s);
+
+    mock_free_value(template);
+    mock_free_value(conn);
+    mock_free_value(fmt);
+    mock_free_value(value_list);
+}
+
+static bench_path paths[] = {
+    {"each_row", run_each_row, 1},
+    {"each_batch_1", run_each_batch_1, 1},
+    {"each_batch_16", run_each_batch_16, 1},
+    {"each_batch_256", run_each_batch_256, 1},
+    {"to_list", run_to_list, 1},
+    {"write_csv", run_write_csv, 1},
+    {"write_arrow", run_write_arrow, 1},
+    {"query_format", run_query_format, 0},
+    {"query_template", run_query_template, 0},
+};
+
+static void usage(void)
+{
+    fputs("usage: bench_synthetic [--rows N] [--columns N] [--width N]\n"
+          "                       [--null-ratio F] [--iterations N]\n"
+          "                       [--placeholders N] [path...]\n", stderr);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    bench_options opt = {100000, 8, 16, 0.1, 5, 20};
+    const char *only[sizeof(paths) / sizeof(paths[0])];
+    int only_count = 0, i;
+
+    for (i = 1;i < argc;i++) {
+        const char *arg = argv[i];
+
+        if (arg[0] != '-') {
+            if (only_count == sizeof(only) / sizeof(only[0]))
+                usage();
+
+            only[only_count] = arg;
+            only_count++;
+            continue;
+        }
+
+        if (i + 1 == argc)
+            usage();
+
+        const char *value = argv[i + 1];
+        i++;
+
+        if (strcmp(arg, "--rows") == 0)
+            opt.rows = atoi(value);
+        else if (strcmp(arg, "--columns") == 0)
+            opt.columns = atoi(value);
+        else if (strcmp(arg, "--width") == 0)
+            opt.width = atoi(value);
+        else if (strcmp(arg, "--null-ratio") == 0)
+            opt.null_ratio = atof(value);
+        else if (strcmp(arg, "--iterations") == 0)
+            opt.iterations = atoi(value);
+        else if (strcmp(arg, "--placeholders") == 0)
+            opt.placeholders = atoi(value);
+        else
+            usage();
+    }
+
+    lily_state *s = mock_new_state();
+    lily_value *cursor = make_cursor(s, &opt);
+    int first = 1, path_index;
+
+    printf("{\"rows\": %d, \"columns\": %d, \"width\": %d, "
+           "\"null_ratio\": %g, ",
+           opt.rows, opt.columns, opt.width, opt.null_ratio);
+    report_memory(s, &opt);
+    report_compact(s, &opt);
+    printf("\"paths\": {");
+
+    for (path_index = 0;
+         path_index < sizeof(paths) / sizeof(paths[0]);
+         path_index++) {
+        bench_path *path = &paths[path_index];
+
+        if (only_count) {
+            for (i = 0;i < only_count;i++)
+                if (strcmp(only[i], path->name) == 0)
+                    break;
+
+            if (i == only_count)
+                continue;
+        }
+
+        /* Warm up once, then measure. */
+        path->run(s, cursor, &opt);
+
+        uint64_t allocations = mock_allocation_count();
+        uint64_t calls = calls_seen;
+        double start = now_ns();
+        int iter;
+
+        for (iter = 0;iter < opt.iterations;iter++)
+            path->run(s, cursor, &opt);
+
+        double elapsed = now_ns() - start;
+        double units = (double)opt.rows * opt.iterations;
+
+        allocations = mock_allocation_count() - allocations;
+        calls = calls_seen - calls;
+        printf("%s\n    \"%s\": {\"ns_per_%s\": %.2f, "
+               "\"allocations_per_%s\": %.2f",
+               first ? "" : ",", path->name,
+               path->per_row ? "row" : "call", elapsed / units,
+               path->per_row ? "row" : "call", allocations / units);
+
+        if (calls)
+            printf(", \"callbacks_per_row\": %.4f", calls / units);
+
+        printf("}");
+        first = 0;
+    }
+
+    printf("\n}}\n");
+    mock_free_value(cursor);
+    mock_free_state(s);
+    return 0;
+}
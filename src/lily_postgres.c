@@ -4,7 +4,14 @@ library postgres
 This provides a very thin wrapper over libpq for Lily.
 */
 
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #include "libpq-fe.h"
 
@@ -17,7 +24,14 @@ typedef struct lily_postgres_Cursor_ {
     uint64_t row_count;
     uint64_t current_row;
     uint64_t is_closed;
+    uint64_t auto_close;
+    uint64_t memory_bytes;
+    uint64_t column_hash_mask;
+    uint32_t *column_hash;
+    struct column_type_ *column_types;
     PGresult *pg_result;
+    struct row_store_ *store;
+    struct column_store_ *columns;
 } lily_postgres_Cursor;
 #define ARG_Cursor(state, index) \
 (lily_postgres_Cursor *)lily_arg_generic(state, index)
@@ -25,297 +39,6613 @@ typedef struct lily_postgres_Cursor_ {
 #define INIT_Cursor(state)\
 (lily_postgres_Cursor *) lily_push_foreign(state, ID_Cursor(state), (lily_destroy_func)destroy_Cursor, sizeof(lily_postgres_Cursor))
 
+typedef struct lily_postgres_Template_ {
+    LILY_FOREIGN_HEADER
+    uint64_t placeholder_count;
+    uint64_t fmt_size;
+    uint64_t buffer_size;
+    uint64_t *offsets;
+    uint64_t *value_sizes;
+    char *fmt;
+    char *buffer;
+} lily_postgres_Template;
+#define ARG_Template(state, index) \
+(lily_postgres_Template *)lily_arg_generic(state, index)
+#define ID_Template(state) lily_cid_at(state, 1)
+#define INIT_Template(state)\
+(lily_postgres_Template *) lily_push_foreign(state, ID_Template(state), (lily_destroy_func)destroy_Template, sizeof(lily_postgres_Template))
+
+typedef struct lily_postgres_Params_ {
+    LILY_FOREIGN_HEADER
+    uint64_t count;
+    uint64_t size;
+    Oid *types;
+    char **values;
+    int *lengths;
+    int *formats;
+} lily_postgres_Params;
+#define ARG_Params(state, index) \
+(lily_postgres_Params *)lily_arg_generic(state, index)
+#define ID_Params(state) lily_cid_at(state, 2)
+#define INIT_Params(state)\
+(lily_postgres_Params *) lily_push_foreign(state, ID_Params(state), (lily_destroy_func)destroy_Params, sizeof(lily_postgres_Params))
+
+typedef struct lily_postgres_CopyWriter_ {
+    LILY_FOREIGN_HEADER
+    uint64_t column_count;
+    uint64_t column;
+    uint64_t row_count;
+    uint64_t buffer_pos;
+    uint64_t buffer_size;
+    Oid *column_types;
+    char *buffer;
+    struct lily_postgres_Conn_ *conn_value;
+} lily_postgres_CopyWriter;
+#define ARG_CopyWriter(state, index) \
+(lily_postgres_CopyWriter *)lily_arg_generic(state, index)
+#define ID_CopyWriter(state) lily_cid_at(state, 3)
+#define INIT_CopyWriter(state)\
+(lily_postgres_CopyWriter *) lily_push_foreign(state, ID_CopyWriter(state), (lily_destroy_func)destroy_CopyWriter, sizeof(lily_postgres_CopyWriter))
+
+typedef struct lily_postgres_RowStream_ {
+    LILY_FOREIGN_HEADER
+    struct stream_ring_ *ring;
+    PGresult *current;
+    uint64_t current_row;
+    struct lily_postgres_Conn_ *conn_value;
+} lily_postgres_RowStream;
+#define ARG_RowStream(state, index) \
+(lily_postgres_RowStream *)lily_arg_generic(state, index)
+#define ID_RowStream(state) lily_cid_at(state, 4)
+#define INIT_RowStream(state)\
+(lily_postgres_RowStream *) lily_push_foreign(state, ID_RowStream(state), (lily_destroy_func)destroy_RowStream, sizeof(lily_postgres_RowStream))
+
 typedef struct lily_postgres_Conn_ {
     LILY_FOREIGN_HEADER
     uint64_t is_open;
     PGconn *conn;
+    struct lily_postgres_CopyWriter_ *copy_writer;
+    struct type_registry_ *types;
+    struct lily_postgres_RowStream_ *stream;
+    char *pool_key;
 } lily_postgres_Conn;
 #define ARG_Conn(state, index) \
 (lily_postgres_Conn *)lily_arg_generic(state, index)
-#define ID_Conn(state) lily_cid_at(state, 1)
+#define ID_Conn(state) lily_cid_at(state, 5)
 #define INIT_Conn(state)\
 (lily_postgres_Conn *) lily_push_foreign(state, ID_Conn(state), (lily_destroy_func)destroy_Conn, sizeof(lily_postgres_Conn))
 
 const char *lily_postgres_info_table[] = {
-    "\02Cursor\0Conn\0"
-    ,"C\03Cursor\0"
+    "\06Cursor\0Template\0Params\0CopyWriter\0RowStream\0Conn\0"
+    ,"C\61Cursor\0"
     ,"m\0close\0(Cursor)"
+    ,"m\0column_boolean\0(Cursor,Integer): List[Option[Boolean]]"
+    ,"m\0column_date\0(Cursor,Integer): List[Option[Integer]]"
+    ,"m\0column_double\0(Cursor,Integer): List[Option[Double]]"
+    ,"m\0column_epoch_micros\0(Cursor,Integer): List[Option[Integer]]"
+    ,"m\0column_integer\0(Cursor,Integer): List[Option[Integer]]"
+    ,"m\0column_interval_micros\0(Cursor,Integer): List[Option[Integer]]"
+    ,"m\0column_index\0(Cursor,String): Option[Integer]"
+    ,"m\0column_names\0(Cursor): List[String]"
+    ,"m\0column_string\0(Cursor,Integer): List[Option[String]]"
+    ,"m\0compact\0(Cursor)"
+    ,"m\0count_nonnull\0(Cursor,Integer): Integer"
+    ,"m\0each_batch\0(Cursor,Integer,Function(List[List[String]]))"
     ,"m\0each_row\0(Cursor,Function(List[String]))"
+    ,"m\0each_row_while\0(Cursor,Function(List[String]=>Boolean))"
+    ,"m\0field\0(Cursor,Integer,String): Option[String]"
+    ,"m\0get_boolean\0(Cursor,Integer,Integer): Option[Boolean]"
+    ,"m\0get_boolean_list\0(Cursor,Integer,Integer): Option[List[Option[Boolean]]]"
+    ,"m\0get_date\0(Cursor,Integer,Integer): Option[Integer]"
+    ,"m\0get_double\0(Cursor,Integer,Integer): Option[Double]"
+    ,"m\0get_double_list\0(Cursor,Integer,Integer): Option[List[Option[Double]]]"
+    ,"m\0get_epoch_micros\0(Cursor,Integer,Integer): Option[Integer]"
+    ,"m\0get_integer\0(Cursor,Integer,Integer): Option[Integer]"
+    ,"m\0get_integer_list\0(Cursor,Integer,Integer): Option[List[Option[Integer]]]"
+    ,"m\0get_interval_micros\0(Cursor,Integer,Integer): Option[Integer]"
+    ,"m\0get_json_boolean\0(Cursor,Integer,Integer,String): Option[Boolean]"
+    ,"m\0get_json_double\0(Cursor,Integer,Integer,String): Option[Double]"
+    ,"m\0get_json_integer\0(Cursor,Integer,Integer,String): Option[Integer]"
+    ,"m\0get_json_path\0(Cursor,Integer,Integer,String): Option[String]"
+    ,"m\0get_json_string\0(Cursor,Integer,Integer,String): Option[String]"
+    ,"m\0get_string_list\0(Cursor,Integer,Integer): Option[List[Option[String]]]"
+    ,"m\0histogram\0(Cursor,Integer,Integer): List[Integer]"
+    ,"m\0live_bytes\0: Integer"
+    ,"m\0max_double\0(Cursor,Integer): Option[Double]"
+    ,"m\0max_integer\0(Cursor,Integer): Option[Integer]"
+    ,"m\0memory_bytes\0(Cursor): Integer"
+    ,"m\0min_double\0(Cursor,Integer): Option[Double]"
+    ,"m\0min_integer\0(Cursor,Integer): Option[Integer]"
+    ,"m\0next\0(Cursor): Option[List[String]]"
+    ,"m\0row\0(Cursor,Integer): List[String]"
     ,"m\0row_count\0(Cursor): Integer"
-    ,"C\02Conn\0"
+    ,"m\0set_auto_close\0(Cursor,Boolean)"
+    ,"m\0set_memory_limit\0(Integer)"
+    ,"m\0slice\0(Cursor,Integer,Integer,Function(List[String]))"
+    ,"m\0sum_double\0(Cursor,Integer): Double"
+    ,"m\0sum_integer\0(Cursor,Integer): Integer"
+    ,"m\0to_list\0(Cursor): List[List[String]]"
+    ,"m\0write_csv\0(Cursor,File,*String,*String,*Boolean)"
+    ,"m\0write_arrow\0(Cursor,String,*Integer)"
+    ,"C\01Template\0"
+    ,"m\0placeholder_count\0(Template): Integer"
+    ,"C\11Params\0"
+    ,"m\0new\0(*Integer): Params"
+    ,"m\0add_boolean\0(Params,Boolean)"
+    ,"m\0add_bytestring\0(Params,ByteString)"
+    ,"m\0add_double\0(Params,Double)"
+    ,"m\0add_integer\0(Params,Integer)"
+    ,"m\0add_null\0(Params)"
+    ,"m\0add_string\0(Params,String)"
+    ,"m\0clear\0(Params)"
+    ,"m\0size\0(Params): Integer"
+    ,"C\10CopyWriter\0"
+    ,"m\0end_row\0(CopyWriter)"
+    ,"m\0finish\0(CopyWriter): Result[String,Integer]"
+    ,"m\0write_boolean\0(CopyWriter,Boolean)"
+    ,"m\0write_bytes\0(CopyWriter,ByteString)"
+    ,"m\0write_double\0(CopyWriter,Double)"
+    ,"m\0write_integer\0(CopyWriter,Integer)"
+    ,"m\0write_null\0(CopyWriter)"
+    ,"m\0write_string\0(CopyWriter,String)"
+    ,"C\02RowStream\0"
+    ,"m\0cancel\0(RowStream)"
+    ,"m\0next\0(RowStream): Option[List[String]]"
+    ,"C\15Conn\0"
+    ,"m\0compile\0(Conn,String): Template"
+    ,"m\0copy_in_binary\0(Conn,String,List[String]): Result[String,CopyWriter]"
     ,"m\0query\0(Conn,String,String...): Result[String,Cursor]"
+    ,"m\0query_spill\0(Conn,Integer,String,String...): Result[String,Cursor]"
+    ,"m\0query_all\0(Conn,String): Result[String,List[Cursor]]"
+    ,"m\0query_params\0(Conn,String,Params): Result[String,Cursor]"
+    ,"m\0query_template\0(Conn,Template,String...): Result[String,Cursor]"
+    ,"m\0stream\0(Conn,String,String...): Result[String,RowStream]"
+    ,"m\0release\0(Conn)"
+    ,"m\0borrow\0(*String,*String,*String,*String,*String): Result[String,Conn]"
     ,"m\0open\0(*String,*String,*String,*String,*String): Result[String,Conn]"
+    ,"m\0pool_stats\0: Tuple[Integer,Integer,Integer,Integer,Integer]"
+    ,"m\0set_pool_size\0(Integer)"
     ,"Z"
 };
 void lily_postgres_Cursor_close(lily_state *);
+void lily_postgres_Cursor_column_boolean(lily_state *);
+void lily_postgres_Cursor_column_date(lily_state *);
+void lily_postgres_Cursor_column_double(lily_state *);
+void lily_postgres_Cursor_column_epoch_micros(lily_state *);
+void lily_postgres_Cursor_column_integer(lily_state *);
+void lily_postgres_Cursor_column_interval_micros(lily_state *);
+void lily_postgres_Cursor_column_index(lily_state *);
+void lily_postgres_Cursor_column_names(lily_state *);
+void lily_postgres_Cursor_column_string(lily_state *);
+void lily_postgres_Cursor_compact(lily_state *);
+void lily_postgres_Cursor_count_nonnull(lily_state *);
+void lily_postgres_Cursor_each_batch(lily_state *);
 void lily_postgres_Cursor_each_row(lily_state *);
+void lily_postgres_Cursor_each_row_while(lily_state *);
+void lily_postgres_Cursor_field(lily_state *);
+void lily_postgres_Cursor_get_boolean(lily_state *);
+void lily_postgres_Cursor_get_boolean_list(lily_state *);
+void lily_postgres_Cursor_get_date(lily_state *);
+void lily_postgres_Cursor_get_double(lily_state *);
+void lily_postgres_Cursor_get_double_list(lily_state *);
+void lily_postgres_Cursor_get_epoch_micros(lily_state *);
+void lily_postgres_Cursor_get_integer(lily_state *);
+void lily_postgres_Cursor_get_integer_list(lily_state *);
+void lily_postgres_Cursor_get_interval_micros(lily_state *);
+void lily_postgres_Cursor_get_json_boolean(lily_state *);
+void lily_postgres_Cursor_get_json_double(lily_state *);
+void lily_postgres_Cursor_get_json_integer(lily_state *);
+void lily_postgres_Cursor_get_json_path(lily_state *);
+void lily_postgres_Cursor_get_json_string(lily_state *);
+void lily_postgres_Cursor_get_string_list(lily_state *);
+void lily_postgres_Cursor_histogram(lily_state *);
+void lily_postgres_Cursor_live_bytes(lily_state *);
+void lily_postgres_Cursor_max_double(lily_state *);
+void lily_postgres_Cursor_max_integer(lily_state *);
+void lily_postgres_Cursor_memory_bytes(lily_state *);
+void lily_postgres_Cursor_min_double(lily_state *);
+void lily_postgres_Cursor_min_integer(lily_state *);
+void lily_postgres_Cursor_next(lily_state *);
+void lily_postgres_Cursor_row(lily_state *);
 void lily_postgres_Cursor_row_count(lily_state *);
+void lily_postgres_Cursor_set_auto_close(lily_state *);
+void lily_postgres_Cursor_set_memory_limit(lily_state *);
+void lily_postgres_Cursor_slice(lily_state *);
+void lily_postgres_Cursor_sum_double(lily_state *);
+void lily_postgres_Cursor_sum_integer(lily_state *);
+void lily_postgres_Cursor_to_list(lily_state *);
+void lily_postgres_Cursor_write_csv(lily_state *);
+void lily_postgres_Cursor_write_arrow(lily_state *);
+void lily_postgres_Template_placeholder_count(lily_state *);
+void lily_postgres_Params_new(lily_state *);
+void lily_postgres_Params_add_boolean(lily_state *);
+void lily_postgres_Params_add_bytestring(lily_state *);
+void lily_postgres_Params_add_double(lily_state *);
+void lily_postgres_Params_add_integer(lily_state *);
+void lily_postgres_Params_add_null(lily_state *);
+void lily_postgres_Params_add_string(lily_state *);
+void lily_postgres_Params_clear(lily_state *);
+void lily_postgres_Params_size(lily_state *);
+void lily_postgres_CopyWriter_end_row(lily_state *);
+void lily_postgres_CopyWriter_finish(lily_state *);
+void lily_postgres_CopyWriter_write_boolean(lily_state *);
+void lily_postgres_CopyWriter_write_bytes(lily_state *);
+void lily_postgres_CopyWriter_write_double(lily_state *);
+void lily_postgres_CopyWriter_write_integer(lily_state *);
+void lily_postgres_CopyWriter_write_null(lily_state *);
+void lily_postgres_CopyWriter_write_string(lily_state *);
+void lily_postgres_RowStream_cancel(lily_state *);
+void lily_postgres_RowStream_next(lily_state *);
+void lily_postgres_Conn_compile(lily_state *);
+void lily_postgres_Conn_copy_in_binary(lily_state *);
 void lily_postgres_Conn_query(lily_state *);
+void lily_postgres_Conn_query_spill(lily_state *);
+void lily_postgres_Conn_query_all(lily_state *);
+void lily_postgres_Conn_query_params(lily_state *);
+void lily_postgres_Conn_query_template(lily_state *);
+void lily_postgres_Conn_stream(lily_state *);
+void lily_postgres_Conn_release(lily_state *);
+void lily_postgres_Conn_borrow(lily_state *);
 void lily_postgres_Conn_open(lily_state *);
+void lily_postgres_Conn_pool_stats(lily_state *);
+void lily_postgres_Conn_set_pool_size(lily_state *);
 lily_call_entry_func lily_postgres_call_table[] = {
     NULL,
     NULL,
     lily_postgres_Cursor_close,
+    lily_postgres_Cursor_column_boolean,
+    lily_postgres_Cursor_column_date,
+    lily_postgres_Cursor_column_double,
+    lily_postgres_Cursor_column_epoch_micros,
+    lily_postgres_Cursor_column_integer,
+    lily_postgres_Cursor_column_interval_micros,
+    lily_postgres_Cursor_column_index,
+    lily_postgres_Cursor_column_names,
+    lily_postgres_Cursor_column_string,
+    lily_postgres_Cursor_compact,
+    lily_postgres_Cursor_count_nonnull,
+    lily_postgres_Cursor_each_batch,
     lily_postgres_Cursor_each_row,
+    lily_postgres_Cursor_each_row_while,
+    lily_postgres_Cursor_field,
+    lily_postgres_Cursor_get_boolean,
+    lily_postgres_Cursor_get_boolean_list,
+    lily_postgres_Cursor_get_date,
+    lily_postgres_Cursor_get_double,
+    lily_postgres_Cursor_get_double_list,
+    lily_postgres_Cursor_get_epoch_micros,
+    lily_postgres_Cursor_get_integer,
+    lily_postgres_Cursor_get_integer_list,
+    lily_postgres_Cursor_get_interval_micros,
+    lily_postgres_Cursor_get_json_boolean,
+    lily_postgres_Cursor_get_json_double,
+    lily_postgres_Cursor_get_json_integer,
+    lily_postgres_Cursor_get_json_path,
+    lily_postgres_Cursor_get_json_string,
+    lily_postgres_Cursor_get_string_list,
+    lily_postgres_Cursor_histogram,
+    lily_postgres_Cursor_live_bytes,
+    lily_postgres_Cursor_max_double,
+    lily_postgres_Cursor_max_integer,
+    lily_postgres_Cursor_memory_bytes,
+    lily_postgres_Cursor_min_double,
+    lily_postgres_Cursor_min_integer,
+    lily_postgres_Cursor_next,
+    lily_postgres_Cursor_row,
     lily_postgres_Cursor_row_count,
+    lily_postgres_Cursor_set_auto_close,
+    lily_postgres_Cursor_set_memory_limit,
+    lily_postgres_Cursor_slice,
+    lily_postgres_Cursor_sum_double,
+    lily_postgres_Cursor_sum_integer,
+    lily_postgres_Cursor_to_list,
+    lily_postgres_Cursor_write_csv,
+    lily_postgres_Cursor_write_arrow,
+    NULL,
+    lily_postgres_Template_placeholder_count,
     NULL,
+    lily_postgres_Params_new,
+    lily_postgres_Params_add_boolean,
+    lily_postgres_Params_add_bytestring,
+    lily_postgres_Params_add_double,
+    lily_postgres_Params_add_integer,
+    lily_postgres_Params_add_null,
+    lily_postgres_Params_add_string,
+    lily_postgres_Params_clear,
+    lily_postgres_Params_size,
+    NULL,
+    lily_postgres_CopyWriter_end_row,
+    lily_postgres_CopyWriter_finish,
+    lily_postgres_CopyWriter_write_boolean,
+    lily_postgres_CopyWriter_write_bytes,
+    lily_postgres_CopyWriter_write_double,
+    lily_postgres_CopyWriter_write_integer,
+    lily_postgres_CopyWriter_write_null,
+    lily_postgres_CopyWriter_write_string,
+    NULL,
+    lily_postgres_RowStream_cancel,
+    lily_postgres_RowStream_next,
+    NULL,
+    lily_postgres_Conn_compile,
+    lily_postgres_Conn_copy_in_binary,
     lily_postgres_Conn_query,
+    lily_postgres_Conn_query_spill,
+    lily_postgres_Conn_query_all,
+    lily_postgres_Conn_query_params,
+    lily_postgres_Conn_query_template,
+    lily_postgres_Conn_stream,
+    lily_postgres_Conn_release,
+    lily_postgres_Conn_borrow,
     lily_postgres_Conn_open,
+    lily_postgres_Conn_pool_stats,
+    lily_postgres_Conn_set_pool_size,
 };
 /** End autogen section. **/
 
-/**
-foreign class Cursor {
-    layout {
-        uint64_t column_count;
-        uint64_t row_count;
-        uint64_t current_row;
-        uint64_t is_closed;
-        PGresult *pg_result;
-    }
+/* Type oids from pg_type.h, which is a server header. */
+#define BOOLOID 16
+#define BYTEAOID 17
+#define INT8OID 20
+#define INT2OID 21
+#define INT4OID 23
+#define TEXTOID 25
+#define FLOAT4OID 700
+#define FLOAT8OID 701
+#define DATEOID 1082
+#define TIMESTAMPOID 1114
+#define TIMESTAMPTZOID 1184
+#define INTERVALOID 1186
+#define NUMERICOID 1700
+
+void return_failure(lily_state *s, const char *message)
+{
+    lily_container_val *variant = lily_push_failure(s);
+    lily_push_string(s, message);
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
 }
 
-The `Cursor` class provides a wrapper over the result of querying the postgres
-database. The class provides a very basic set of methods to allow interaction
-with the rows as a `List[String]`.
-*/
+int result_failed(PGresult *raw_result)
+{
+    ExecStatusType status = PQresultStatus(raw_result);
 
-void close_result(lily_postgres_Cursor *result)
+    return (status == PGRES_BAD_RESPONSE ||
+            status == PGRES_NONFATAL_ERROR ||
+            status == PGRES_FATAL_ERROR);
+}
+
+int result_copying(PGresult *raw_result)
 {
-    if (result->is_closed == 0)
-        PQclear(result->pg_result);
+    ExecStatusType status = PQresultStatus(raw_result);
 
-    result->is_closed = 1;
+    return (status == PGRES_COPY_IN ||
+            status == PGRES_COPY_OUT ||
+            status == PGRES_COPY_BOTH);
 }
 
-void destroy_Cursor(lily_postgres_Cursor *r)
+/* A COPY statement leaves the connection in copy mode, and PQgetResult returns
+   a new COPY result for as long as it stays there. Loops that collect every
+   result use this to end the copy, the way PQexec does, so that the loop can
+   finish. Returns 1 if `raw_result` started a copy. */
+int end_copy(PGconn *conn, PGresult *raw_result)
 {
-    close_result(r);
+    ExecStatusType status = PQresultStatus(raw_result);
+    char *buffer;
+
+    if (result_copying(raw_result) == 0)
+        return 0;
+
+    if (status != PGRES_COPY_OUT)
+        PQputCopyEnd(conn, "COPY is not supported here.");
+
+    if (status != PGRES_COPY_IN)
+        while (PQgetCopyData(conn, &buffer, 0) > 0)
+            PQfreemem(buffer);
+
+    return 1;
 }
 
-/**
-define Cursor.close
+/* Typed access to fields goes through a decoder, which is picked for each column
+   when a Cursor is made. A decoder has a function for each kind of value that
+   its type can be read as, and NULL for the rest. Each function reads a field's
+   text, which ends with a zero byte, and returns 0 if the text is not valid. */
+typedef struct {
+    int (*to_integer)(const char *text, int64_t *out);
+    int (*to_double)(const char *text, double *out);
+    int (*to_boolean)(const char *text, int *out);
+    int (*to_epoch_micros)(const char *text, int64_t *out);
+    int (*to_date)(const char *text, int64_t *out);
+    int (*to_interval_micros)(const char *text, int64_t *out);
+} field_decoder;
 
-Close a `Cursor` and free all data associated with it. If this is not done
-manually, then it is done automatically when the `Cursor` is destroyed through
-either the gc or refcounting.
-*/
-void lily_postgres_Cursor_close(lily_state *s)
+typedef struct column_type_ {
+    const field_decoder *decoder;
+    /* Arrays read their elements with this, and it is NULL otherwise. */
+    const field_decoder *element;
+    char delimiter;
+} column_type;
+
+int decode_integer(const char *text, int64_t *out)
 {
-    lily_postgres_Cursor *to_close = ARG_Cursor(s, 0);
+    char *end;
+
+    errno = 0;
+    long long value = strtoll(text, &end, 10);
 
-    close_result(to_close);
-    to_close->row_count = 0;
+    if (end == text || *end != '\0' || errno)
+        return 0;
+
+    *out = value;
+    return 1;
 }
 
-/**
-define Cursor.each_row(fn: Function(List[String]))
+int decode_double(const char *text, double *out)
+{
+    char *end;
+    double value = strtod(text, &end);
 
-This loops through each row in `self`, calling `fn` for each row that is found.
-If `self` has no rows, or has been closed, then this does nothing.
-*/
-void lily_postgres_Cursor_each_row(lily_state *s)
+    if (end == text || *end != '\0')
+        return 0;
+
+    *out = value;
+    return 1;
+}
+
+int decode_boolean(const char *text, int *out)
 {
-    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    if (text[1] != '\0' || (text[0] != 't' && text[0] != 'f'))
+        return 0;
 
-    PGresult *raw_result = boxed_result->pg_result;
-    if (raw_result == NULL || boxed_result->row_count == 0)
-        return;
+    *out = (text[0] == 't');
+    return 1;
+}
 
-    lily_call_prepare(s, lily_arg_function(s, 1));
+/* Time fields are read in the fixed formats that the server sends when
+   DateStyle is ISO and IntervalStyle is postgres, which Conn.open sets. */
+#define MICROS_PER_SECOND INT64_C(1000000)
+#define MICROS_PER_DAY (INT64_C(86400) * MICROS_PER_SECOND)
 
-    int row;
-    for (row = 0;row < boxed_result->row_count;row++) {
-        int num_cols = boxed_result->column_count;
-        lily_container_val *lv = lily_push_list(s, num_cols);
+/* Read exactly `count` digits from `p`. */
+int read_digits(const char **p, int count, int64_t *out)
+{
+    const char *start = *p;
+    int64_t value = 0;
+    int i;
 
-        int col;
-        for (col = 0;col < num_cols;col++) {
-            char *field_text;
+    for (i = 0;i < count;i++) {
+        if (start[i] < '0' || start[i] > '9')
+            return 0;
 
-            if (PQgetisnull(raw_result, row, col))
-                field_text = "(null)";
-            else
-                field_text = PQgetvalue(raw_result, row, col);
+        value = value * 10 + (start[i] - '0');
+    }
 
-            lily_push_string(s, field_text);
-            lily_con_set_from_stack(s, lv, col);
-        }
+    *p = start + count;
+    *out = value;
+    return 1;
+}
 
-        lily_call(s, 1);
+/* Read one or more digits from `p`. */
+int read_number(const char **p, int64_t *out)
+{
+    int count = strspn(*p, "0123456789");
+
+    return count && count < 16 && read_digits(p, count, out);
+}
+
+/* Read up to 6 digits after a decimal point as microseconds. */
+int64_t read_fraction(const char **p)
+{
+    const char *s = *p;
+    int64_t value = 0, scale = 100000;
+
+    if (*s != '.')
+        return 0;
+
+    s++;
+
+    while (*s >= '0' && *s <= '9') {
+        value += (*s - '0') * scale;
+        scale /= 10;
+        s++;
     }
+
+    *p = s;
+    return value;
 }
 
-/**
-define Cursor.row_count: Integer
+/* Days from 1970-01-01 to the given day of the proleptic Gregorian calendar. */
+int64_t days_from_civil(int64_t year, int64_t month, int64_t day)
+{
+    year -= month <= 2;
 
-Returns the number of rows present within `self`.
-*/
-void lily_postgres_Cursor_row_count(lily_state *s)
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int64_t year_of_era = year - era * 400;
+    int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 +
+                          day - 1;
+    int64_t day_of_era = year_of_era * 365 + year_of_era / 4 -
+                         year_of_era / 100 + day_of_year;
+
+    return era * 146097 + day_of_era - 719468;
+}
+
+/* Read "YYYY-MM-DD" as days since 1970-01-01. The year may be longer. */
+int read_date(const char **p, int64_t *out)
 {
-    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    int64_t year, month, day;
+
+    if (read_number(p, &year) == 0 || **p != '-')
+        return 0;
+
+    (*p)++;
+
+    if (read_digits(p, 2, &month) == 0 || **p != '-')
+        return 0;
+
+    (*p)++;
+
+    if (read_digits(p, 2, &day) == 0 ||
+        month < 1 || month > 12 || day < 1 || day > 31)
+        return 0;
 
-    lily_return_integer(s, boxed_result->current_row);
+    /* There is no year 0, so 1 BC is year 0 of the calendar. */
+    if (strstr(*p, " BC") != NULL)
+        year = 1 - year;
+
+    *out = days_from_civil(year, month, day);
+    return 1;
 }
 
-/**
-foreign class Conn {
-    layout {
-        uint64_t is_open;
-        PGconn *conn;
-    }
+/* Read the " BC" that ends dates before year 1, if it is there. */
+void skip_era(const char **p)
+{
+    if (strncmp(*p, " BC", 3) == 0)
+        *p += 3;
 }
 
-The `Conn` class represents a connection to a postgres server.
-*/
+/* Infinite times are given the largest and smallest values. */
+int read_infinity(const char *text, int64_t *out)
+{
+    if (strcmp(text, "infinity") == 0)
+        *out = INT64_MAX;
+    else if (strcmp(text, "-infinity") == 0)
+        *out = INT64_MIN;
+    else
+        return 0;
 
-void destroy_Conn(lily_postgres_Conn *conn_value)
+    return 1;
+}
+
+int decode_date(const char *text, int64_t *out)
 {
-    PQfinish(conn_value->conn);
+    const char *p = text;
+
+    if (read_infinity(text, out))
+        return 1;
+
+    if (read_date(&p, out) == 0)
+        return 0;
+
+    skip_era(&p);
+    return *p == '\0';
 }
 
-/**
-define Conn.query(format: String, values: String...): Result[String, Cursor]
+int decode_date_micros(const char *text, int64_t *out)
+{
+    int64_t days;
 
-Perform a query using `format`. Any `"?"` value found within `format` will be
-replaced with an entry from `values`.
+    if (read_infinity(text, out))
+        return 1;
 
-On success, the result is a `Success` containing a `Cursor`.
+    if (decode_date(text, &days) == 0)
+        return 0;
 
-On failure, the result is a `Failure` containing a `String` describing the error.
-*/
-void lily_postgres_Conn_query(lily_state *s)
+    *out = days * MICROS_PER_DAY;
+    return 1;
+}
+
+/* Read "YYYY-MM-DD HH:MM:SS[.ffffff][+HH[:MM[:SS]]][ BC]". */
+int decode_timestamp(const char *text, int64_t *out)
 {
-    lily_postgres_Conn *conn_value = ARG_Conn(s, 0);
-    char *fmt = lily_arg_string_raw(s, 1);
-    lily_container_val *vararg_lv = lily_arg_container(s, 2);
+    const char *p = text;
+    int64_t days, hour, minute, second, micros;
 
-    int arg_pos = 0, fmt_index = 0, text_start = 0, text_stop = 0;
-    lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+    if (read_infinity(text, out))
+        return 1;
 
-    int num_values = lily_con_size(vararg_lv);
+    if (read_date(&p, &days) == 0 || *p != ' ')
+        return 0;
 
-    while (1) {
-        char ch = fmt[fmt_index];
+    p++;
 
-        if (ch == '?') {
-            if (arg_pos == num_values) {
-                lily_container_val *variant = lily_push_failure(s);
-                lily_push_string(s, "Not enough arguments for format.\n");
-                lily_con_set_from_stack(s, variant, 0);
-                lily_return_top(s);
-                return;
-            }
+    if (read_digits(&p, 2, &hour) == 0 || *p++ != ':' ||
+        read_digits(&p, 2, &minute) == 0 || *p++ != ':' ||
+        read_digits(&p, 2, &second) == 0)
+        return 0;
 
-            lily_mb_add_slice(msgbuf, fmt, text_start, text_stop);
-            text_start = fmt_index + 1;
-            text_stop = text_start;
+    micros = days * MICROS_PER_DAY +
+             (hour * 3600 + minute * 60 + second) * MICROS_PER_SECOND +
+             read_fraction(&p);
 
-            lily_value *v = lily_con_get(vararg_lv, arg_pos);
-            lily_mb_add(msgbuf, lily_as_string_raw(v));
-            arg_pos++;
+    /* Only timestamptz has an offset, which is the zone's distance ahead. */
+    if (*p == '+' || *p == '-') {
+        int sign = (*p == '-') ? -1 : 1;
+        int64_t zone_hour, zone_minute = 0, zone_second = 0;
+
+        p++;
+
+        if (read_digits(&p, 2, &zone_hour) == 0)
+            return 0;
+
+        if (*p == ':' && (p++, read_digits(&p, 2, &zone_minute) == 0))
+            return 0;
+
+        if (*p == ':' && (p++, read_digits(&p, 2, &zone_second) == 0))
+            return 0;
+
+        micros -= sign * (zone_hour * 3600 + zone_minute * 60 + zone_second) *
+                  MICROS_PER_SECOND;
+    }
+
+    skip_era(&p);
+
+    if (*p != '\0')
+        return 0;
+
+    *out = micros;
+    return 1;
+}
+
+/* Read an interval such as "1 year 2 mons -3 days +04:05:06.7". As with
+   extracting the epoch of an interval on the server, a year is 365.25 days and
+   a month is 30 days. */
+int decode_interval(const char *text, int64_t *out)
+{
+    const char *p = text;
+    int64_t months = 0, days = 0, micros = 0;
+
+    if (*p == '\0')
+        return 0;
+
+    while (*p) {
+        int sign = 1;
+        int64_t value;
+
+        if (*p == '-' || *p == '+') {
+            sign = (*p == '-') ? -1 : 1;
+            p++;
         }
-        else {
-            if (ch == '\0')
-                break;
 
-            text_stop++;
+        if (read_number(&p, &value) == 0)
+            return 0;
+
+        if (*p == ':') {
+            int64_t minute, second;
+
+            p++;
+
+            if (read_digits(&p, 2, &minute) == 0 || *p++ != ':' ||
+                read_digits(&p, 2, &second) == 0)
+                return 0;
+
+            micros += sign * ((value * 3600 + minute * 60 + second) *
+                              MICROS_PER_SECOND + read_fraction(&p));
         }
+        else if (*p == ' ') {
+            int size;
 
-        fmt_index++;
-    }
+            p++;
+            size = strcspn(p, " ");
 
-    const char *query_string;
+            if (strncmp(p, "year", 4) == 0 && (size == 4 || size == 5))
+                months += sign * value * 12;
+            else if (strncmp(p, "mon", 3) == 0 && (size == 3 || size == 4))
+                months += sign * value;
+            else if (strncmp(p, "day", 3) == 0 && (size == 3 || size == 4))
+                days += sign * value;
+            else
+                return 0;
 
-    /* If there are no ?'s in the format string, then it can be used as-is. */
-    if (text_start == 0)
-        query_string = fmt;
-    else {
-        lily_mb_add_slice(msgbuf, fmt, text_start, text_stop);
-        query_string = lily_mb_raw(msgbuf);
+            p += size;
+        }
+        else
+            return 0;
+
+        if (*p == ' ')
+            p++;
     }
 
-    PGresult *raw_result = PQexec(conn_value->conn, query_string);
+    *out = (months / 12) * INT64_C(31557600) * MICROS_PER_SECOND +
+           (months % 12) * 30 * MICROS_PER_DAY +
+           days * MICROS_PER_DAY + micros;
+    return 1;
+}
 
-    ExecStatusType status = PQresultStatus(raw_result);
-    if (status == PGRES_BAD_RESPONSE ||
-        status == PGRES_NONFATAL_ERROR ||
-        status == PGRES_FATAL_ERROR) {
-        lily_container_val *variant = lily_push_failure(s);
-        lily_push_string(s, PQerrorMessage(conn_value->conn));
-        lily_con_set_from_stack(s, variant, 0);
-        lily_return_top(s);
+const field_decoder text_decoder = {NULL, NULL, NULL, NULL, NULL, NULL};
+const field_decoder integer_decoder = {decode_integer, decode_double, NULL,
+        NULL, NULL, NULL};
+const field_decoder float_decoder = {NULL, decode_double, NULL, NULL, NULL,
+        NULL};
+/* Numeric fields only work as an Integer if they have no fraction. */
+const field_decoder numeric_decoder = {decode_integer, decode_double, NULL,
+        NULL, NULL, NULL};
+const field_decoder boolean_decoder = {NULL, NULL, decode_boolean, NULL, NULL,
+        NULL};
+const field_decoder timestamp_decoder = {NULL, NULL, NULL, decode_timestamp,
+        NULL, NULL};
+const field_decoder date_decoder = {NULL, NULL, NULL, decode_date_micros,
+        decode_date, NULL};
+const field_decoder interval_decoder = {NULL, NULL, NULL, NULL, NULL,
+        decode_interval};
+
+/* A copy of the parts of pg_type needed to find a decoder, sorted by oid. It is
+   loaded by a Conn the first time a result has a type that is not built in. */
+typedef struct {
+    Oid oid;
+    Oid base;
+    Oid element;
+    char category;
+    char delimiter;
+} type_entry;
+
+typedef struct type_registry_ {
+    type_entry *entries;
+    int count;
+} type_registry;
+
+void free_type_registry(type_registry *r)
+{
+    if (r == NULL)
         return;
+
+    free(r->entries);
+    free(r);
+}
+
+type_registry *load_type_registry(PGconn *conn)
+{
+    PGresult *raw_result = PQexec(conn,
+            "SELECT oid, typbasetype, typelem, typcategory, typdelim"
+            " FROM pg_catalog.pg_type ORDER BY oid");
+
+    if (PQresultStatus(raw_result) != PGRES_TUPLES_OK) {
+        PQclear(raw_result);
+        return NULL;
     }
 
-    lily_container_val *variant = lily_push_success(s);
+    type_registry *r = malloc(sizeof(*r));
+    int count = PQntuples(raw_result);
+    int i;
 
-    lily_postgres_Cursor *res = INIT_Cursor(s);
-    res->current_row = 0;
-    res->is_closed = 0;
-    res->pg_result = raw_result;
-    res->row_count = PQntuples(raw_result);
-    res->column_count = PQnfields(raw_result);
+    r->entries = malloc((count ? count : 1) * sizeof(*r->entries));
+    r->count = count;
 
-    lily_con_set_from_stack(s, variant, 0);
-    lily_return_top(s);
+    for (i = 0;i < count;i++) {
+        type_entry *e = &r->entries[i];
+
+        e->oid = strtoul(PQgetvalue(raw_result, i, 0), NULL, 10);
+        e->base = strtoul(PQgetvalue(raw_result, i, 1), NULL, 10);
+        e->element = strtoul(PQgetvalue(raw_result, i, 2), NULL, 10);
+        e->category = PQgetvalue(raw_result, i, 3)[0];
+        e->delimiter = PQgetvalue(raw_result, i, 4)[0];
+    }
+
+    PQclear(raw_result);
+    return r;
 }
 
-/**
-static define Conn.open(
-    host: *String="",
-    port: *String="",
-    dbname: *String="",
-    name: *String="",
-    pass: *String=""): Result[String, Conn]
+type_entry *find_type(type_registry *r, Oid oid)
+{
+    int low = 0, high = r->count - 1;
 
-Attempt to connect to the postgres server, using the values provided.
+    while (low <= high) {
+        int mid = low + (high - low) / 2;
+        Oid mid_oid = r->entries[mid].oid;
 
-If able to connect, the result is a `Success` containing the `Conn`.
+        if (mid_oid == oid)
+            return &r->entries[mid];
+        else if (mid_oid < oid)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
 
-Otherwise, the result is a `Failure` containing an error message.
-*/
-void lily_postgres_Conn_open(lily_state *s)
+    return NULL;
+}
+
+/* Returns the decoder for a built in scalar type, or NULL. */
+const field_decoder *builtin_decoder(Oid oid)
 {
-    const char *host = NULL;
-    const char *port = NULL;
-    const char *dbname = NULL;
-    const char *name = NULL;
-    const char *pass = NULL;
+    switch (oid) {
+        case BOOLOID:
+            return &boolean_decoder;
+        case INT8OID:
+        case INT2OID:
+        case INT4OID:
+        case 26: /* oid */
+            return &integer_decoder;
+        case FLOAT4OID:
+        case FLOAT8OID:
+            return &float_decoder;
+        case NUMERICOID:
+            return &numeric_decoder;
+        case TIMESTAMPOID:
+        case TIMESTAMPTZOID:
+            return &timestamp_decoder;
+        case DATEOID:
+            return &date_decoder;
+        case INTERVALOID:
+            return &interval_decoder;
+        case BYTEAOID:
+        case TEXTOID:
+        case 18:   /* char */
+        case 19:   /* name */
+        case 1042: /* bpchar */
+        case 1043: /* varchar */
+            return &text_decoder;
+    }
 
-    switch (lily_arg_count(s)) {
-        case 5:
-            pass = lily_arg_string_raw(s, 4);
-        case 4:
-            name = lily_arg_string_raw(s, 3);
-        case 3:
-            dbname = lily_arg_string_raw(s, 2);
-        case 2:
-            port = lily_arg_string_raw(s, 1);
-        case 1:
-            host = lily_arg_string_raw(s, 0);
+    return NULL;
+}
+
+/* Returns the element type of a built in array type, or 0. */
+Oid builtin_array_element(Oid oid)
+{
+    switch (oid) {
+        case 1000: return BOOLOID;
+        case 1001: return BYTEAOID;
+        case 1002: return 18;
+        case 1003: return 19;
+        case 1005: return INT2OID;
+        case 1007: return INT4OID;
+        case 1009: return TEXTOID;
+        case 1014: return 1042;
+        case 1015: return 1043;
+        case 1016: return INT8OID;
+        case 1021: return FLOAT4OID;
+        case 1022: return FLOAT8OID;
+        case 1028: return 26;
+        case 1115: return TIMESTAMPOID;
+        case 1182: return DATEOID;
+        case 1185: return TIMESTAMPTZOID;
+        case 1187: return INTERVALOID;
+        case 1231: return NUMERICOID;
     }
 
-    PGconn *conn = PQsetdbLogin(host, port, NULL, NULL, dbname, name, pass);
-    lily_postgres_Conn *new_val;
-    lily_container_val *variant;
+    return 0;
+}
 
-    switch (PQstatus(conn)) {
-        case CONNECTION_OK:
-            variant = lily_push_success(s);
+/* Find the decoder for a scalar type, looking through domains. Types that are
+   not known, such as enums and citext, are read as text. */
+const field_decoder *scalar_decoder(type_registry *r, Oid oid)
+{
+    int depth;
+
+    for (depth = 0;depth < 8;depth++) {
+        const field_decoder *decoder = builtin_decoder(oid);
 
-            new_val = INIT_Conn(s);
-            new_val->is_open = 1;
-            new_val->conn = conn;
+        if (decoder)
+            return decoder;
 
-            lily_con_set_from_stack(s, variant, 0);
+        type_entry *e = r ? find_type(r, oid) : NULL;
+
+        if (e == NULL)
             break;
-        default:
-            variant = lily_push_failure(s);
-            lily_push_string(s, PQerrorMessage(conn));
-            lily_con_set_from_stack(s, variant, 0);
+        else if (e->base)
+            oid = e->base;
+        else if (e->category == 'N')
+            return &numeric_decoder;
+        else if (e->category == 'B')
+            return &boolean_decoder;
+        else
             break;
     }
 
-    lily_return_top(s);
+    return &text_decoder;
+}
+
+void resolve_column_type(type_registry *r, Oid oid, column_type *out)
+{
+    Oid element = builtin_array_element(oid);
+    char delimiter = ',';
+    int depth;
+
+    /* Domains over arrays go to the array type first. */
+    for (depth = 0;element == 0 && r && depth < 8;depth++) {
+        type_entry *e = find_type(r, oid);
+
+        if (e == NULL)
+            break;
+        else if (e->base)
+            oid = e->base;
+        else {
+            if (e->category == 'A' && e->element) {
+                element = e->element;
+                delimiter = e->delimiter;
+            }
+
+            break;
+        }
+
+        element = builtin_array_element(oid);
+    }
+
+    if (element) {
+        out->decoder = &text_decoder;
+        out->element = scalar_decoder(r, element);
+        out->delimiter = delimiter;
+    }
+    else {
+        out->decoder = scalar_decoder(r, oid);
+        out->element = NULL;
+        out->delimiter = ',';
+    }
+}
+
+/* Returns 1 if `oid` can be resolved without the registry. */
+int type_is_builtin(Oid oid)
+{
+    return builtin_decoder(oid) != NULL || builtin_array_element(oid) != 0;
+}
+
+/**
+foreign class Cursor {
+    layout {
+        uint64_t column_count;
+        uint64_t row_count;
+        uint64_t current_row;
+        uint64_t is_closed;
+        uint64_t auto_close;
+        uint64_t memory_bytes;
+        uint64_t column_hash_mask;
+        uint32_t *column_hash;
+        struct column_type_ *column_types;
+        PGresult *pg_result;
+        struct row_store_ *store;
+        struct column_store_ *columns;
+    }
+}
+
+The `Cursor` class provides a wrapper over the result of querying the postgres
+database. The class provides a very basic set of methods to allow interaction
+with the rows as a `List[String]`.
+
+The rows of a `Cursor` are usually held in libpq's result. A `Cursor` made by
+`Conn.query_spill` instead holds its rows in a row store, which keeps rows in
+memory up to a limit and then moves on to a temporary file. `Cursor.compact`
+copies rows out of libpq's result into a smaller form and frees the result.
+Every method works the same way for each kind of `Cursor`.
+
+When a `Cursor` is made, the type of each column is looked up once so that
+methods such as `Cursor.get_integer` know how to read it. Types that are not
+built into postgres, such as domains and enums, are found through `pg_type`.
+A `Conn` loads `pg_type` the first time it sees such a type, and keeps it.
+
+The memory of a result is held by libpq, outside of Lily. A `Cursor` frees it
+as soon as the last reference to the `Cursor` goes away. The exception is a
+`Cursor` that can only be reached through a cycle, such as a closure stored in
+a value that it captures. That `Cursor` waits for the gc, which does not know
+how large the result is. To free large results at a known time, use
+`Cursor.close` or `Cursor.set_auto_close`. `Cursor.live_bytes` shows how much
+is being held, and `Cursor.set_memory_limit` puts a ceiling on it.
+*/
+
+/* A row store holds rows outside of a PGresult. Each row is a header of
+   (offset, size) pairs for each field, followed by the field text. Fields end
+   with a zero byte like libpq's do, and null fields have an offset of -1. Rows
+   start on 4 byte boundaries so the header can be read directly.
+
+   Rows are added to `memory` until `memory_limit` is reached. The offsets of
+   those rows are in `row_offsets`. Both grow by doubling, and what they have
+   allocated, not what they use, is kept within the limit. The rest of the rows
+   go to `spill`, and their offsets in that file go to `spill_index`. Both files
+   are mapped into memory once every row has been added, so memory only grows
+   by the limit (plus room to build the row being spilled) no matter how many
+   rows spill. */
+typedef struct row_store_ {
+    char *memory;
+    uint64_t memory_size;
+    uint64_t memory_used;
+    uint64_t memory_limit;
+    uint64_t memory_rows;
+    uint64_t *row_offsets;
+    uint64_t row_count;
+    uint64_t row_space;
+    FILE *spill;
+    uint64_t spill_size;
+    char *map;
+    FILE *spill_index;
+    uint64_t *index_map;
+    uint64_t column_count;
+    char **names;
+    Oid *types;
+} row_store;
+
+void free_row_store(row_store *store)
+{
+    uint64_t i;
+
+    if (store->map)
+        munmap(store->map, store->spill_size);
+
+    if (store->index_map)
+        munmap(store->index_map,
+               (store->row_count - store->memory_rows) * sizeof(uint64_t));
+
+    if (store->spill)
+        fclose(store->spill);
+
+    if (store->spill_index)
+        fclose(store->spill_index);
+
+    for (i = 0;i < store->column_count;i++)
+        free(store->names[i]);
+
+    free(store->names);
+    free(store->types);
+    free(store->row_offsets);
+    free(store->memory);
+    free(store);
+}
+
+/* A column store is a result that Cursor.compact has copied out of a PGresult.
+   Each column has one block with the text of every field in it, each ending
+   with a zero byte. Field `i` starts at `offsets[i]` and ends before
+   `offsets[i + 1]`. Null fields take no space and have their bit set in
+   `nulls`. */
+typedef struct {
+    char *data;
+    uint32_t *offsets;
+    uint8_t *nulls;
+    char *name;
+    Oid type;
+} compact_column;
+
+typedef struct column_store_ {
+    compact_column *columns;
+    uint64_t column_count;
+    uint64_t size;
+} column_store;
+
+void free_column_store(column_store *store)
+{
+    uint64_t i;
+
+    for (i = 0;i < store->column_count;i++) {
+        compact_column *column = &store->columns[i];
+
+        free(column->data);
+        free(column->offsets);
+        free(column->nulls);
+        free(column->name);
+    }
+
+    free(store->columns);
+    free(store);
+}
+
+/* Copy `col` of `raw_result` into `column`. Returns 0 if the text is too large
+   for 32 bit offsets. */
+int compact_column_from(compact_column *column, PGresult *raw_result, int col)
+{
+    int row_count = PQntuples(raw_result);
+    uint64_t data_size = 0;
+    int row;
+
+    for (row = 0;row < row_count;row++)
+        if (PQgetisnull(raw_result, row, col) == 0)
+            data_size += PQgetlength(raw_result, row, col) + 1;
+
+    if (data_size > UINT32_MAX)
+        return 0;
+
+    column->data = malloc(data_size ? data_size : 1);
+    column->offsets = malloc((row_count + 1) * sizeof(*column->offsets));
+    column->nulls = calloc((row_count + 7) / 8 + 1, 1);
+    column->name = strdup(PQfname(raw_result, col));
+    column->type = PQftype(raw_result, col);
+
+    uint32_t pos = 0;
+
+    for (row = 0;row < row_count;row++) {
+        column->offsets[row] = pos;
+
+        if (PQgetisnull(raw_result, row, col)) {
+            column->nulls[row / 8] |= 1 << (row % 8);
+            continue;
+        }
+
+        int size = PQgetlength(raw_result, row, col);
+
+        memcpy(column->data + pos, PQgetvalue(raw_result, row, col), size + 1);
+        pos += size + 1;
+    }
+
+    column->offsets[row_count] = pos;
+    return 1;
+}
+
+/* Returns the size of a column store with `row_count` rows. */
+uint64_t column_store_size(column_store *store, uint64_t row_count)
+{
+    uint64_t size = sizeof(*store) +
+                    store->column_count * sizeof(*store->columns);
+    uint64_t i;
+
+    for (i = 0;i < store->column_count;i++) {
+        compact_column *column = &store->columns[i];
+
+        size += column->offsets[row_count] +
+                (row_count + 1) * sizeof(*column->offsets) +
+                (row_count + 7) / 8 + 1 + strlen(column->name) + 1;
+    }
+
+    return size;
+}
+
+/* Copy every column of `raw_result` into a new column store. Returns NULL if
+   a column is too large. */
+column_store *new_column_store(PGresult *raw_result)
+{
+    column_store *store = malloc(sizeof(*store));
+    int column_count = PQnfields(raw_result);
+    int col;
+
+    store->columns = calloc(column_count ? column_count : 1,
+            sizeof(*store->columns));
+    store->column_count = 0;
+
+    for (col = 0;col < column_count;col++) {
+        if (compact_column_from(&store->columns[col], raw_result, col) == 0) {
+            free_column_store(store);
+            return NULL;
+        }
+
+        store->column_count++;
+    }
+
+    store->size = column_store_size(store, PQntuples(raw_result));
+    return store;
+}
+
+/* Results held by every open Cursor, which the limit (if not 0) applies to.
+   Interpreters on other threads can share these, so they are atomic. */
+_Atomic uint64_t live_result_bytes = 0;
+_Atomic uint64_t result_byte_limit = 0;
+
+/* Add `size` to the live bytes, unless that would pass the limit. Returns 0
+   if it would. Checking and adding are one step, so that two threads cannot
+   both pass the check and then go past the limit together. */
+int reserve_result_bytes(uint64_t size)
+{
+    uint64_t live = atomic_load(&live_result_bytes);
+    uint64_t limit;
+
+    do {
+        limit = atomic_load(&result_byte_limit);
+
+        if (limit && live + size > limit)
+            return 0;
+    } while (atomic_compare_exchange_weak(&live_result_bytes, &live,
+                                          live + size) == 0);
+
+    return 1;
+}
+
+void close_result(lily_postgres_Cursor *result)
+{
+    if (result->is_closed == 0) {
+        live_result_bytes -= result->memory_bytes;
+
+        if (result->store)
+            free_row_store(result->store);
+        else if (result->columns)
+            free_column_store(result->columns);
+        else
+            PQclear(result->pg_result);
+
+        free(result->column_hash);
+        free(result->column_types);
+    }
+
+    result->is_closed = 1;
+}
+
+/* Returns the text of a field and sets `size` to its length, or returns NULL
+   if the field is null. */
+char *cursor_field(lily_postgres_Cursor *c, int row, int col, int *size)
+{
+    row_store *store = c->store;
+
+    if (c->columns) {
+        compact_column *column = &c->columns->columns[col];
+
+        if (column->nulls[row / 8] & (1 << (row % 8)))
+            return NULL;
+
+        *size = column->offsets[row + 1] - column->offsets[row] - 1;
+        return column->data + column->offsets[row];
+    }
+
+    if (store == NULL) {
+        PGresult *raw_result = c->pg_result;
+
+        if (PQgetisnull(raw_result, row, col))
+            return NULL;
+
+        *size = PQgetlength(raw_result, row, col);
+        return PQgetvalue(raw_result, row, col);
+    }
+
+    char *row_start;
+
+    if (row < store->memory_rows)
+        row_start = store->memory + store->row_offsets[row];
+    else
+        row_start = store->map + store->index_map[row - store->memory_rows];
+
+    int32_t *header = (int32_t *)row_start + col * 2;
+
+    if (header[0] == -1)
+        return NULL;
+
+    *size = header[1];
+    return row_start + header[0];
+}
+
+char *cursor_column_name(lily_postgres_Cursor *c, int col)
+{
+    if (c->store)
+        return c->store->names[col];
+    else if (c->columns)
+        return c->columns->columns[col].name;
+
+    return PQfname(c->pg_result, col);
+}
+
+Oid cursor_column_type(lily_postgres_Cursor *c, int col)
+{
+    if (c->store)
+        return c->store->types[col];
+    else if (c->columns)
+        return c->columns->columns[col].type;
+
+    return PQftype(c->pg_result, col);
+}
+
+/* Make a store for rows shaped like `raw_result`, which may be NULL if there
+   are no rows. */
+row_store *new_row_store(PGresult *raw_result, uint64_t memory_limit)
+{
+    row_store *store = calloc(1, sizeof(*store));
+    uint64_t i;
+
+    store->memory_limit = memory_limit;
+
+    if (raw_result)
+        store->column_count = PQnfields(raw_result);
+
+    store->names = malloc((store->column_count + 1) * sizeof(char *));
+    store->types = malloc((store->column_count + 1) * sizeof(Oid));
+
+    for (i = 0;i < store->column_count;i++) {
+        store->names[i] = strdup(PQfname(raw_result, i));
+        store->types[i] = PQftype(raw_result, i);
+    }
+
+    return store;
+}
+
+/* Copy the row in `raw_result` into `store`. Returns 0 if the row could not
+   be written to the temporary file. */
+int row_store_add(row_store *store, PGresult *raw_result)
+{
+    int num_cols = store->column_count;
+    uint64_t header_size = (uint64_t)num_cols * 8;
+    uint64_t size = header_size;
+    int col;
+
+    for (col = 0;col < num_cols;col++) {
+        if (PQgetisnull(raw_result, 0, col) == 0)
+            size += PQgetlength(raw_result, 0, col) + 1;
+    }
+
+    size = (size + 3) & ~(uint64_t)3;
+
+    /* The sizes that memory and the offsets would need to grow to, at least.
+       What is allocated counts toward the limit, not only what is used. */
+    uint64_t limit = store->memory_limit;
+    uint64_t need_size = store->memory_used + size;
+    uint64_t need_space = store->memory_rows + 1;
+    char *row;
+
+    if (need_size < store->memory_size)
+        need_size = store->memory_size;
+
+    if (need_space < store->row_space)
+        need_space = store->row_space;
+
+    int in_memory = (store->spill == NULL &&
+                     need_size <= limit &&
+                     need_space <= (limit - need_size) / sizeof(uint64_t));
+
+    if (in_memory) {
+        /* Both grow by doubling, but never past what the limit leaves. */
+        if (store->memory_used + size > store->memory_size) {
+            uint64_t new_size = store->memory_size ? store->memory_size : 4096;
+            uint64_t max_size = limit - need_space * sizeof(uint64_t);
+
+            while (new_size < store->memory_used + size)
+                new_size *= 2;
+
+            if (new_size > max_size)
+                new_size = max_size;
+
+            store->memory = realloc(store->memory, new_size);
+            store->memory_size = new_size;
+        }
+
+        if (store->memory_rows == store->row_space) {
+            uint64_t new_space = store->row_space ? store->row_space * 2 : 64;
+            uint64_t max_space = (limit - store->memory_size) /
+                                 sizeof(uint64_t);
+
+            if (new_space > max_space)
+                new_space = max_space;
+
+            store->row_offsets = realloc(store->row_offsets,
+                    new_space * sizeof(uint64_t));
+            store->row_space = new_space;
+        }
+
+        row = store->memory + store->memory_used;
+        store->row_offsets[store->row_count] = store->memory_used;
+        store->memory_used += size;
+        store->memory_rows++;
+    }
+    else {
+        if (store->spill == NULL) {
+            store->spill = tmpfile();
+            store->spill_index = tmpfile();
+
+            if (store->spill == NULL || store->spill_index == NULL)
+                return 0;
+        }
+
+        /* Spilled rows are built in the unused part of memory, or in memory
+           made for it if there is none. */
+        if (store->memory_size - store->memory_used < size) {
+            store->memory = realloc(store->memory, store->memory_used + size);
+            store->memory_size = store->memory_used + size;
+        }
+
+        row = store->memory + store->memory_used;
+
+        if (fwrite(&store->spill_size, sizeof(uint64_t), 1,
+                   store->spill_index) != 1)
+            return 0;
+
+        store->spill_size += size;
+    }
+
+    int32_t *header = (int32_t *)row;
+    uint64_t pos = header_size;
+
+    for (col = 0;col < num_cols;col++) {
+        if (PQgetisnull(raw_result, 0, col)) {
+            header[col * 2] = -1;
+            header[col * 2 + 1] = 0;
+            continue;
+        }
+
+        int length = PQgetlength(raw_result, 0, col);
+
+        header[col * 2] = (int32_t)pos;
+        header[col * 2 + 1] = length;
+        memcpy(row + pos, PQgetvalue(raw_result, 0, col), length + 1);
+        pos += length + 1;
+    }
+
+    memset(row + pos, 0, size - pos);
+    store->row_count++;
+
+    if (in_memory == 0 && fwrite(row, 1, size, store->spill) != size)
+        return 0;
+
+    return 1;
+}
+
+/* Map `f`, which holds `size` bytes. Returns NULL on failure. */
+void *map_spill_file(FILE *f, uint64_t size)
+{
+    if (fflush(f) != 0)
+        return NULL;
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+
+    return map == MAP_FAILED ? NULL : map;
+}
+
+/* Free the room that was left for more rows, and the buffer that spilled rows
+   were built in. Then map the spilled rows and their index, if there are
+   any. Returns 0 on failure. */
+int row_store_finish(row_store *store)
+{
+    if (store->memory_size > store->memory_used) {
+        if (store->memory_used) {
+            store->memory = realloc(store->memory, store->memory_used);
+        }
+        else {
+            free(store->memory);
+            store->memory = NULL;
+        }
+
+        store->memory_size = store->memory_used;
+    }
+
+    if (store->row_space > store->memory_rows) {
+        if (store->memory_rows) {
+            store->row_offsets = realloc(store->row_offsets,
+                    store->memory_rows * sizeof(uint64_t));
+        }
+        else {
+            free(store->row_offsets);
+            store->row_offsets = NULL;
+        }
+
+        store->row_space = store->memory_rows;
+    }
+
+    if (store->spill == NULL || store->spill_size == 0)
+        return 1;
+
+    store->map = map_spill_file(store->spill, store->spill_size);
+
+    if (store->map == NULL)
+        return 0;
+
+    store->index_map = map_spill_file(store->spill_index,
+            (store->row_count - store->memory_rows) * sizeof(uint64_t));
+
+    return store->index_map != NULL;
+}
+
+void destroy_Cursor(lily_postgres_Cursor *r)
+{
+    close_result(r);
+}
+
+/* FNV-1a, which is quick for the short names that columns usually have. */
+uint32_t hash_name(const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+        name++;
+    }
+
+    return hash;
+}
+
+/* Column names are put in an open addressing table once, so that finding a
+   column by name does not need to search every name. Slots hold the column
+   index plus one, so that 0 is an empty slot. */
+void build_column_hash(lily_postgres_Cursor *c)
+{
+    uint64_t size = 8;
+    int col;
+
+    while (size < c->column_count * 2)
+        size *= 2;
+
+    c->column_hash = calloc(size, sizeof(*c->column_hash));
+    c->column_hash_mask = size - 1;
+
+    for (col = 0;col < c->column_count;col++) {
+        uint64_t slot = hash_name(cursor_column_name(c, col)) &
+                        c->column_hash_mask;
+
+        while (c->column_hash[slot])
+            slot = (slot + 1) & c->column_hash_mask;
+
+        c->column_hash[slot] = col + 1;
+    }
+}
+
+/* Returns the index of the first column named `name`, or -1. */
+int find_column(lily_postgres_Cursor *c, const char *name)
+{
+    if (c->is_closed)
+        return -1;
+
+    uint64_t slot = hash_name(name) & c->column_hash_mask;
+    int col = -1;
+
+    /* Duplicate names go into later slots, so the lowest index wins. */
+    while (c->column_hash[slot]) {
+        int index = c->column_hash[slot] - 1;
+
+        if ((col == -1 || index < col) &&
+            strcmp(cursor_column_name(c, index), name) == 0)
+            col = index;
+
+        slot = (slot + 1) & c->column_hash_mask;
+    }
+
+    return col;
+}
+
+type_registry *conn_types(lily_postgres_Conn *conn_value, Oid oid);
+
+/* Pick a decoder for each column. Types that are not built in are looked up in
+   the registry of `conn_value`, which may be NULL. */
+void resolve_cursor_types(lily_postgres_Cursor *c,
+        lily_postgres_Conn *conn_value)
+{
+    type_registry *r = NULL;
+    int col;
+
+    c->column_types = malloc((c->column_count ? c->column_count : 1) *
+            sizeof(*c->column_types));
+
+    for (col = 0;col < c->column_count;col++) {
+        Oid oid = cursor_column_type(c, col);
+
+        if (r == NULL && conn_value && type_is_builtin(oid) == 0)
+            r = conn_types(conn_value, oid);
+
+        resolve_column_type(r, oid, &c->column_types[col]);
+    }
+}
+
+/* Push a new Cursor holding either `raw_result` or `store`. The bytes of
+   `raw_result` must already be reserved by reserve_result_bytes. Those of
+   `store` are added here, since query_spill is not limited. */
+lily_postgres_Cursor *push_cursor_for(lily_state *s,
+        lily_postgres_Conn *conn_value, PGresult *raw_result, row_store *store)
+{
+    lily_postgres_Cursor *res = INIT_Cursor(s);
+    res->current_row = 0;
+    res->is_closed = 0;
+    res->pg_result = raw_result;
+    res->store = store;
+    res->columns = NULL;
+
+    res->auto_close = 0;
+
+    if (store) {
+        res->row_count = store->row_count;
+        res->column_count = store->column_count;
+        /* Only the part in memory counts, since the rest is in a file. */
+        res->memory_bytes = store->memory_size +
+                            store->row_space * sizeof(*store->row_offsets);
+        live_result_bytes += res->memory_bytes;
+    }
+    else {
+        res->row_count = PQntuples(raw_result);
+        res->column_count = PQnfields(raw_result);
+        res->memory_bytes = PQresultMemorySize(raw_result);
+    }
+
+    build_column_hash(res);
+    resolve_cursor_types(res, conn_value);
+    return res;
+}
+
+void push_cursor(lily_state *s, PGresult *raw_result)
+{
+    live_result_bytes += PQresultMemorySize(raw_result);
+    push_cursor_for(s, NULL, raw_result, NULL);
+}
+
+/**
+define Cursor.close
+
+Close a `Cursor` and free all data associated with it. If this is not done
+manually, then it is done automatically when the `Cursor` is destroyed through
+either the gc or refcounting.
+*/
+void close_cursor(lily_postgres_Cursor *c)
+{
+    close_result(c);
+    c->row_count = 0;
+    c->column_count = 0;
+}
+
+void lily_postgres_Cursor_close(lily_state *s)
+{
+    lily_postgres_Cursor *to_close = ARG_Cursor(s, 0);
+
+    close_cursor(to_close);
+}
+
+/* Returns the field at the row and column given by arguments 1 and 2, or NULL
+   if it is null, and sets `type` to the type of the column. */
+char *arg_field(lily_state *s, lily_postgres_Cursor *c, column_type **type)
+{
+    int64_t row = lily_arg_integer(s, 1);
+    int64_t col = lily_arg_integer(s, 2);
+    int size;
+
+    if (row < 0 || row >= c->row_count)
+        lily_IndexError(s, "Index %ld is out of range.", (long)row);
+
+    if (col < 0 || col >= c->column_count)
+        lily_IndexError(s, "Column %ld is out of range.", (long)col);
+
+    *type = &c->column_types[col];
+    return cursor_field(c, (int)row, (int)col, &size);
+}
+
+#define VALUE_BOOLEAN 0
+#define VALUE_DOUBLE  1
+#define VALUE_INTEGER 2
+#define VALUE_STRING  3
+
+const char *value_kind_names[] = {"Boolean", "Double", "Integer", "String"};
+
+/* Returns 1 if `decoder` can read fields as `kind`. */
+int decoder_reads(const field_decoder *decoder, int kind)
+{
+    if (kind == VALUE_BOOLEAN)
+        return decoder->to_boolean != NULL;
+    else if (kind == VALUE_DOUBLE)
+        return decoder->to_double != NULL;
+    else if (kind == VALUE_INTEGER)
+        return decoder->to_integer != NULL;
+
+    return 1;
+}
+
+/* Push `text` read as `kind` by `decoder` inside of a Some. Returns 0 without
+   pushing anything if `text` is not valid. */
+int push_some_decoded(lily_state *s, const field_decoder *decoder, int kind,
+        const char *text, int size)
+{
+    int64_t integer_value = 0;
+    double double_value = 0;
+    int boolean_value = 0, ok = 1;
+
+    if (kind == VALUE_INTEGER)
+        ok = decoder->to_integer(text, &integer_value);
+    else if (kind == VALUE_DOUBLE)
+        ok = decoder->to_double(text, &double_value);
+    else if (kind == VALUE_BOOLEAN)
+        ok = decoder->to_boolean(text, &boolean_value);
+
+    if (ok == 0)
+        return 0;
+
+    lily_container_val *variant = lily_push_some(s);
+
+    if (kind == VALUE_STRING)
+        lily_push_string_sized(s, text, size);
+    else if (kind == VALUE_INTEGER)
+        lily_push_integer(s, integer_value);
+    else if (kind == VALUE_DOUBLE)
+        lily_push_double(s, double_value);
+    else
+        lily_push_boolean(s, boolean_value);
+
+    lily_con_set_from_stack(s, variant, 0);
+    return 1;
+}
+
+/* Return every field of the column in argument 1 as a List of Option values,
+   read as `kind`. */
+void return_value_column(lily_state *s, int kind)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    int64_t col = lily_arg_integer(s, 1);
+
+    if (col < 0 || col >= boxed_result->column_count)
+        lily_IndexError(s, "Column %ld is out of range.", (long)col);
+
+    const field_decoder *decoder = boxed_result->column_types[col].decoder;
+
+    if (decoder_reads(decoder, kind) == 0)
+        lily_ValueError(s, "Column cannot be read as %s %s.",
+                kind == VALUE_INTEGER ? "an" : "a", value_kind_names[kind]);
+
+    int row_count = (int)boxed_result->row_count;
+    lily_container_val *lv = lily_push_list(s, row_count);
+    int row, size;
+
+    for (row = 0;row < row_count;row++) {
+        char *text = cursor_field(boxed_result, row, (int)col, &size);
+
+        if (text == NULL)
+            lily_push_none(s);
+        else if (push_some_decoded(s, decoder, kind, text, size) == 0)
+            lily_ValueError(s, "'%s' is not a valid %s.", text,
+                    value_kind_names[kind]);
+
+        lily_con_set_from_stack(s, lv, row);
+    }
+
+    lily_return_top(s);
+}
+
+#define TIME_DATE     0
+#define TIME_EPOCH    1
+#define TIME_INTERVAL 2
+
+typedef int (*time_function)(const char *, int64_t *);
+
+time_function time_decoder(const field_decoder *decoder, int kind)
+{
+    if (kind == TIME_DATE)
+        return decoder->to_date;
+    else if (kind == TIME_EPOCH)
+        return decoder->to_epoch_micros;
+
+    return decoder->to_interval_micros;
+}
+
+const char *time_kind_names[] = {"date", "timestamp", "interval"};
+
+/* Return the field given by arguments 1 and 2 as an Option[Integer], read as
+   `kind`. */
+void return_time_field(lily_state *s, int kind)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    column_type *type;
+    char *text = arg_field(s, boxed_result, &type);
+    time_function fn = time_decoder(type->decoder, kind);
+    int64_t value;
+
+    if (text == NULL) {
+        lily_return_none(s);
+        return;
+    }
+
+    if (fn == NULL)
+        lily_ValueError(s, "Column cannot be read as a %s.",
+                time_kind_names[kind]);
+
+    if (fn(text, &value) == 0)
+        lily_ValueError(s, "'%s' is not a valid %s.", text,
+                time_kind_names[kind]);
+
+    lily_container_val *variant = lily_push_some(s);
+
+    lily_push_integer(s, value);
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/* Return every field of the column in argument 1 as a List[Option[Integer]],
+   read as `kind`. */
+void return_time_column(lily_state *s, int kind)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    int64_t col = lily_arg_integer(s, 1);
+
+    if (col < 0 || col >= boxed_result->column_count)
+        lily_IndexError(s, "Column %ld is out of range.", (long)col);
+
+    time_function fn = time_decoder(boxed_result->column_types[col].decoder,
+            kind);
+
+    if (fn == NULL)
+        lily_ValueError(s, "Column cannot be read as a %s.",
+                time_kind_names[kind]);
+
+    int row_count = (int)boxed_result->row_count;
+    lily_container_val *lv = lily_push_list(s, row_count);
+    int row, size;
+
+    for (row = 0;row < row_count;row++) {
+        char *text = cursor_field(boxed_result, row, (int)col, &size);
+        int64_t value;
+
+        if (text == NULL) {
+            lily_push_none(s);
+            lily_con_set_from_stack(s, lv, row);
+            continue;
+        }
+
+        if (fn(text, &value) == 0)
+            lily_ValueError(s, "'%s' is not a valid %s.", text,
+                    time_kind_names[kind]);
+
+        lily_container_val *variant = lily_push_some(s);
+
+        lily_push_integer(s, value);
+        lily_con_set_from_stack(s, variant, 0);
+        lily_con_set_from_stack(s, lv, row);
+    }
+
+    lily_return_top(s);
+}
+
+/* Aggregates read a column's fields into a small buffer a chunk at a time,
+   skipping nulls, and then run a simple loop over the chunk. */
+#define COLUMN_CHUNK 1024
+
+typedef struct {
+    lily_postgres_Cursor *cursor;
+    const field_decoder *decoder;
+    int col;
+    int row;
+} column_reader;
+
+/* Start reading the column in argument 1, which must be readable as a Double
+   if `want_double` is set, or as an Integer otherwise. */
+void column_reader_init(lily_state *s, column_reader *r, int want_double)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    int64_t col = lily_arg_integer(s, 1);
+
+    if (col < 0 || col >= boxed_result->column_count)
+        lily_IndexError(s, "Column %ld is out of range.", (long)col);
+
+    r->cursor = boxed_result;
+    r->decoder = boxed_result->column_types[col].decoder;
+    r->col = (int)col;
+    r->row = 0;
+
+    if (want_double && r->decoder->to_double == NULL)
+        lily_ValueError(s, "Column cannot be read as a Double.");
+    else if (want_double == 0 && r->decoder->to_integer == NULL)
+        lily_ValueError(s, "Column cannot be read as an Integer.");
+}
+
+int column_read_integers(lily_state *s, column_reader *r, int64_t *out)
+{
+    lily_postgres_Cursor *c = r->cursor;
+    int count = 0, size;
+
+    while (count < COLUMN_CHUNK && r->row < c->row_count) {
+        char *text = cursor_field(c, r->row, r->col, &size);
+
+        r->row++;
+
+        if (text == NULL)
+            continue;
+
+        if (r->decoder->to_integer(text, &out[count]) == 0)
+            lily_ValueError(s, "'%s' is not a valid Integer.", text);
+
+        count++;
+    }
+
+    return count;
+}
+
+int column_read_doubles(lily_state *s, column_reader *r, double *out)
+{
+    lily_postgres_Cursor *c = r->cursor;
+    int count = 0, size;
+
+    while (count < COLUMN_CHUNK && r->row < c->row_count) {
+        char *text = cursor_field(c, r->row, r->col, &size);
+
+        r->row++;
+
+        if (text == NULL)
+            continue;
+
+        if (r->decoder->to_double(text, &out[count]) == 0)
+            lily_ValueError(s, "'%s' is not a valid Double.", text);
+
+        count++;
+    }
+
+    return count;
+}
+
+/* Find the smallest and largest values of the column in argument 1, ignoring
+   NaN, and also infinity if `finite_only` is set. Returns 0 if there are
+   none. */
+int column_double_range(lily_state *s, double *min_out, double *max_out,
+        int finite_only)
+{
+    column_reader r;
+    double chunk[COLUMN_CHUNK];
+    double low = 0, high = 0;
+    int count, i, found = 0;
+
+    column_reader_init(s, &r, 1);
+
+    while ((count = column_read_doubles(s, &r, chunk)) != 0) {
+        for (i = 0;i < count;i++) {
+            double value = chunk[i];
+
+            if (value != value || (finite_only && isfinite(value) == 0))
+                continue;
+
+            if (found == 0) {
+                low = high = value;
+                found = 1;
+            }
+
+            low = value < low ? value : low;
+            high = value > high ? value : high;
+        }
+    }
+
+    *min_out = low;
+    *max_out = high;
+    return found;
+}
+
+/* Find the smallest and largest values of the column in argument 1. Returns 0
+   if there are none. */
+int column_integer_range(lily_state *s, int64_t *min_out, int64_t *max_out)
+{
+    column_reader r;
+    int64_t chunk[COLUMN_CHUNK];
+    int64_t low = INT64_MAX, high = INT64_MIN;
+    int count, i, found = 0;
+
+    column_reader_init(s, &r, 0);
+
+    while ((count = column_read_integers(s, &r, chunk)) != 0) {
+        found = 1;
+
+        for (i = 0;i < count;i++) {
+            low = chunk[i] < low ? chunk[i] : low;
+            high = chunk[i] > high ? chunk[i] : high;
+        }
+    }
+
+    *min_out = low;
+    *max_out = high;
+    return found;
+}
+
+void return_some_integer(lily_state *s, int64_t value)
+{
+    lily_container_val *variant = lily_push_some(s);
+
+    lily_push_integer(s, value);
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+void return_some_double(lily_state *s, double value)
+{
+    lily_container_val *variant = lily_push_some(s);
+
+    lily_push_double(s, value);
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/**
+define Cursor.column_boolean(column: Integer): List[Option[Boolean]]
+
+Returns every field of `column` read as `Cursor.get_boolean` reads one field.
+The List is made at its full size, and filled in one pass without calling back
+into Lily.
+
+# Errors
+
+* `IndexError` if `column` is out of range.
+
+* `ValueError` if the column cannot be read as a `Boolean`.
+*/
+void lily_postgres_Cursor_column_boolean(lily_state *s)
+{
+    return_value_column(s, VALUE_BOOLEAN);
+}
+
+/**
+define Cursor.column_date(column: Integer): List[Option[Integer]]
+
+Returns every field of `column` read as `Cursor.get_date` reads one field. The
+column is checked and converted in a single pass, so this is faster than calling
+`Cursor.get_date` for each row.
+
+# Errors
+
+* `IndexError` if `column` is out of range.
+
+* `ValueError` if the column's type is not `date`, or a field is not valid.
+*/
+void lily_postgres_Cursor_column_date(lily_state *s)
+{
+    return_time_column(s, TIME_DATE);
+}
+
+/**
+define Cursor.column_double(column: Integer): List[Option[Double]]
+
+Returns every field of `column` read as `Cursor.get_double` reads one field, in
+a single pass.
+
+# Errors
+
+* `IndexError` if `column` is out of range.
+
+* `ValueError` if the column cannot be read as a `Double`.
+*/
+void lily_postgres_Cursor_column_double(lily_state *s)
+{
+    return_value_column(s, VALUE_DOUBLE);
+}
+
+/**
+define Cursor.column_epoch_micros(column: Integer): List[Option[Integer]]
+
+Returns every field of `column` read as `Cursor.get_epoch_micros` reads one
+field, in a single pass.
+
+# Errors
+
+* `IndexError` if `column` is out of range.
+
+* `ValueError` if the column's type cannot be read as a timestamp, or a field is
+  not valid.
+*/
+void lily_postgres_Cursor_column_epoch_micros(lily_state *s)
+{
+    return_time_column(s, TIME_EPOCH);
+}
+
+/**
+define Cursor.column_integer(column: Integer): List[Option[Integer]]
+
+Returns every field of `column` read as `Cursor.get_integer` reads one field, in
+a single pass.
+
+# Errors
+
+* `IndexError` if `column` is out of range.
+
+* `ValueError` if the column cannot be read as an `Integer`.
+*/
+void lily_postgres_Cursor_column_integer(lily_state *s)
+{
+    return_value_column(s, VALUE_INTEGER);
+}
+
+/**
+define Cursor.column_interval_micros(column: Integer): List[Option[Integer]]
+
+Returns every field of `column` read as `Cursor.get_interval_micros` reads one
+field, in a single pass.
+
+# Errors
+
+* `IndexError` if `column` is out of range.
+
+* `ValueError` if the column's type is not `interval`, or a field is not valid.
+*/
+void lily_postgres_Cursor_column_interval_micros(lily_state *s)
+{
+    return_time_column(s, TIME_INTERVAL);
+}
+
+/**
+define Cursor.column_index(name: String): Option[Integer]
+
+Returns the index of the column called `name`, or `None` if there is no such
+column. If several columns have that name, the first is used. Names are matched
+exactly as the server sent them, without folding case. Column names are indexed
+when the `Cursor` is made, so this does not search through every name.
+*/
+void lily_postgres_Cursor_column_index(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    int col = find_column(boxed_result, lily_arg_string_raw(s, 1));
+
+    if (col == -1) {
+        lily_return_none(s);
+        return;
+    }
+
+    lily_container_val *variant = lily_push_some(s);
+
+    lily_push_integer(s, col);
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/**
+define Cursor.column_names: List[String]
+
+Returns the name of each column in `self`, in order. If `self` has been closed,
+the result is empty.
+*/
+void lily_postgres_Cursor_column_names(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    int num_cols = boxed_result->is_closed ? 0 : boxed_result->column_count;
+    lily_container_val *lv = lily_push_list(s, num_cols);
+    int col;
+
+    for (col = 0;col < num_cols;col++) {
+        lily_push_string(s, cursor_column_name(boxed_result, col));
+        lily_con_set_from_stack(s, lv, col);
+    }
+
+    lily_return_top(s);
+}
+
+/**
+define Cursor.column_string(column: Integer): List[Option[String]]
+
+Returns every field of `column` as a `List`, with `None` for null fields. Any
+column can be read this way.
+
+# Errors
+
+* `IndexError` if `column` is out of range.
+*/
+void lily_postgres_Cursor_column_string(lily_state *s)
+{
+    return_value_column(s, VALUE_STRING);
+}
+
+/**
+define Cursor.compact
+
+Copy the rows of `self` out of libpq's result into one block of memory per
+column, then free the result. Every method works the same way afterward, but
+the rows take less memory. This is best done right after a query, for a
+`Cursor` that will be kept for a while. A `Cursor` that is closed, or was made
+by `Conn.query_spill`, or has already been compacted, is left alone.
+
+# Errors
+
+* `ValueError` if a column holds 4GB of text or more.
+*/
+void lily_postgres_Cursor_compact(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+
+    if (boxed_result->is_closed || boxed_result->store ||
+        boxed_result->columns)
+        return;
+
+    PGresult *raw_result = boxed_result->pg_result;
+    column_store *store = new_column_store(raw_result);
+
+    if (store == NULL)
+        lily_ValueError(s, "Result is too large to compact.");
+
+    live_result_bytes -= boxed_result->memory_bytes;
+    boxed_result->memory_bytes = store->size;
+    live_result_bytes += boxed_result->memory_bytes;
+    boxed_result->columns = store;
+    boxed_result->pg_result = NULL;
+    PQclear(raw_result);
+}
+
+/**
+define Cursor.count_nonnull(column: Integer): Integer
+
+Returns how many fields of `column` are not null.
+
+# Errors
+
+* `IndexError` if `column` is out of range.
+*/
+void lily_postgres_Cursor_count_nonnull(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    int64_t col = lily_arg_integer(s, 1);
+    int64_t total = 0;
+    int row, size;
+
+    if (col < 0 || col >= boxed_result->column_count)
+        lily_IndexError(s, "Column %ld is out of range.", (long)col);
+
+    for (row = 0;row < boxed_result->row_count;row++)
+        total += cursor_field(boxed_result, row, (int)col, &size) != NULL;
+
+    lily_return_integer(s, total);
+}
+
+/* Push `row` as a List[String], the way that each_row sends it. */
+void push_row(lily_state *s, lily_postgres_Cursor *c, int row)
+{
+    int num_cols = c->column_count;
+    lily_container_val *lv = lily_push_list(s, num_cols);
+
+    int col;
+    for (col = 0;col < num_cols;col++) {
+        int size;
+        char *field_text = cursor_field(c, row, col, &size);
+
+        if (field_text == NULL)
+            field_text = "(null)";
+
+        lily_push_string(s, field_text);
+        lily_con_set_from_stack(s, lv, col);
+    }
+}
+
+/**
+define Cursor.each_batch(size: Integer, fn: Function(List[List[String]]))
+
+This is like `Cursor.each_row`, except that `fn` is sent a `List` of up to
+`size` rows at a time, in order. Only the last batch can have fewer than `size`
+rows. Sending rows in batches means that `fn` is called fewer times, which helps
+most when rows are small. Like `Cursor.each_row`, this honors
+`Cursor.set_auto_close`.
+
+# Errors
+
+* `ValueError` if `size` is less than 1.
+*/
+void lily_postgres_Cursor_each_batch(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    int64_t size = lily_arg_integer(s, 1);
+
+    if (size < 1)
+        lily_ValueError(s, "Batch size must be at least 1.");
+
+    if (boxed_result->is_closed || boxed_result->row_count == 0)
+        return;
+
+    lily_call_prepare(s, lily_arg_function(s, 2));
+
+    int row = 0;
+
+    /* `fn` may close `self`, which sets the row count to 0 and ends this. */
+    while (row < boxed_result->row_count) {
+        int row_count = (int)boxed_result->row_count;
+        int batch_size = row_count - row < size ? row_count - row : (int)size;
+        lily_container_val *lv = lily_push_list(s, batch_size);
+        int i;
+
+        for (i = 0;i < batch_size;i++) {
+            push_row(s, boxed_result, row + i);
+            lily_con_set_from_stack(s, lv, i);
+        }
+
+        row += batch_size;
+        lily_call(s, 1);
+    }
+
+    if (boxed_result->auto_close)
+        close_cursor(boxed_result);
+}
+
+/**
+define Cursor.each_row(fn: Function(List[String]))
+
+This loops through each row in `self`, calling `fn` for each row that is found.
+If `self` has no rows, or has been closed, then this does nothing. If
+`Cursor.set_auto_close` is on, `self` is closed afterward.
+*/
+void lily_postgres_Cursor_each_row(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+
+    if (boxed_result->is_closed || boxed_result->row_count == 0)
+        return;
+
+    lily_call_prepare(s, lily_arg_function(s, 1));
+
+    int row;
+    for (row = 0;row < boxed_result->row_count;row++) {
+        push_row(s, boxed_result, row);
+        lily_call(s, 1);
+    }
+
+    if (boxed_result->auto_close)
+        close_cursor(boxed_result);
+}
+
+/**
+define Cursor.each_row_while(fn: Function(List[String] => Boolean))
+
+This is like `Cursor.each_row`, except that it stops as soon as `fn` returns
+`false`. Rows after that one are not read. If `Cursor.set_auto_close` is on,
+`self` is closed afterward, whether or not every row was sent.
+*/
+void lily_postgres_Cursor_each_row_while(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+
+    if (boxed_result->is_closed || boxed_result->row_count == 0)
+        return;
+
+    lily_call_prepare(s, lily_arg_function(s, 1));
+
+    int row;
+    for (row = 0;row < boxed_result->row_count;row++) {
+        push_row(s, boxed_result, row);
+        lily_call(s, 1);
+
+        if (lily_as_boolean(lily_call_result(s)) == 0)
+            break;
+    }
+
+    if (boxed_result->auto_close)
+        close_cursor(boxed_result);
+}
+
+/**
+define Cursor.field(row: Integer, name: String): Option[String]
+
+Returns the field in the column called `name` of row `row`. If there is no
+such column, or the field is null, the result is `None`. This finds the column
+the same way that `Cursor.column_index` does.
+
+# Errors
+
+* `IndexError` if `row` is not a valid row index.
+*/
+void lily_postgres_Cursor_field(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    int64_t row = lily_arg_integer(s, 1);
+
+    if (row < 0 || row >= boxed_result->row_count)
+        lily_IndexError(s, "Index %ld is out of range.", (long)row);
+
+    int col = find_column(boxed_result, lily_arg_string_raw(s, 2));
+    int size;
+    char *text;
+
+    if (col == -1 ||
+        (text = cursor_field(boxed_result, (int)row, col, &size)) == NULL) {
+        lily_return_none(s);
+        return;
+    }
+
+    lily_container_val *variant = lily_push_some(s);
+
+    lily_push_string_sized(s, text, size);
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/* Reads the elements of an array field's text in order. The elements of arrays
+   with several dimensions are read as if the array was flat. */
+typedef struct {
+    const char *pos;
+    char stops[3];
+} array_reader;
+
+void array_start(array_reader *r, const char *text, char delimiter)
+{
+    /* Arrays that do not start at 1 are written with their bounds first, such
+       as "[0:1]={1,2}". */
+    if (text[0] == '[') {
+        const char *equals = strchr(text, '=');
+        text = equals ? equals + 1 : text + strlen(text);
+    }
+
+    r->pos = text;
+    r->stops[0] = delimiter;
+    r->stops[1] = '}';
+    r->stops[2] = '\0';
+}
+
+/* Read the next element. Returns -1 at the end, 0 if the element is null, or 1
+   otherwise. If `msgbuf` is not NULL, the element is unquoted into it and
+   `size` is set to its length. */
+int array_next(array_reader *r, lily_msgbuf *msgbuf, int *size)
+{
+    const char *pos = r->pos;
+    char delimiter = r->stops[0];
+    int n;
+
+    while (*pos == '{' || *pos == '}' || *pos == delimiter)
+        pos++;
+
+    if (*pos == '\0') {
+        r->pos = pos;
+        return -1;
+    }
+
+    if (msgbuf)
+        lily_mb_flush(msgbuf);
+
+    if (*pos == '"') {
+        int total = 0;
+
+        pos++;
+
+        while (1) {
+            n = strcspn(pos, "\"\\");
+
+            if (msgbuf)
+                lily_mb_add_slice(msgbuf, pos, 0, n);
+
+            total += n;
+            pos += n;
+
+            if (*pos != '\\' || pos[1] == '\0')
+                break;
+
+            if (msgbuf)
+                lily_mb_add_char(msgbuf, pos[1]);
+
+            total++;
+            pos += 2;
+        }
+
+        if (*pos == '"')
+            pos++;
+
+        r->pos = pos;
+        *size = total;
+        return 1;
+    }
+
+    n = strcspn(pos, r->stops);
+    r->pos = pos + n;
+
+    if (n == 4 && strncmp(pos, "NULL", 4) == 0)
+        return 0;
+
+    if (msgbuf)
+        lily_mb_add_slice(msgbuf, pos, 0, n);
+
+    *size = n;
+    return 1;
+}
+
+/* Return the array field given by arguments 1 and 2 as an Option of a List.
+   Each element is read as `kind`. */
+void return_array_field(lily_state *s, int kind)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    column_type *type;
+    char *text = arg_field(s, boxed_result, &type);
+
+    if (text == NULL) {
+        lily_return_none(s);
+        return;
+    }
+
+    const field_decoder *element = type->element;
+
+    if (element == NULL || decoder_reads(element, kind) == 0)
+        lily_ValueError(s, "Column cannot be read as a List[%s].",
+                value_kind_names[kind]);
+
+    lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+    array_reader r;
+    int count = 0, size, status, i;
+
+    /* Count first so that the List can be made with the right size. */
+    array_start(&r, text, type->delimiter);
+
+    while (array_next(&r, NULL, &size) != -1)
+        count++;
+
+    lily_container_val *variant = lily_push_some(s);
+    lily_container_val *lv = lily_push_list(s, count);
+
+    array_start(&r, text, type->delimiter);
+
+    for (i = 0;i < count;i++) {
+        status = array_next(&r, msgbuf, &size);
+
+        if (status == 0) {
+            lily_push_none(s);
+            lily_con_set_from_stack(s, lv, i);
+            continue;
+        }
+
+        if (push_some_decoded(s, element, kind, lily_mb_raw(msgbuf),
+                size) == 0)
+            lily_ValueError(s, "Element %d is not a valid %s.", i,
+                    value_kind_names[kind]);
+
+        lily_con_set_from_stack(s, lv, i);
+    }
+
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/**
+define Cursor.get_boolean(row: Integer, column: Integer): Option[Boolean]
+
+Returns the field at `row` and `column` as a `Boolean`, or `None` if the field
+is null. The column must be `boolean`, or a domain over it.
+
+# Errors
+
+* `IndexError` if `row` or `column` is out of range.
+
+* `ValueError` if the column's type cannot be read as a `Boolean`.
+*/
+void lily_postgres_Cursor_get_boolean(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    column_type *type;
+    char *text = arg_field(s, boxed_result, &type);
+    int value;
+
+    if (text == NULL) {
+        lily_return_none(s);
+        return;
+    }
+
+    if (type->decoder->to_boolean == NULL)
+        lily_ValueError(s, "Column cannot be read as a Boolean.");
+
+    if (type->decoder->to_boolean(text, &value) == 0)
+        lily_ValueError(s, "'%s' is not a valid Boolean.", text);
+
+    lily_container_val *variant = lily_push_some(s);
+
+    lily_push_boolean(s, value);
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/**
+define Cursor.get_boolean_list(row: Integer, column: Integer): Option[List[Option[Boolean]]]
+
+Returns the array field at `row` and `column` as a `List`, or `None` if the
+field is null. Null elements are `None`. Arrays with several dimensions are
+flattened, so `{{t,f},{f,t}}` has 4 elements.
+
+# Errors
+
+* `IndexError` if `row` or `column` is out of range.
+
+* `ValueError` if the column is not an array of `boolean`.
+*/
+void lily_postgres_Cursor_get_boolean_list(lily_state *s)
+{
+    return_array_field(s, VALUE_BOOLEAN);
+}
+
+/**
+define Cursor.get_date(row: Integer, column: Integer): Option[Integer]
+
+Returns the `date` field at `row` and `column` as the number of days since
+1970-01-01, or `None` if the field is null. `infinity` and `-infinity` are the
+largest and smallest `Integer` values.
+
+# Errors
+
+* `IndexError` if `row` or `column` is out of range.
+
+* `ValueError` if the column's type is not `date`.
+*/
+void lily_postgres_Cursor_get_date(lily_state *s)
+{
+    return_time_field(s, TIME_DATE);
+}
+
+/**
+define Cursor.get_double(row: Integer, column: Integer): Option[Double]
+
+Returns the field at `row` and `column` as a `Double`, or `None` if the field
+is null. Integer, floating point, and numeric columns can be read as a
+`Double`, as can domains over them.
+
+# Errors
+
+* `IndexError` if `row` or `column` is out of range.
+
+* `ValueError` if the column's type cannot be read as a `Double`.
+*/
+void lily_postgres_Cursor_get_double(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    column_type *type;
+    char *text = arg_field(s, boxed_result, &type);
+    double value;
+
+    if (text == NULL) {
+        lily_return_none(s);
+        return;
+    }
+
+    if (type->decoder->to_double == NULL)
+        lily_ValueError(s, "Column cannot be read as a Double.");
+
+    if (type->decoder->to_double(text, &value) == 0)
+        lily_ValueError(s, "'%s' is not a valid Double.", text);
+
+    lily_container_val *variant = lily_push_some(s);
+
+    lily_push_double(s, value);
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/**
+define Cursor.get_double_list(row: Integer, column: Integer): Option[List[Option[Double]]]
+
+Returns the array field at `row` and `column` as a `List`, or `None` if the
+field is null. Null elements are `None`. Elements are read like
+`Cursor.get_double` reads fields, and arrays with several dimensions are
+flattened.
+
+# Errors
+
+* `IndexError` if `row` or `column` is out of range.
+
+* `ValueError` if the column's elements cannot be read as a `Double`.
+*/
+void lily_postgres_Cursor_get_double_list(lily_state *s)
+{
+    return_array_field(s, VALUE_DOUBLE);
+}
+
+/**
+define Cursor.get_epoch_micros(row: Integer, column: Integer): Option[Integer]
+
+Returns the field at `row` and `column` as microseconds since
+1970-01-01 00:00:00 UTC, or `None` if the field is null. The column can be a
+`timestamp`, `timestamptz`, or `date`. Fields of a `timestamp` are taken to be
+in UTC. `infinity` and `-infinity` are the largest and smallest `Integer`
+values.
+
+# Errors
+
+* `IndexError` if `row` or `column` is out of range.
+
+* `ValueError` if the column's type cannot be read as a timestamp.
+*/
+void lily_postgres_Cursor_get_epoch_micros(lily_state *s)
+{
+    return_time_field(s, TIME_EPOCH);
+}
+
+/**
+define Cursor.get_integer(row: Integer, column: Integer): Option[Integer]
+
+Returns the field at `row` and `column` as an `Integer`, or `None` if the field
+is null. Integer and numeric columns can be read as an `Integer`, as can domains
+over them. Numeric fields must not have a fraction.
+
+# Errors
+
+* `IndexError` if `row` or `column` is out of range.
+
+* `ValueError` if the column's type cannot be read as an `Integer`, or the field
+  does not fit in one.
+*/
+void lily_postgres_Cursor_get_integer(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    column_type *type;
+    char *text = arg_field(s, boxed_result, &type);
+    int64_t value;
+
+    if (text == NULL) {
+        lily_return_none(s);
+        return;
+    }
+
+    if (type->decoder->to_integer == NULL)
+        lily_ValueError(s, "Column cannot be read as an Integer.");
+
+    if (type->decoder->to_integer(text, &value) == 0)
+        lily_ValueError(s, "'%s' is not a valid Integer.", text);
+
+    lily_container_val *variant = lily_push_some(s);
+
+    lily_push_integer(s, value);
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/**
+define Cursor.get_integer_list(row: Integer, column: Integer): Option[List[Option[Integer]]]
+
+Returns the array field at `row` and `column` as a `List`, or `None` if the
+field is null. Null elements are `None`. Elements are read like
+`Cursor.get_integer` reads fields, and arrays with several dimensions are
+flattened.
+
+# Errors
+
+* `IndexError` if `row` or `column` is out of range.
+
+* `ValueError` if the column's elements cannot be read as an `Integer`.
+*/
+void lily_postgres_Cursor_get_integer_list(lily_state *s)
+{
+    return_array_field(s, VALUE_INTEGER);
+}
+
+/**
+define Cursor.get_interval_micros(row: Integer, column: Integer): Option[Integer]
+
+Returns the `interval` field at `row` and `column` as a number of microseconds,
+or `None` if the field is null. Like the server does when taking the epoch of
+an interval, a year counts as 365.25 days and a month counts as 30 days.
+
+# Errors
+
+* `IndexError` if `row` or `column` is out of range.
+
+* `ValueError` if the column's type is not `interval`.
+*/
+void lily_postgres_Cursor_get_interval_micros(lily_state *s)
+{
+    return_time_field(s, TIME_INTERVAL);
+}
+
+/* JSON fields are not parsed as a whole. Instead, json_find walks along a path,
+   skipping over values that are not on it. Skipping uses strcspn to jump to the
+   next character that matters, since most of a document is usually not on the
+   path. */
+const char *json_space(const char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+        p++;
+
+    return p;
+}
+
+/* `p` is at the opening quote. Returns the position after the closing quote, or
+   NULL if there is none. */
+const char *json_skip_string(const char *p)
+{
+    p++;
+
+    while (1) {
+        p += strcspn(p, "\"\\");
+
+        if (*p == '"')
+            return p + 1;
+        else if (*p == '\0' || p[1] == '\0')
+            return NULL;
+
+        p += 2;
+    }
+}
+
+/* Returns the position after the number at `p`, or NULL if it is not a valid
+   JSON number. This is checked before using strtod, which would also take hex,
+   "Infinity", and "nan". */
+const char *json_skip_number(const char *p)
+{
+    int n;
+
+    if (*p == '-')
+        p++;
+
+    if (*p == '0')
+        p++;
+    else if (*p >= '1' && *p <= '9')
+        p += strspn(p, "0123456789");
+    else
+        return NULL;
+
+    if (*p == '.') {
+        n = strspn(p + 1, "0123456789");
+
+        if (n == 0)
+            return NULL;
+
+        p += n + 1;
+    }
+
+    if (*p == 'e' || *p == 'E') {
+        p++;
+
+        if (*p == '+' || *p == '-')
+            p++;
+
+        n = strspn(p, "0123456789");
+
+        if (n == 0)
+            return NULL;
+
+        p += n;
+    }
+
+    return p;
+}
+
+/* Returns the position after the value at `p`, or NULL if it is not valid. */
+const char *json_skip_value(const char *p)
+{
+    if (*p == '"')
+        return json_skip_string(p);
+
+    if (*p == '{' || *p == '[') {
+        int depth = 1;
+
+        p++;
+
+        while (depth) {
+            p += strcspn(p, "\"{}[]");
+
+            if (*p == '\0')
+                return NULL;
+            else if (*p == '"') {
+                p = json_skip_string(p);
+
+                if (p == NULL)
+                    return NULL;
+
+                continue;
+            }
+            else if (*p == '{' || *p == '[')
+                depth++;
+            else
+                depth--;
+
+            p++;
+        }
+
+        return p;
+    }
+
+    if (strncmp(p, "true", 4) == 0 || strncmp(p, "null", 4) == 0)
+        return p + 4;
+    else if (strncmp(p, "false", 5) == 0)
+        return p + 5;
+
+    return json_skip_number(p);
+}
+
+/* Returns 1 if the value at `p`, which json_find found, is JSON null. */
+int json_is_null(const char *p)
+{
+    return strncmp(p, "null", 4) == 0;
+}
+
+/* Returns the value of the 4 hex digits at `p`, or -1 if they are not valid. */
+int32_t json_hex4(const char *p)
+{
+    int32_t value = 0;
+    int i;
+
+    for (i = 0;i < 4;i++) {
+        char ch = p[i] | 0x20;
+
+        value <<= 4;
+
+        if (p[i] >= '0' && p[i] <= '9')
+            value |= p[i] - '0';
+        else if (ch >= 'a' && ch <= 'f')
+            value |= ch - 'a' + 10;
+        else
+            return -1;
+    }
+
+    return value;
+}
+
+/* Unescape the string at `p`, which is at the opening quote, into `msgbuf`.
+   Returns the size of the result, or -1 if the string is not valid. */
+int json_unescape(lily_msgbuf *msgbuf, const char *p)
+{
+    int size = 0;
+
+    lily_mb_flush(msgbuf);
+    p++;
+
+    while (1) {
+        int n = strcspn(p, "\"\\");
+
+        lily_mb_add_slice(msgbuf, p, 0, n);
+        size += n;
+        p += n;
+
+        if (*p == '"')
+            return size;
+        else if (*p == '\0')
+            return -1;
+
+        char ch = p[1];
+        int32_t code, low;
+
+        p += 2;
+
+        switch (ch) {
+            case '"': case '\\': case '/':
+                break;
+            case 'b': ch = '\b'; break;
+            case 'f': ch = '\f'; break;
+            case 'n': ch = '\n'; break;
+            case 'r': ch = '\r'; break;
+            case 't': ch = '\t'; break;
+            case 'u':
+                code = json_hex4(p);
+
+                if (code == -1)
+                    return -1;
+
+                p += 4;
+
+                /* Characters outside of the basic plane are surrogate pairs. */
+                if (code >= 0xD800 && code < 0xDC00 && p[0] == '\\' &&
+                    p[1] == 'u' && (low = json_hex4(p + 2)) >= 0xDC00 &&
+                    low < 0xE000) {
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+
+                if (code < 0x80) {
+                    lily_mb_add_char(msgbuf, (char)code);
+                    size += 1;
+                }
+                else if (code < 0x800) {
+                    lily_mb_add_char(msgbuf, (char)(0xC0 | (code >> 6)));
+                    lily_mb_add_char(msgbuf, (char)(0x80 | (code & 0x3F)));
+                    size += 2;
+                }
+                else if (code < 0x10000) {
+                    lily_mb_add_char(msgbuf, (char)(0xE0 | (code >> 12)));
+                    lily_mb_add_char(msgbuf,
+                            (char)(0x80 | ((code >> 6) & 0x3F)));
+                    lily_mb_add_char(msgbuf, (char)(0x80 | (code & 0x3F)));
+                    size += 3;
+                }
+                else {
+                    lily_mb_add_char(msgbuf, (char)(0xF0 | (code >> 18)));
+                    lily_mb_add_char(msgbuf,
+                            (char)(0x80 | ((code >> 12) & 0x3F)));
+                    lily_mb_add_char(msgbuf,
+                            (char)(0x80 | ((code >> 6) & 0x3F)));
+                    lily_mb_add_char(msgbuf, (char)(0x80 | (code & 0x3F)));
+                    size += 4;
+                }
+
+                continue;
+            default:
+                return -1;
+        }
+
+        lily_mb_add_char(msgbuf, ch);
+        size++;
+    }
+}
+
+/* Returns 1 if the key at `p`, which is at the opening quote, is the same as
+   the first `size` bytes of `name`. */
+int json_key_equals(lily_msgbuf *msgbuf, const char *p, const char *end,
+        const char *name, int size)
+{
+    const char *start = p + 1;
+    int key_size = (int)(end - start) - 1;
+
+    if (memchr(start, '\\', key_size) == NULL)
+        return key_size == size && memcmp(start, name, size) == 0;
+
+    return json_unescape(msgbuf, p) == size &&
+           memcmp(lily_mb_raw(msgbuf), name, size) == 0;
+}
+
+/* Find the value at `path` in `doc`. Path segments are split by `"."`, and a
+   segment of digits is an index when the value is an array. Returns the start
+   of the value and sets `end`, or returns NULL if there is no such value.
+   `error` is set if the document is not valid. */
+const char *json_find(lily_msgbuf *msgbuf, const char *doc, const char *path,
+        const char **end, int *error)
+{
+    const char *p = json_space(doc);
+
+    *error = 0;
+
+    while (*path) {
+        int size = strcspn(path, ".");
+
+        if (*p == '{') {
+            p = json_space(p + 1);
+
+            if (*p == '}')
+                return NULL;
+
+            while (1) {
+                if (*p != '"')
+                    goto invalid;
+
+                const char *key_end = json_skip_string(p);
+
+                if (key_end == NULL)
+                    goto invalid;
+
+                int found = json_key_equals(msgbuf, p, key_end, path, size);
+
+                p = json_space(key_end);
+
+                if (*p != ':')
+                    goto invalid;
+
+                p = json_space(p + 1);
+
+                if (found)
+                    break;
+
+                p = json_skip_value(p);
+
+                if (p == NULL)
+                    goto invalid;
+
+                p = json_space(p);
+
+                if (*p == '}')
+                    return NULL;
+                else if (*p != ',')
+                    goto invalid;
+
+                p = json_space(p + 1);
+            }
+        }
+        else if (*p == '[') {
+            int digits = strspn(path, "0123456789");
+
+            if (size == 0 || digits != size)
+                return NULL;
+
+            long index = strtol(path, NULL, 10), i;
+
+            p = json_space(p + 1);
+
+            if (*p == ']')
+                return NULL;
+
+            for (i = 0;i < index;i++) {
+                p = json_skip_value(p);
+
+                if (p == NULL)
+                    goto invalid;
+
+                p = json_space(p);
+
+                if (*p == ']')
+                    return NULL;
+                else if (*p != ',')
+                    goto invalid;
+
+                p = json_space(p + 1);
+            }
+        }
+        else
+            return NULL;
+
+        path += size;
+
+        if (*path == '.')
+            path++;
+    }
+
+    *end = json_skip_value(p);
+
+    if (*end == NULL)
+        goto invalid;
+
+    /* Catch values that only start out valid, like "0x10" or "nullx". */
+    const char *next = json_space(*end);
+
+    if (*next != ',' && *next != '}' && *next != ']' && *next != '\0')
+        goto invalid;
+
+    return p;
+
+invalid:
+    *error = 1;
+    return NULL;
+}
+
+/* Find the value at the path in argument 3 of the field given by arguments 1
+   and 2. Returns NULL if the field is null or there is no such value. */
+const char *arg_json_value(lily_state *s, const char **end)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    const char *path = lily_arg_string_raw(s, 3);
+    column_type *type;
+    char *text = arg_field(s, boxed_result, &type);
+    int error;
+
+    if (text == NULL)
+        return NULL;
+
+    const char *value = json_find(lily_msgbuf_get(s), text, path, end, &error);
+
+    if (error)
+        lily_ValueError(s, "Field is not valid JSON.");
+
+    return value;
+}
+
+/**
+define Cursor.get_json_boolean(row: Integer, column: Integer, path: String): Option[Boolean]
+
+Returns the JSON boolean at `path` in the field at `row` and `column`. The
+result is `None` if the field is null, there is no value at `path`, or the value
+is JSON `null`. See `Cursor.get_json_path` for how paths work.
+
+# Errors
+
+* `IndexError` if `row` or `column` is out of range.
+
+* `ValueError` if the field is not valid JSON, or the value is not a boolean.
+*/
+void lily_postgres_Cursor_get_json_boolean(lily_state *s)
+{
+    const char *end;
+    const char *value = arg_json_value(s, &end);
+
+    if (value == NULL || json_is_null(value)) {
+        lily_return_none(s);
+        return;
+    }
+
+    int size = (int)(end - value);
+    int result;
+
+    if (size == 4 && strncmp(value, "true", 4) == 0)
+        result = 1;
+    else if (size == 5 && strncmp(value, "false", 5) == 0)
+        result = 0;
+    else
+        lily_ValueError(s, "JSON value is not a boolean.");
+
+    lily_container_val *variant = lily_push_some(s);
+
+    lily_push_boolean(s, result);
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/**
+define Cursor.get_json_double(row: Integer, column: Integer, path: String): Option[Double]
+
+Returns the JSON number at `path` in the field at `row` and `column` as a
+`Double`. The result is `None` if the field is null, there is no value at
+`path`, or the value is JSON `null`. See `Cursor.get_json_path` for how paths
+work.
+
+# Errors
+
+* `IndexError` if `row` or `column` is out of range.
+
+* `ValueError` if the field is not valid JSON, or the value is not a number.
+*/
+void lily_postgres_Cursor_get_json_double(lily_state *s)
+{
+    const char *end;
+    const char *value = arg_json_value(s, &end);
+
+    if (value == NULL || json_is_null(value)) {
+        lily_return_none(s);
+        return;
+    }
+
+    if (json_skip_number(value) != end)
+        lily_ValueError(s, "JSON value is not a number.");
+
+    double result = strtod(value, NULL);
+
+    lily_container_val *variant = lily_push_some(s);
+
+    lily_push_double(s, result);
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/**
+define Cursor.get_json_integer(row: Integer, column: Integer, path: String): Option[Integer]
+
+Returns the JSON number at `path` in the field at `row` and `column` as an
+`Integer`. The result is `None` if the field is null, there is no value at
+`path`, or the value is JSON `null`. See `Cursor.get_json_path` for how paths
+work.
+
+# Errors
+
+* `IndexError` if `row` or `column` is out of range.
+
+* `ValueError` if the field is not valid JSON, or the value is not a number
+  without a fraction that fits in an `Integer`.
+*/
+void lily_postgres_Cursor_get_json_integer(lily_state *s)
+{
+    const char *end;
+    const char *value = arg_json_value(s, &end);
+
+    if (value == NULL || json_is_null(value)) {
+        lily_return_none(s);
+        return;
+    }
+
+    char *number_end;
+
+    errno = 0;
+    long long result = strtoll(value, &number_end, 10);
+
+    if (json_skip_number(value) != end || number_end != end || errno)
+        lily_ValueError(s, "JSON value is not an Integer.");
+
+    lily_container_val *variant = lily_push_some(s);
+
+    lily_push_integer(s, result);
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/**
+define Cursor.get_json_path(row: Integer, column: Integer, path: String): Option[String]
+
+Returns the JSON text of the value at `path` in the field at `row` and
+`column`. The result is `None` if the field is null or there is no value at
+`path`. JSON `null` is returned as `"null"`.
+
+Segments of `path` are split by `"."`. A segment picks a key of an object, or an
+element of an array if the segment is a number. An empty `path` is the whole
+field. For example, `"items.0.id"` is the `"id"` key of the first element in the
+`"items"` array.
+
+Only the part of the field along `path` is read, and values that are not on it
+are skipped over without being decoded. The column can be `json`, `jsonb`, or
+any other type holding JSON text.
+
+# Errors
+
+* `IndexError` if `row` or `column` is out of range.
+
+* `ValueError` if the field is not valid JSON.
+*/
+void lily_postgres_Cursor_get_json_path(lily_state *s)
+{
+    const char *end;
+    const char *value = arg_json_value(s, &end);
+
+    if (value == NULL) {
+        lily_return_none(s);
+        return;
+    }
+
+    lily_container_val *variant = lily_push_some(s);
+
+    lily_push_string_sized(s, value, (int)(end - value));
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/**
+define Cursor.get_json_string(row: Integer, column: Integer, path: String): Option[String]
+
+Returns the JSON string at `path` in the field at `row` and `column`, with
+escapes decoded. The result is `None` if the field is null, there is no value at
+`path`, or the value is JSON `null`. See `Cursor.get_json_path` for how paths
+work.
+
+# Errors
+
+* `IndexError` if `row` or `column` is out of range.
+
+* `ValueError` if the field is not valid JSON, or the value is not a string.
+*/
+void lily_postgres_Cursor_get_json_string(lily_state *s)
+{
+    const char *end;
+    const char *value = arg_json_value(s, &end);
+
+    if (value == NULL || json_is_null(value)) {
+        lily_return_none(s);
+        return;
+    }
+
+    lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+    int size = *value == '"' ? json_unescape(msgbuf, value) : -1;
+
+    if (size == -1)
+        lily_ValueError(s, "JSON value is not a string.");
+
+    lily_container_val *variant = lily_push_some(s);
+
+    lily_push_string_sized(s, lily_mb_raw(msgbuf), size);
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/**
+define Cursor.get_string_list(row: Integer, column: Integer): Option[List[Option[String]]]
+
+Returns the array field at `row` and `column` as a `List`, or `None` if the
+field is null. Null elements are `None`. Quoted elements are unescaped, and
+arrays with several dimensions are flattened. Any array column can be read this
+way.
+
+# Errors
+
+* `IndexError` if `row` or `column` is out of range.
+
+* `ValueError` if the column is not an array.
+*/
+void lily_postgres_Cursor_get_string_list(lily_state *s)
+{
+    return_array_field(s, VALUE_STRING);
+}
+
+/* Each bucket takes 8 bytes here, and a Lily value in the result. */
+#define HISTOGRAM_MAX_BUCKETS (1 << 20)
+
+/**
+define Cursor.histogram(column: Integer, buckets: Integer): List[Integer]
+
+Splits the range from the smallest to the largest value of `column` into
+`buckets` buckets of the same width, and returns how many values fall into each
+one. The largest value is counted in the last bucket. Values are read as a
+`Double`. Null fields, NaN, and infinite values are not counted.
+
+# Errors
+
+* `IndexError` if `column` is out of range.
+
+* `ValueError` if `buckets` is less than 1 or more than 1048576, or the column
+  cannot be read as a `Double`.
+*/
+void lily_postgres_Cursor_histogram(lily_state *s)
+{
+    int64_t buckets = lily_arg_integer(s, 2);
+    double low, high;
+
+    if (buckets < 1 || buckets > HISTOGRAM_MAX_BUCKETS)
+        lily_ValueError(s, "Bucket count %ld is not valid.", (long)buckets);
+
+    int found = column_double_range(s, &low, &high, 1);
+    int64_t *counts = calloc(buckets, sizeof(*counts));
+
+    if (found) {
+        column_reader r;
+        double chunk[COLUMN_CHUNK];
+        /* Halved so that the width of a range such as -DBL_MAX to DBL_MAX
+           does not overflow. */
+        double half_width = high / 2 - low / 2;
+        int count, i;
+
+        /* The first pass read every field, so this one cannot fail. */
+        column_reader_init(s, &r, 1);
+
+        while ((count = column_read_doubles(s, &r, chunk)) != 0) {
+            for (i = 0;i < count;i++) {
+                double value = chunk[i];
+
+                if (isfinite(value) == 0)
+                    continue;
+
+                double position = 0;
+
+                if (half_width > 0)
+                    position = (value / 2 - low / 2) / half_width * buckets;
+
+                int64_t index = 0;
+
+                if (position >= buckets)
+                    index = buckets - 1;
+                else if (position > 0)
+                    index = (int64_t)position;
+
+                counts[index]++;
+            }
+        }
+    }
+
+    lily_container_val *lv = lily_push_list(s, (int)buckets);
+    int i;
+
+    for (i = 0;i < buckets;i++) {
+        lily_push_integer(s, counts[i]);
+        lily_con_set_from_stack(s, lv, i);
+    }
+
+    free(counts);
+    lily_return_top(s);
+}
+
+/**
+static define Cursor.live_bytes: Integer
+
+Returns how many bytes of results are held by every `Cursor` that is still open.
+This counts memory that libpq holds outside of Lily, which is freed when a
+`Cursor` is closed or destroyed.
+*/
+void lily_postgres_Cursor_live_bytes(lily_state *s)
+{
+    lily_return_integer(s, (int64_t)live_result_bytes);
+}
+
+/**
+define Cursor.max_double(column: Integer): Option[Double]
+
+Returns the largest value of `column` read as a `Double`, or `None` if every
+field is null. NaN is ignored.
+
+# Errors
+
+* `IndexError` if `column` is out of range.
+
+* `ValueError` if the column cannot be read as a `Double`.
+*/
+void lily_postgres_Cursor_max_double(lily_state *s)
+{
+    double low, high;
+
+    if (column_double_range(s, &low, &high, 0))
+        return_some_double(s, high);
+    else
+        lily_return_none(s);
+}
+
+/**
+define Cursor.max_integer(column: Integer): Option[Integer]
+
+Returns the largest value of `column` read as an `Integer`, or `None` if every
+field is null.
+
+# Errors
+
+* `IndexError` if `column` is out of range.
+
+* `ValueError` if the column cannot be read as an `Integer`.
+*/
+void lily_postgres_Cursor_max_integer(lily_state *s)
+{
+    int64_t low, high;
+
+    if (column_integer_range(s, &low, &high))
+        return_some_integer(s, high);
+    else
+        lily_return_none(s);
+}
+
+/**
+define Cursor.memory_bytes: Integer
+
+Returns how many bytes of memory the result of `self` uses, or 0 if `self` has
+been closed. For a `Cursor` made by `Conn.query_spill`, rows in the temporary
+file and their index are not counted.
+*/
+void lily_postgres_Cursor_memory_bytes(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+
+    lily_return_integer(s, boxed_result->is_closed ? 0 :
+            (int64_t)boxed_result->memory_bytes);
+}
+
+/**
+define Cursor.min_double(column: Integer): Option[Double]
+
+Returns the smallest value of `column` read as a `Double`, or `None` if every
+field is null. NaN is ignored.
+
+# Errors
+
+* `IndexError` if `column` is out of range.
+
+* `ValueError` if the column cannot be read as a `Double`.
+*/
+void lily_postgres_Cursor_min_double(lily_state *s)
+{
+    double low, high;
+
+    if (column_double_range(s, &low, &high, 0))
+        return_some_double(s, low);
+    else
+        lily_return_none(s);
+}
+
+/**
+define Cursor.min_integer(column: Integer): Option[Integer]
+
+Returns the smallest value of `column` read as an `Integer`, or `None` if every
+field is null.
+
+# Errors
+
+* `IndexError` if `column` is out of range.
+
+* `ValueError` if the column cannot be read as an `Integer`.
+*/
+void lily_postgres_Cursor_min_integer(lily_state *s)
+{
+    int64_t low, high;
+
+    if (column_integer_range(s, &low, &high))
+        return_some_integer(s, low);
+    else
+        lily_return_none(s);
+}
+
+/**
+define Cursor.next: Option[List[String]]
+
+Returns the row after the one that `next` last returned, starting with the
+first row, or `None` once every row has been returned. Rows are the same as the
+ones that `Cursor.each_row` sends. Calling `next` does not change what other
+methods do.
+*/
+void lily_postgres_Cursor_next(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+
+    if (boxed_result->current_row >= boxed_result->row_count) {
+        lily_return_none(s);
+        return;
+    }
+
+    lily_container_val *variant = lily_push_some(s);
+
+    push_row(s, boxed_result, (int)boxed_result->current_row);
+    lily_con_set_from_stack(s, variant, 0);
+    boxed_result->current_row++;
+    lily_return_top(s);
+}
+
+/**
+define Cursor.row(index: Integer): List[String]
+
+Returns the row at `index`, the same way that `Cursor.each_row` would send it.
+Only that row is read.
+
+# Errors
+
+* `IndexError` if `index` is not a valid row index.
+*/
+void lily_postgres_Cursor_row(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    int64_t row = lily_arg_integer(s, 1);
+
+    if (row < 0 || row >= boxed_result->row_count)
+        lily_IndexError(s, "Index %ld is out of range.", (long)row);
+
+    push_row(s, boxed_result, (int)row);
+    lily_return_top(s);
+}
+
+/**
+define Cursor.row_count: Integer
+
+Returns the number of rows present within `self`.
+*/
+void lily_postgres_Cursor_row_count(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+
+    lily_return_integer(s, boxed_result->row_count);
+}
+
+/**
+define Cursor.set_auto_close(enabled: Boolean)
+
+If `enabled` is `true`, `self` closes itself once `Cursor.each_row`,
+`Cursor.each_batch`, or `Cursor.to_list` has gone through every row, and once
+`Cursor.each_row_while` returns, even if it stopped early. This frees the result
+right away, instead of when `self` is destroyed. A closed `Cursor` has no rows,
+so leave this off if rows will be read again afterward.
+*/
+void lily_postgres_Cursor_set_auto_close(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+
+    boxed_result->auto_close = lily_arg_boolean(s, 1);
+}
+
+/**
+static define Cursor.set_memory_limit(bytes: Integer)
+
+Limit the bytes of results that every open `Cursor` can hold together, as
+counted by `Cursor.live_bytes`. A limit of 0, which is the default, means there
+is no limit.
+
+While the limit is reached, `Conn.query`, `Conn.query_all`,
+`Conn.query_params`, and `Conn.query_template` fail without sending their query.
+If a result would go past the limit, it is freed and the query fails. In both
+cases, the `Failure` says so. `Conn.query_spill` is not limited, since it keeps
+its own rows within a limit.
+
+# Errors
+
+* `ValueError` if `bytes` is negative.
+*/
+void lily_postgres_Cursor_set_memory_limit(lily_state *s)
+{
+    int64_t limit = lily_arg_integer(s, 0);
+
+    if (limit < 0)
+        lily_ValueError(s, "Memory limit must not be negative.");
+
+    result_byte_limit = (uint64_t)limit;
+}
+
+/**
+define Cursor.slice(start: Integer, count: Integer, fn: Function(List[String]))
+
+Calls `fn` for up to `count` rows, starting with the row at `start`. Rows past
+the end of `self` are not sent, so this can be used to send one page of rows.
+Only the rows that are sent are read.
+
+# Errors
+
+* `ValueError` if `start` or `count` is negative.
+*/
+void lily_postgres_Cursor_slice(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    int64_t start = lily_arg_integer(s, 1);
+    int64_t count = lily_arg_integer(s, 2);
+
+    if (start < 0 || count < 0)
+        lily_ValueError(s, "Slice start and count must not be negative.");
+
+    int64_t stop = boxed_result->row_count;
+
+    if (start >= stop)
+        return;
+
+    if (count < stop - start)
+        stop = start + count;
+
+    lily_call_prepare(s, lily_arg_function(s, 3));
+
+    /* `fn` may close `self`, which sets the row count to 0 and ends this. */
+    int row;
+    for (row = (int)start;row < stop && row < boxed_result->row_count;row++) {
+        push_row(s, boxed_result, row);
+        lily_call(s, 1);
+    }
+}
+
+/**
+define Cursor.sum_double(column: Integer): Double
+
+Returns the sum of `column` read as a `Double`. Null fields are skipped, and a
+column with no values has a sum of `0.0`.
+
+# Errors
+
+* `IndexError` if `column` is out of range.
+
+* `ValueError` if the column cannot be read as a `Double`.
+*/
+void lily_postgres_Cursor_sum_double(lily_state *s)
+{
+    column_reader r;
+    double chunk[COLUMN_CHUNK];
+    double total = 0;
+    int count, i;
+
+    column_reader_init(s, &r, 1);
+
+    while ((count = column_read_doubles(s, &r, chunk)) != 0) {
+        for (i = 0;i < count;i++)
+            total += chunk[i];
+    }
+
+    lily_return_double(s, total);
+}
+
+/**
+define Cursor.sum_integer(column: Integer): Integer
+
+Returns the sum of `column` read as an `Integer`. Null fields are skipped, and a
+column with no values has a sum of `0`.
+
+# Errors
+
+* `IndexError` if `column` is out of range.
+
+* `ValueError` if the column cannot be read as an `Integer`, or the sum does not
+  fit in an `Integer`.
+*/
+void lily_postgres_Cursor_sum_integer(lily_state *s)
+{
+    column_reader r;
+    int64_t chunk[COLUMN_CHUNK];
+    int64_t total = 0;
+    int count, i;
+
+    column_reader_init(s, &r, 0);
+
+    while ((count = column_read_integers(s, &r, chunk)) != 0) {
+        for (i = 0;i < count;i++) {
+            int64_t value = chunk[i];
+
+            if ((value > 0 && total > INT64_MAX - value) ||
+                (value < 0 && total < INT64_MIN - value))
+                lily_ValueError(s, "Sum is too large for an Integer.");
+
+            total += value;
+        }
+    }
+
+    lily_return_integer(s, total);
+}
+
+#define CSV_BUFFER_SIZE (1024 * 1024)
+
+/* `failed` is set once a write comes up short, such as when the disk is full
+   or a pipe was closed. */
+typedef struct {
+    char *buffer;
+    uint64_t pos;
+    FILE *f;
+    int failed;
+} csv_writer;
+
+void csv_write(csv_writer *w, const char *text, uint64_t size)
+{
+    if (fwrite(text, 1, size, w->f) != size)
+        w->failed = 1;
+}
+
+void csv_flush(csv_writer *w)
+{
+    csv_write(w, w->buffer, w->pos);
+    w->pos = 0;
+}
+
+void csv_add(csv_writer *w, const char *text, uint64_t size)
+{
+    if (w->pos + size > CSV_BUFFER_SIZE) {
+        csv_flush(w);
+
+        /* Too big to buffer, so write it directly. */
+        if (size > CSV_BUFFER_SIZE) {
+            csv_write(w, text, size);
+            return;
+        }
+    }
+
+    memcpy(w->buffer + w->pos, text, size);
+    w->pos += size;
+}
+
+void csv_add_char(csv_writer *w, char ch)
+{
+    if (w->pos == CSV_BUFFER_SIZE)
+        csv_flush(w);
+
+    w->buffer[w->pos] = ch;
+    w->pos++;
+}
+
+/* Write `text` as a field, quoting it if it holds anything in `special`. The
+   scan uses strcspn, which the C library vectorizes. */
+void csv_add_field(csv_writer *w, const char *text, uint64_t size,
+        const char *special)
+{
+    uint64_t plain = strcspn(text, special);
+
+    if (plain == size) {
+        csv_add(w, text, size);
+        return;
+    }
+
+    csv_add_char(w, '"');
+
+    const char *end = text + size;
+
+    while (1) {
+        const char *quote = memchr(text, '"', end - text);
+
+        if (quote == NULL) {
+            csv_add(w, text, end - text);
+            break;
+        }
+
+        /* Include the quote, then write it again to escape it. */
+        csv_add(w, text, quote - text + 1);
+        csv_add_char(w, '"');
+        text = quote + 1;
+    }
+
+    csv_add_char(w, '"');
+}
+
+/**
+define Cursor.to_list: List[List[String]]
+
+Returns every row of `self` in a `List`. Rows are the same as the ones that
+`Cursor.each_row` sends. The whole result is built in one pass, without calling
+back into Lily. If `self` has been closed, the result is empty. If
+`Cursor.set_auto_close` is on, `self` is closed afterward.
+*/
+void lily_postgres_Cursor_to_list(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    int row_count = (int)boxed_result->row_count;
+    lily_container_val *lv = lily_push_list(s, row_count);
+    int row;
+
+    for (row = 0;row < row_count;row++) {
+        push_row(s, boxed_result, row);
+        lily_con_set_from_stack(s, lv, row);
+    }
+
+    if (boxed_result->auto_close)
+        close_cursor(boxed_result);
+
+    lily_return_top(s);
+}
+
+/**
+define Cursor.write_csv(f: File, delimiter: *String=",", null: *String="", header: *Boolean=false)
+
+Write every row in `self` to `f` as csv, following RFC 4180. Fields holding the
+delimiter, a quote, or a line break are quoted. Null fields are written as
+`null`. When `null` is empty, empty strings are written as `""` so that they can
+be told apart from nulls. If `header` is `true`, a row of column names is
+written first.
+
+Rows are collected into a large buffer before being written to `f`, and `f` is
+flushed at the end.
+
+# Errors
+
+* `ValueError` if `delimiter` is not a single byte, or is a quote or line break.
+
+* `ValueError` if `self` is closed.
+
+* `IOError` if `f` is not open for writing, or if writing fails partway, such
+  as when the disk is full. Rows written before the failure stay in `f`.
+*/
+void lily_postgres_Cursor_write_csv(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    lily_file_val *file_val = lily_arg_file(s, 1);
+    const char *delimiter = ",";
+    const char *null_text = "";
+    int header = 0;
+
+    switch (lily_arg_count(s)) {
+        case 5:
+            header = lily_arg_boolean(s, 4);
+        case 4:
+            null_text = lily_arg_string_raw(s, 3);
+        case 3:
+            delimiter = lily_arg_string_raw(s, 2);
+    }
+
+    if (delimiter[0] == '\0' || delimiter[1] != '\0' ||
+        delimiter[0] == '"' || delimiter[0] == '\r' || delimiter[0] == '\n')
+        lily_ValueError(s, "Delimiter must be a single byte.");
+
+    FILE *f = lily_file_for_write(s, file_val);
+
+    if (boxed_result->is_closed)
+        lily_ValueError(s, "Cursor is closed.");
+
+    char special[] = {delimiter[0], '"', '\r', '\n', '\0'};
+    uint64_t null_size = strlen(null_text);
+    int num_cols = boxed_result->column_count;
+    csv_writer w;
+    int row, col;
+
+    w.buffer = malloc(CSV_BUFFER_SIZE);
+    w.pos = 0;
+    w.f = f;
+    w.failed = 0;
+
+    if (header) {
+        for (col = 0;col < num_cols;col++) {
+            const char *name = cursor_column_name(boxed_result, col);
+
+            if (col)
+                csv_add_char(&w, delimiter[0]);
+
+            csv_add_field(&w, name, strlen(name), special);
+        }
+
+        csv_add(&w, "\r\n", 2);
+    }
+
+    for (row = 0;row < boxed_result->row_count && w.failed == 0;row++) {
+        for (col = 0;col < num_cols;col++) {
+            if (col)
+                csv_add_char(&w, delimiter[0]);
+
+            int size;
+            char *text = cursor_field(boxed_result, row, col, &size);
+
+            if (text == NULL)
+                csv_add(&w, null_text, null_size);
+            else if (size == 0 && null_size == 0)
+                csv_add(&w, "\"\"", 2);
+            else
+                csv_add_field(&w, text, size, special);
+        }
+
+        csv_add(&w, "\r\n", 2);
+    }
+
+    csv_flush(&w);
+    free(w.buffer);
+
+    if (w.failed || fflush(f) != 0)
+        lily_IOError(s, "Unable to write csv to the file.");
+}
+
+/* Arrow IPC file writing.
+
+   An Arrow file is the magic, a schema message, one message per record batch,
+   then a footer that indexes the batches. Message metadata is a flatbuffer,
+   which is built here by a small back-to-front builder like the one that the
+   flatbuffers library uses. Everything is written little-endian. */
+
+#define ARROW_BATCH_ROWS 65536
+
+/* Type ids from Arrow's Schema.fbs. */
+#define ARROW_TYPE_INT 2
+#define ARROW_TYPE_FLOAT 3
+#define ARROW_TYPE_BINARY 4
+#define ARROW_TYPE_UTF8 5
+#define ARROW_TYPE_BOOL 6
+
+/* Message header ids from Message.fbs. */
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_RECORD_BATCH 3
+
+#define ARROW_METADATA_V5 4
+
+typedef struct {
+    char *data;
+    uint64_t size;
+    uint64_t capacity;
+} arrow_buffer;
+
+typedef struct {
+    Oid oid;
+    uint8_t type;
+    /* Bytes per value for fixed width types, or 0. */
+    uint8_t width;
+} arrow_column;
+
+typedef struct {
+    int64_t offset;
+    int32_t metadata_size;
+    int64_t body_size;
+} arrow_block;
+
+/* Flatbuffers are built from the end towards the start. Offsets to objects
+   are given as their distance from the end of the buffer. */
+typedef struct {
+    char *data;
+    uint64_t capacity;
+    uint64_t head;
+    uint64_t min_align;
+    uint64_t table_start;
+    uint32_t fields[8];
+    int field_count;
+} fb_builder;
+
+void write_le16(char *out, uint16_t value)
+{
+    out[0] = (char)(value & 0xff);
+    out[1] = (char)(value >> 8);
+}
+
+void write_le32(char *out, uint32_t value)
+{
+    int i;
+
+    for (i = 0;i < 4;i++) {
+        out[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+void write_le64(char *out, uint64_t value)
+{
+    int i;
+
+    for (i = 0;i < 8;i++) {
+        out[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+char *arrow_grow(arrow_buffer *b, uint64_t size)
+{
+    if (b->size + size > b->capacity) {
+        while (b->size + size > b->capacity)
+            b->capacity *= 2;
+
+        b->data = realloc(b->data, b->capacity);
+    }
+
+    char *out = b->data + b->size;
+
+    b->size += size;
+    return out;
+}
+
+/* Arrow buffers start on 8 byte boundaries. */
+void arrow_pad(arrow_buffer *b)
+{
+    uint64_t pad = (8 - (b->size & 7)) & 7;
+
+    memset(arrow_grow(b, pad), 0, pad);
+}
+
+uint64_t fb_size(fb_builder *b)
+{
+    return b->capacity - b->head;
+}
+
+char *fb_push(fb_builder *b, uint64_t size)
+{
+    if (size > b->head) {
+        uint64_t used = fb_size(b);
+        uint64_t new_capacity = b->capacity;
+
+        while (new_capacity - used < size)
+            new_capacity *= 2;
+
+        char *new_data = malloc(new_capacity);
+
+        memcpy(new_data + new_capacity - used, b->data + b->head, used);
+        free(b->data);
+        b->data = new_data;
+        b->head = new_capacity - used;
+        b->capacity = new_capacity;
+    }
+
+    b->head -= size;
+    return b->data + b->head;
+}
+
+/* Pad so that after `extra` more bytes, the size is a multiple of `align`. */
+void fb_prep(fb_builder *b, uint64_t align, uint64_t extra)
+{
+    if (align > b->min_align)
+        b->min_align = align;
+
+    uint64_t pad = (align - ((fb_size(b) + extra) & (align - 1))) &
+                   (align - 1);
+
+    memset(fb_push(b, pad), 0, pad);
+}
+
+void fb_init(fb_builder *b)
+{
+    b->capacity = 1024;
+    b->head = b->capacity;
+    b->data = malloc(b->capacity);
+    b->min_align = 1;
+}
+
+void fb_reset(fb_builder *b)
+{
+    b->head = b->capacity;
+    b->min_align = 1;
+}
+
+uint32_t fb_string(fb_builder *b, const char *text)
+{
+    uint64_t size = strlen(text);
+
+    fb_prep(b, 4, size + 1);
+    fb_push(b, 1)[0] = '\0';
+    memcpy(fb_push(b, size), text, size);
+    fb_prep(b, 4, 4);
+    write_le32(fb_push(b, 4), (uint32_t)size);
+    return (uint32_t)fb_size(b);
+}
+
+/* An offset is stored relative to where it is written. */
+void fb_push_offset(fb_builder *b, uint32_t target)
+{
+    fb_prep(b, 4, 4);
+    write_le32(fb_push(b, 4), (uint32_t)fb_size(b) + 4 - target);
+}
+
+uint32_t fb_offset_vector(fb_builder *b, uint32_t *targets, int count)
+{
+    int i;
+
+    fb_prep(b, 4, 4 * (uint64_t)count);
+
+    for (i = count - 1;i >= 0;i--)
+        fb_push_offset(b, targets[i]);
+
+    write_le32(fb_push(b, 4), (uint32_t)count);
+    return (uint32_t)fb_size(b);
+}
+
+/* `data` holds `count` structs of `size` bytes, already little-endian. */
+uint32_t fb_struct_vector(fb_builder *b, const char *data, int count,
+        uint64_t size)
+{
+    fb_prep(b, 4, size * count);
+    fb_prep(b, 8, size * count);
+
+    if (count)
+        memcpy(fb_push(b, size * count), data, size * count);
+
+    fb_prep(b, 4, 4);
+    write_le32(fb_push(b, 4), (uint32_t)count);
+    return (uint32_t)fb_size(b);
+}
+
+void fb_start_table(fb_builder *b, int field_count)
+{
+    b->table_start = fb_size(b);
+    b->field_count = field_count;
+    memset(b->fields, 0, sizeof(b->fields));
+}
+
+void fb_add_i8(fb_builder *b, int field, uint8_t value)
+{
+    fb_prep(b, 1, 0);
+    fb_push(b, 1)[0] = (char)value;
+    b->fields[field] = (uint32_t)fb_size(b);
+}
+
+void fb_add_i16(fb_builder *b, int field, uint16_t value)
+{
+    fb_prep(b, 2, 0);
+    write_le16(fb_push(b, 2), value);
+    b->fields[field] = (uint32_t)fb_size(b);
+}
+
+void fb_add_i32(fb_builder *b, int field, uint32_t value)
+{
+    fb_prep(b, 4, 0);
+    write_le32(fb_push(b, 4), value);
+    b->fields[field] = (uint32_t)fb_size(b);
+}
+
+void fb_add_i64(fb_builder *b, int field, uint64_t value)
+{
+    fb_prep(b, 8, 0);
+    write_le64(fb_push(b, 8), value);
+    b->fields[field] = (uint32_t)fb_size(b);
+}
+
+void fb_add_offset(fb_builder *b, int field, uint32_t target)
+{
+    fb_push_offset(b, target);
+    b->fields[field] = (uint32_t)fb_size(b);
+}
+
+/* Finish a table by writing its vtable right before it. */
+uint32_t fb_end_table(fb_builder *b)
+{
+    fb_prep(b, 4, 4);
+    fb_push(b, 4);
+
+    uint32_t table = (uint32_t)fb_size(b);
+    int i;
+
+    for (i = b->field_count - 1;i >= 0;i--) {
+        uint16_t field_offset = 0;
+
+        if (b->fields[i])
+            field_offset = (uint16_t)(table - b->fields[i]);
+
+        write_le16(fb_push(b, 2), field_offset);
+    }
+
+    write_le16(fb_push(b, 2), (uint16_t)(table - b->table_start));
+    write_le16(fb_push(b, 2), (uint16_t)(4 + 2 * b->field_count));
+
+    /* The table starts with the distance back to its vtable. */
+    write_le32(b->data + b->capacity - table, (uint32_t)(fb_size(b) - table));
+    return table;
+}
+
+char *fb_finish(fb_builder *b, uint32_t root)
+{
+    fb_prep(b, b->min_align, 4);
+    fb_push_offset(b, root);
+    return b->data + b->head;
+}
+
+void arrow_columns_init(arrow_column *columns, lily_postgres_Cursor *c,
+        int num_cols)
+{
+    int col;
+
+    for (col = 0;col < num_cols;col++) {
+        Oid oid = cursor_column_type(c, col);
+        uint8_t type, width = 0;
+
+        switch (oid) {
+            case INT2OID: type = ARROW_TYPE_INT; width = 2; break;
+            case INT4OID: type = ARROW_TYPE_INT; width = 4; break;
+            case INT8OID: type = ARROW_TYPE_INT; width = 8; break;
+            case FLOAT4OID: type = ARROW_TYPE_FLOAT; width = 4; break;
+            case FLOAT8OID: type = ARROW_TYPE_FLOAT; width = 8; break;
+            case BOOLOID: type = ARROW_TYPE_BOOL; break;
+            case BYTEAOID: type = ARROW_TYPE_BINARY; break;
+            /* Everything else is sent as the server's text for it. */
+            default: type = ARROW_TYPE_UTF8; break;
+        }
+
+        columns[col].oid = oid;
+        columns[col].type = type;
+        columns[col].width = width;
+    }
+}
+
+uint32_t arrow_build_schema(fb_builder *b, lily_postgres_Cursor *cursor,
+        arrow_column *columns, int num_cols)
+{
+    uint32_t *fields = malloc(num_cols * sizeof(*fields));
+    int col;
+
+    for (col = 0;col < num_cols;col++) {
+        arrow_column *c = &columns[col];
+        uint32_t name = fb_string(b, cursor_column_name(cursor, col));
+        uint32_t children = fb_offset_vector(b, NULL, 0);
+        uint32_t type;
+
+        if (c->type == ARROW_TYPE_INT) {
+            fb_start_table(b, 2);
+            fb_add_i32(b, 0, c->width * 8);
+            fb_add_i8(b, 1, 1);
+        }
+        else if (c->type == ARROW_TYPE_FLOAT) {
+            /* Precision: 1 is single, 2 is double. */
+            fb_start_table(b, 1);
+            fb_add_i16(b, 0, c->width == 4 ? 1 : 2);
+        }
+        else
+            fb_start_table(b, 0);
+
+        type = fb_end_table(b);
+
+        fb_start_table(b, 6);
+        fb_add_offset(b, 0, name);
+        fb_add_offset(b, 3, type);
+        fb_add_offset(b, 5, children);
+        fb_add_i8(b, 1, 1);
+        fb_add_i8(b, 2, c->type);
+        fields[col] = fb_end_table(b);
+    }
+
+    uint32_t field_vector = fb_offset_vector(b, fields, num_cols);
+
+    free(fields);
+    fb_start_table(b, 2);
+    fb_add_offset(b, 1, field_vector);
+    fb_add_i16(b, 0, 0);
+    return fb_end_table(b);
+}
+
+/* Write a message with its continuation marker and length, padded so that
+   the body that follows starts on an 8 byte boundary. */
+void arrow_write_message(FILE *f, arrow_block *block, uint64_t *file_pos,
+        fb_builder *b, uint32_t root, arrow_buffer *body)
+{
+    char *metadata = fb_finish(b, root);
+    uint64_t metadata_size = fb_size(b);
+    uint64_t padded = (metadata_size + 8 + 7) & ~(uint64_t)7;
+    char prefix[8];
+    char zeros[8] = {0};
+
+    write_le32(prefix, 0xffffffff);
+    write_le32(prefix + 4, (uint32_t)(padded - 8));
+    fwrite(prefix, 1, 8, f);
+    fwrite(metadata, 1, metadata_size, f);
+    fwrite(zeros, 1, padded - 8 - metadata_size, f);
+
+    if (body)
+        fwrite(body->data, 1, body->size, f);
+
+    block->offset = *file_pos;
+    block->metadata_size = (int32_t)padded;
+    block->body_size = body ? body->size : 0;
+    *file_pos += padded + block->body_size;
+}
+
+int hex_value(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    else if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    else if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+
+    return 0;
+}
+
+/* Add one column of rows `start` to `stop` to the body. Each buffer's offset
+   and size is added to `buffers`, and the column's length and null count to
+   `nodes`. Returns 0 if a Binary or Utf8 column has more data than its int32
+   offsets can reach. */
+int arrow_add_column(arrow_buffer *body, arrow_buffer *buffers,
+        arrow_buffer *nodes, lily_postgres_Cursor *cursor, arrow_column *c,
+        int col, int start, int stop)
+{
+    int count = stop - start;
+    uint64_t bitmap_size = ((uint64_t)count + 7) / 8;
+    uint64_t validity_start = body->size;
+    char *validity = arrow_grow(body, bitmap_size);
+    int64_t null_count = 0;
+    int row, size;
+
+    memset(validity, 0, bitmap_size);
+
+    for (row = 0;row < count;row++) {
+        if (cursor_field(cursor, start + row, col, &size) == NULL)
+            null_count++;
+        else
+            body->data[validity_start + row / 8] |= (char)(1 << (row % 8));
+    }
+
+    write_le64(arrow_grow(nodes, 16), count);
+    write_le64(nodes->data + nodes->size - 8, null_count);
+    write_le64(arrow_grow(buffers, 16), validity_start);
+    write_le64(buffers->data + buffers->size - 8, bitmap_size);
+    arrow_pad(body);
+
+    uint64_t values_start = body->size;
+
+    if (c->type == ARROW_TYPE_INT || c->type == ARROW_TYPE_FLOAT) {
+        char *values = arrow_grow(body, (uint64_t)count * c->width);
+
+        memset(values, 0, (uint64_t)count * c->width);
+
+        for (row = 0;row < count;row++) {
+            char *text = cursor_field(cursor, start + row, col, &size);
+
+            if (text == NULL)
+                continue;
+
+            char *out = body->data + values_start + (uint64_t)row * c->width;
+
+            if (c->type == ARROW_TYPE_INT) {
+                int64_t value = strtoll(text, NULL, 10);
+
+                if (c->width == 8)
+                    write_le64(out, (uint64_t)value);
+                else if (c->width == 4)
+                    write_le32(out, (uint32_t)value);
+                else
+                    write_le16(out, (uint16_t)value);
+            }
+            else if (c->width == 8) {
+                double value = strtod(text, NULL);
+                uint64_t bits;
+
+                memcpy(&bits, &value, sizeof(bits));
+                write_le64(out, bits);
+            }
+            else {
+                float value = strtof(text, NULL);
+                uint32_t bits;
+
+                memcpy(&bits, &value, sizeof(bits));
+                write_le32(out, bits);
+            }
+        }
+    }
+    else if (c->type == ARROW_TYPE_BOOL) {
+        char *values = arrow_grow(body, bitmap_size);
+
+        memset(values, 0, bitmap_size);
+
+        for (row = 0;row < count;row++) {
+            char *text = cursor_field(cursor, start + row, col, &size);
+
+            if (text && text[0] == 't')
+                body->data[values_start + row / 8] |= (char)(1 << (row % 8));
+        }
+    }
+    else {
+        /* Binary and Utf8 have int32 offsets, then the data. */
+        uint64_t offsets_size = ((uint64_t)count + 1) * 4;
+        uint64_t data_size = 0;
+
+        arrow_grow(body, offsets_size);
+        arrow_pad(body);
+
+        uint64_t data_start = body->size;
+
+        for (row = 0;row < count;row++) {
+            write_le32(body->data + values_start + (uint64_t)row * 4,
+                    (uint32_t)data_size);
+
+            char *text = cursor_field(cursor, start + row, col, &size);
+
+            if (text == NULL)
+                continue;
+
+            if (data_size + size > INT32_MAX)
+                return 0;
+
+            if (c->type == ARROW_TYPE_BINARY && size >= 2 &&
+                text[0] == '\\' && text[1] == 'x') {
+                int i, byte_count = (size - 2) / 2;
+                char *out = arrow_grow(body, byte_count);
+
+                for (i = 0;i < byte_count;i++)
+                    out[i] = (char)((hex_value(text[2 + i * 2]) << 4) |
+                                    hex_value(text[3 + i * 2]));
+
+                data_size += byte_count;
+            }
+            else {
+                memcpy(arrow_grow(body, size), text, size);
+                data_size += size;
+            }
+        }
+
+        write_le32(body->data + values_start + (uint64_t)count * 4,
+                (uint32_t)data_size);
+        write_le64(arrow_grow(buffers, 16), values_start);
+        write_le64(buffers->data + buffers->size - 8, offsets_size);
+        values_start = data_start;
+    }
+
+    write_le64(arrow_grow(buffers, 16), values_start);
+    write_le64(buffers->data + buffers->size - 8, body->size - values_start);
+    arrow_pad(body);
+    return 1;
+}
+
+/**
+define Cursor.write_arrow(path: String, batch_rows: *Integer=65536)
+
+Write every row in `self` to a new file at `path`, using the Arrow IPC file
+format. Rows are written in record batches of up to `batch_rows` rows, built
+directly from the result without making any Lily values.
+
+Columns of type `int2`, `int4`, `int8`, `float4`, `float8`, `bool`, and `bytea`
+become the matching Arrow type. Other columns become `Utf8` columns holding the
+server's text for each value.
+
+# Errors
+
+* `IOError` if the file cannot be opened for writing.
+
+* `ValueError` if `batch_rows` is less than 1, or if `self` is closed.
+
+* `ValueError` if a `Utf8` or `Binary` column in one batch has more than 2GB of
+  data, which is past what its offsets can reach. The file is removed.
+*/
+void lily_postgres_Cursor_write_arrow(lily_state *s)
+{
+    lily_postgres_Cursor *boxed_result = ARG_Cursor(s, 0);
+    char *path = lily_arg_string_raw(s, 1);
+    int64_t batch_rows = ARROW_BATCH_ROWS;
+
+    if (lily_arg_count(s) == 3)
+        batch_rows = lily_arg_integer(s, 2);
+
+    if (batch_rows < 1)
+        lily_ValueError(s, "batch_rows must be at least 1.");
+
+    if (boxed_result->is_closed)
+        lily_ValueError(s, "Cursor is closed.");
+
+    FILE *f = fopen(path, "wb");
+
+    if (f == NULL)
+        lily_IOError(s, "Unable to open '%s' for writing.", path);
+
+    int num_cols = boxed_result->column_count;
+    int row_count = boxed_result->row_count;
+    int batch_count = (int)((row_count + batch_rows - 1) / batch_rows);
+    arrow_column *columns = malloc((num_cols + 1) * sizeof(*columns));
+    arrow_block *blocks = malloc((batch_count + 1) * sizeof(*blocks));
+    arrow_block schema_block;
+    arrow_buffer body = {malloc(4096), 0, 4096};
+    arrow_buffer buffers = {malloc(256), 0, 256};
+    arrow_buffer nodes = {malloc(256), 0, 256};
+    uint64_t file_pos = 8;
+    fb_builder b;
+    int batch, col, too_large = -1;
+
+    fb_init(&b);
+    arrow_columns_init(columns, boxed_result, num_cols);
+    fwrite("ARROW1\0\0", 1, 8, f);
+
+    uint32_t schema = arrow_build_schema(&b, boxed_result, columns,
+            num_cols);
+
+    fb_start_table(&b, 5);
+    fb_add_i64(&b, 3, 0);
+    fb_add_offset(&b, 2, schema);
+    fb_add_i16(&b, 0, ARROW_METADATA_V5);
+    fb_add_i8(&b, 1, ARROW_HEADER_SCHEMA);
+    arrow_write_message(f, &schema_block, &file_pos, &b, fb_end_table(&b),
+            NULL);
+
+    for (batch = 0;batch < batch_count;batch++) {
+        int start = (int)(batch * batch_rows);
+        int stop = start + (int)batch_rows;
+
+        if (stop > row_count)
+            stop = row_count;
+
+        body.size = 0;
+        buffers.size = 0;
+        nodes.size = 0;
+
+        for (col = 0;col < num_cols;col++)
+            if (arrow_add_column(&body, &buffers, &nodes, boxed_result,
+                    &columns[col], col, start, stop) == 0) {
+                too_large = col;
+                goto cleanup;
+            }
+
+        fb_reset(&b);
+
+        uint32_t buffer_vector = fb_struct_vector(&b, buffers.data,
+                (int)(buffers.size / 16), 16);
+        uint32_t node_vector = fb_struct_vector(&b, nodes.data,
+                (int)(nodes.size / 16), 16);
+
+        fb_start_table(&b, 4);
+        fb_add_i64(&b, 0, stop - start);
+        fb_add_offset(&b, 1, node_vector);
+        fb_add_offset(&b, 2, buffer_vector);
+
+        uint32_t record_batch = fb_end_table(&b);
+
+        fb_start_table(&b, 5);
+        fb_add_i64(&b, 3, body.size);
+        fb_add_offset(&b, 2, record_batch);
+        fb_add_i16(&b, 0, ARROW_METADATA_V5);
+        fb_add_i8(&b, 1, ARROW_HEADER_RECORD_BATCH);
+        arrow_write_message(f, &blocks[batch], &file_pos, &b,
+                fb_end_table(&b), &body);
+    }
+
+    /* The footer repeats the schema, and has the place of each batch. */
+    fb_reset(&b);
+    body.size = 0;
+
+    for (batch = 0;batch < batch_count;batch++) {
+        char *out = arrow_grow(&body, 24);
+
+        write_le64(out, blocks[batch].offset);
+        write_le32(out + 8, blocks[batch].metadata_size);
+        write_le32(out + 12, 0);
+        write_le64(out + 16, blocks[batch].body_size);
+    }
+
+    uint32_t batch_vector = fb_struct_vector(&b, body.data, batch_count, 24);
+    uint32_t dictionary_vector = fb_struct_vector(&b, NULL, 0, 24);
+
+    schema = arrow_build_schema(&b, boxed_result, columns, num_cols);
+    fb_start_table(&b, 5);
+    fb_add_offset(&b, 1, schema);
+    fb_add_offset(&b, 2, dictionary_vector);
+    fb_add_offset(&b, 3, batch_vector);
+    fb_add_i16(&b, 0, ARROW_METADATA_V5);
+
+    char *footer = fb_finish(&b, fb_end_table(&b));
+    uint64_t footer_size = fb_size(&b);
+    char footer_length[4];
+
+    write_le32(footer_length, (uint32_t)footer_size);
+    fwrite(footer, 1, footer_size, f);
+    fwrite(footer_length, 1, 4, f);
+    fwrite("ARROW1", 1, 6, f);
+
+cleanup:;
+    int error = ferror(f);
+
+    fclose(f);
+    free(b.data);
+    free(body.data);
+    free(buffers.data);
+    free(nodes.data);
+    free(blocks);
+    free(columns);
+
+    if (too_large != -1) {
+        /* Don't leave a file without a footer behind. */
+        remove(path);
+        lily_ValueError(s,
+                "Column %d has more than 2GB of data in one batch. Use a "
+                "smaller batch_rows.", too_large);
+    }
+
+    if (error)
+        lily_IOError(s, "Unable to write to '%s'.", path);
+}
+
+/**
+foreign class Template {
+    layout {
+        uint64_t placeholder_count;
+        uint64_t fmt_size;
+        uint64_t buffer_size;
+        uint64_t *offsets;
+        uint64_t *value_sizes;
+        char *fmt;
+        char *buffer;
+    }
+}
+
+A `Template` is a format string that `Conn.compile` has already searched for
+`"?"` values. Running it through `Conn.query_template` builds the query without
+scanning the format again.
+*/
+
+void destroy_Template(lily_postgres_Template *t)
+{
+    free(t->offsets);
+    free(t->value_sizes);
+    free(t->fmt);
+    free(t->buffer);
+}
+
+/**
+define Template.placeholder_count: Integer
+
+Returns the number of `"?"` values that were found in the format of `self`.
+*/
+void lily_postgres_Template_placeholder_count(lily_state *s)
+{
+    lily_postgres_Template *t = ARG_Template(s, 0);
+
+    lily_return_integer(s, t->placeholder_count);
+}
+
+/**
+foreign class Params {
+    layout {
+        uint64_t count;
+        uint64_t size;
+        Oid *types;
+        char **values;
+        int *lengths;
+        int *formats;
+    }
+}
+
+The `Params` class holds typed values for `Conn.query_params`. `Integer`,
+`Double`, `Boolean`, and `ByteString` values are sent to the server in binary,
+so they are not converted to text and back. A `ByteString` is sent as `bytea`
+exactly as it is, including any zero bytes.
+*/
+
+void destroy_Params(lily_postgres_Params *p)
+{
+    uint64_t i;
+
+    for (i = 0;i < p->count;i++)
+        free(p->values[i]);
+
+    free(p->types);
+    free(p->values);
+    free(p->lengths);
+    free(p->formats);
+}
+
+char *params_add(lily_postgres_Params *p, Oid type, int length, int format)
+{
+    if (p->count == p->size) {
+        p->size *= 2;
+        p->types = realloc(p->types, p->size * sizeof(*p->types));
+        p->values = realloc(p->values, p->size * sizeof(*p->values));
+        p->lengths = realloc(p->lengths, p->size * sizeof(*p->lengths));
+        p->formats = realloc(p->formats, p->size * sizeof(*p->formats));
+    }
+
+    char *value = NULL;
+
+    /* Null values are sent with a NULL pointer. */
+    if (length != -1)
+        value = malloc(length + 1);
+
+    p->types[p->count] = type;
+    p->values[p->count] = value;
+    p->lengths[p->count] = length;
+    p->formats[p->count] = format;
+    p->count++;
+    return value;
+}
+
+/* Binary parameters are sent in network byte order. */
+void write_be64(char *out, uint64_t value)
+{
+    int i;
+
+    for (i = 7;i >= 0;i--) {
+        out[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+/**
+static define Params.new(size: *Integer=4): Params
+
+Create a new, empty `Params`, with room for `size` values before growing.
+*/
+void lily_postgres_Params_new(lily_state *s)
+{
+    int64_t size = 4;
+
+    if (lily_arg_count(s) == 1)
+        size = lily_arg_integer(s, 0);
+
+    if (size < 1)
+        size = 1;
+
+    lily_postgres_Params *p = INIT_Params(s);
+    p->count = 0;
+    p->size = size;
+    p->types = malloc(size * sizeof(*p->types));
+    p->values = malloc(size * sizeof(*p->values));
+    p->lengths = malloc(size * sizeof(*p->lengths));
+    p->formats = malloc(size * sizeof(*p->formats));
+
+    lily_return_top(s);
+}
+
+/**
+define Params.add_boolean(value: Boolean)
+
+Add `value` as a `bool` parameter.
+*/
+void lily_postgres_Params_add_boolean(lily_state *s)
+{
+    lily_postgres_Params *p = ARG_Params(s, 0);
+    char *out = params_add(p, BOOLOID, 1, 1);
+
+    out[0] = (lily_arg_boolean(s, 1) != 0);
+}
+
+/**
+define Params.add_bytestring(value: ByteString)
+
+Add `value` as a `bytea` parameter.
+*/
+void lily_postgres_Params_add_bytestring(lily_state *s)
+{
+    lily_postgres_Params *p = ARG_Params(s, 0);
+    lily_bytestring_val *bv = lily_arg_bytestring(s, 1);
+    int length = lily_bytestring_length(bv);
+    char *out = params_add(p, BYTEAOID, length, 1);
+
+    memcpy(out, lily_bytestring_raw(bv), length);
+}
+
+/**
+define Params.add_double(value: Double)
+
+Add `value` as a `float8` parameter.
+*/
+void lily_postgres_Params_add_double(lily_state *s)
+{
+    lily_postgres_Params *p = ARG_Params(s, 0);
+    double value = lily_arg_double(s, 1);
+    uint64_t bits;
+    char *out = params_add(p, FLOAT8OID, 8, 1);
+
+    memcpy(&bits, &value, sizeof(bits));
+    write_be64(out, bits);
+}
+
+/**
+define Params.add_integer(value: Integer)
+
+Add `value` as an `int8` parameter.
+*/
+void lily_postgres_Params_add_integer(lily_state *s)
+{
+    lily_postgres_Params *p = ARG_Params(s, 0);
+    char *out = params_add(p, INT8OID, 8, 1);
+
+    write_be64(out, (uint64_t)lily_arg_integer(s, 1));
+}
+
+/**
+define Params.add_null
+
+Add a null parameter. The server decides the type from the query.
+*/
+void lily_postgres_Params_add_null(lily_state *s)
+{
+    lily_postgres_Params *p = ARG_Params(s, 0);
+
+    params_add(p, 0, -1, 0);
+}
+
+/**
+define Params.add_string(value: String)
+
+Add `value` as a text parameter. The server decides the type from the query,
+so this can also be used for dates, numerics, and other types written as text.
+*/
+void lily_postgres_Params_add_string(lily_state *s)
+{
+    lily_postgres_Params *p = ARG_Params(s, 0);
+    lily_string_val *sv = lily_arg_string(s, 1);
+    int length = lily_string_length(sv);
+    char *out = params_add(p, 0, length, 0);
+
+    memcpy(out, lily_string_raw(sv), length + 1);
+}
+
+/**
+define Params.clear
+
+Remove every value from `self`, so that it can be filled again.
+*/
+void lily_postgres_Params_clear(lily_state *s)
+{
+    lily_postgres_Params *p = ARG_Params(s, 0);
+    uint64_t i;
+
+    for (i = 0;i < p->count;i++)
+        free(p->values[i]);
+
+    p->count = 0;
+}
+
+/**
+define Params.size: Integer
+
+Returns the number of values in `self`.
+*/
+void lily_postgres_Params_size(lily_state *s)
+{
+    lily_postgres_Params *p = ARG_Params(s, 0);
+
+    lily_return_integer(s, p->count);
+}
+
+/**
+foreign class CopyWriter {
+    layout {
+        uint64_t column_count;
+        uint64_t column;
+        uint64_t row_count;
+        uint64_t buffer_pos;
+        uint64_t buffer_size;
+        Oid *column_types;
+        char *buffer;
+        struct lily_postgres_Conn_ *conn_value;
+    }
+}
+
+A `CopyWriter` sends rows to the server using the binary `COPY` format. It is
+created by `Conn.copy_in_binary`. Fields are written one at a time, in column
+order, and each row is ended by `CopyWriter.end_row`. Rows are collected into a
+large buffer which is sent when full, and when `CopyWriter.finish` is called.
+
+The `Conn` that made a `CopyWriter` cannot run other queries until the writer
+is finished. Until then, queries on it return a `Failure` instead of ending the
+copy. If a writer is destroyed before it is finished, the copy is
+cancelled and none of the rows are kept.
+*/
+
+#define COPY_BUFFER_SIZE (256 * 1024)
+
+void write_be16(char *out, uint16_t value)
+{
+    out[0] = (char)(value >> 8);
+    out[1] = (char)(value & 0xff);
+}
+
+void write_be32(char *out, uint32_t value)
+{
+    int i;
+
+    for (i = 3;i >= 0;i--) {
+        out[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+/* Detach `w` from its Conn. The writer cannot be used after this. */
+void copy_unlink(lily_postgres_CopyWriter *w)
+{
+    if (w->conn_value) {
+        w->conn_value->copy_writer = NULL;
+        w->conn_value = NULL;
+    }
+}
+
+void destroy_CopyWriter(lily_postgres_CopyWriter *w)
+{
+    if (w->conn_value) {
+        PGconn *conn = w->conn_value->conn;
+
+        PQputCopyEnd(conn, "CopyWriter destroyed before finish.");
+
+        PGresult *raw_result;
+        while ((raw_result = PQgetResult(conn)) != NULL)
+            PQclear(raw_result);
+
+        copy_unlink(w);
+    }
+
+    free(w->column_types);
+    free(w->buffer);
+}
+
+void copy_flush(lily_state *s, lily_postgres_CopyWriter *w)
+{
+    if (w->buffer_pos == 0)
+        return;
+
+    PGconn *conn = w->conn_value->conn;
+
+    if (PQputCopyData(conn, w->buffer, (int)w->buffer_pos) != 1)
+        lily_RuntimeError(s, "%s", PQerrorMessage(conn));
+
+    w->buffer_pos = 0;
+}
+
+/* Make sure `size` more bytes can be added to the buffer, sending what is
+   there already if needed. */
+char *copy_reserve(lily_state *s, lily_postgres_CopyWriter *w, uint64_t size)
+{
+    if (w->buffer_pos + size > w->buffer_size) {
+        copy_flush(s, w);
+
+        if (size > w->buffer_size) {
+            w->buffer_size = size;
+            w->buffer = realloc(w->buffer, size);
+        }
+    }
+
+    char *out = w->buffer + w->buffer_pos;
+
+    w->buffer_pos += size;
+    return out;
+}
+
+/* Check that another field can be added to the current row, and return the
+   type that the server expects for it. */
+Oid copy_field_type(lily_state *s, lily_postgres_CopyWriter *w)
+{
+    if (w->conn_value == NULL)
+        lily_ValueError(s, "CopyWriter is already finished.");
+
+    if (w->column == w->column_count)
+        lily_ValueError(s, "Row already has %d fields.",
+                (int)w->column_count);
+
+    return w->column_types[w->column];
+}
+
+/* Start a field holding `size` bytes, and return where the bytes go. Fields
+   begin with their size, and rows begin with their field count. */
+char *copy_field(lily_state *s, lily_postgres_CopyWriter *w, uint32_t size)
+{
+    if (w->column == 0)
+        write_be16(copy_reserve(s, w, 2), (uint16_t)w->column_count);
+
+    char *out = copy_reserve(s, w, 4 + (uint64_t)size);
+
+    write_be32(out, size);
+    w->column++;
+    return out + 4;
+}
+
+void copy_type_error(lily_state *s, lily_postgres_CopyWriter *w,
+        const char *given)
+{
+    lily_ValueError(s, "Cannot write %s to column %d.", given,
+            (int)w->column);
+}
+
+/**
+define CopyWriter.end_row
+
+Finish the current row of `self`.
+
+# Errors
+
+* `ValueError` if the row does not have a field for every column.
+*/
+void lily_postgres_CopyWriter_end_row(lily_state *s)
+{
+    lily_postgres_CopyWriter *w = ARG_CopyWriter(s, 0);
+
+    if (w->conn_value == NULL)
+        lily_ValueError(s, "CopyWriter is already finished.");
+
+    if (w->column != w->column_count)
+        lily_ValueError(s, "Row has %d of %d fields.", (int)w->column,
+                (int)w->column_count);
+
+    w->column = 0;
+    w->row_count++;
+}
+
+/**
+define CopyWriter.finish: Result[String, Integer]
+
+Send any buffered rows to the server and end the copy. After this, `self` cannot
+be written to.
+
+On success, the result is a `Success` containing the number of rows written.
+
+On failure, the result is a `Failure` containing a `String` describing the
+error. None of the rows are kept.
+
+# Errors
+
+* `ValueError` if a row was started but not ended.
+*/
+void lily_postgres_CopyWriter_finish(lily_state *s)
+{
+    lily_postgres_CopyWriter *w = ARG_CopyWriter(s, 0);
+
+    if (w->conn_value == NULL)
+        lily_ValueError(s, "CopyWriter is already finished.");
+
+    if (w->column != 0)
+        lily_ValueError(s, "Row has %d of %d fields.", (int)w->column,
+                (int)w->column_count);
+
+    PGconn *conn = w->conn_value->conn;
+    lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+    PGresult *raw_result;
+
+    /* The trailer is a field count of -1. */
+    write_be16(copy_reserve(s, w, 2), 0xffff);
+    copy_flush(s, w);
+    copy_unlink(w);
+
+    if (PQputCopyEnd(conn, NULL) != 1)
+        lily_mb_add(msgbuf, PQerrorMessage(conn));
+
+    while ((raw_result = PQgetResult(conn)) != NULL) {
+        if (result_failed(raw_result))
+            lily_mb_add(msgbuf, PQresultErrorMessage(raw_result));
+
+        PQclear(raw_result);
+    }
+
+    if (lily_mb_raw(msgbuf)[0] != '\0') {
+        return_failure(s, lily_mb_raw(msgbuf));
+        return;
+    }
+
+    lily_container_val *variant = lily_push_success(s);
+
+    lily_push_integer(s, w->row_count);
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/**
+define CopyWriter.write_boolean(value: Boolean)
+
+Write `value` to the next field of a `bool` column.
+
+# Errors
+
+* `ValueError` if the column is not `bool`, or the row is full.
+*/
+void lily_postgres_CopyWriter_write_boolean(lily_state *s)
+{
+    lily_postgres_CopyWriter *w = ARG_CopyWriter(s, 0);
+    Oid type = copy_field_type(s, w);
+
+    if (type != BOOLOID)
+        copy_type_error(s, w, "Boolean");
+
+    char *out = copy_field(s, w, 1);
+
+    out[0] = (lily_arg_boolean(s, 1) != 0);
+}
+
+/**
+define CopyWriter.write_bytes(value: ByteString)
+
+Write `value` to the next field of a `bytea` or `text` column. The bytes are
+sent exactly as they are, so a `text` column must be given valid text.
+
+# Errors
+
+* `ValueError` if the column is not `bytea` or `text`, or the row is full.
+*/
+void lily_postgres_CopyWriter_write_bytes(lily_state *s)
+{
+    lily_postgres_CopyWriter *w = ARG_CopyWriter(s, 0);
+    lily_bytestring_val *bv = lily_arg_bytestring(s, 1);
+    Oid type = copy_field_type(s, w);
+
+    if (type != BYTEAOID && type != TEXTOID)
+        copy_type_error(s, w, "ByteString");
+
+    uint32_t size = lily_bytestring_length(bv);
+
+    memcpy(copy_field(s, w, size), lily_bytestring_raw(bv), size);
+}
+
+/**
+define CopyWriter.write_double(value: Double)
+
+Write `value` to the next field of a `float4` or `float8` column.
+
+# Errors
+
+* `ValueError` if the column is not `float4` or `float8`, or the row is full.
+*/
+void lily_postgres_CopyWriter_write_double(lily_state *s)
+{
+    lily_postgres_CopyWriter *w = ARG_CopyWriter(s, 0);
+    double value = lily_arg_double(s, 1);
+    Oid type = copy_field_type(s, w);
+
+    if (type == FLOAT8OID) {
+        uint64_t bits;
+
+        memcpy(&bits, &value, sizeof(bits));
+        write_be64(copy_field(s, w, 8), bits);
+    }
+    else if (type == FLOAT4OID) {
+        float small = (float)value;
+        uint32_t bits;
+
+        memcpy(&bits, &small, sizeof(bits));
+        write_be32(copy_field(s, w, 4), bits);
+    }
+    else
+        copy_type_error(s, w, "Double");
+}
+
+/**
+define CopyWriter.write_integer(value: Integer)
+
+Write `value` to the next field of an `int2`, `int4`, or `int8` column.
+
+# Errors
+
+* `ValueError` if the column is not an integer column, if `value` is too large
+  for the column, or if the row is full.
+*/
+void lily_postgres_CopyWriter_write_integer(lily_state *s)
+{
+    lily_postgres_CopyWriter *w = ARG_CopyWriter(s, 0);
+    int64_t value = lily_arg_integer(s, 1);
+    Oid type = copy_field_type(s, w);
+
+    if (type == INT8OID)
+        write_be64(copy_field(s, w, 8), (uint64_t)value);
+    else if (type == INT4OID) {
+        if (value < INT32_MIN || value > INT32_MAX)
+            lily_ValueError(s, "Value is too large for int4.");
+
+        write_be32(copy_field(s, w, 4), (uint32_t)value);
+    }
+    else if (type == INT2OID) {
+        if (value < INT16_MIN || value > INT16_MAX)
+            lily_ValueError(s, "Value is too large for int2.");
+
+        write_be16(copy_field(s, w, 2), (uint16_t)value);
+    }
+    else
+        copy_type_error(s, w, "Integer");
+}
+
+/**
+define CopyWriter.write_null
+
+Write a null to the next field.
+
+# Errors
+
+* `ValueError` if the row is full.
+*/
+void lily_postgres_CopyWriter_write_null(lily_state *s)
+{
+    lily_postgres_CopyWriter *w = ARG_CopyWriter(s, 0);
+
+    copy_field_type(s, w);
+
+    /* Nulls are a size of -1 with no data. */
+    copy_field(s, w, 0);
+    write_be32(w->buffer + w->buffer_pos - 4, 0xffffffff);
+}
+
+/**
+define CopyWriter.write_string(value: String)
+
+Write `value` to the next field of a `text` column.
+
+# Errors
+
+* `ValueError` if the column is not `text`, or the row is full.
+*/
+void lily_postgres_CopyWriter_write_string(lily_state *s)
+{
+    lily_postgres_CopyWriter *w = ARG_CopyWriter(s, 0);
+    lily_string_val *sv = lily_arg_string(s, 1);
+    Oid type = copy_field_type(s, w);
+
+    if (type != TEXTOID)
+        copy_type_error(s, w, "String");
+
+    uint32_t size = lily_string_length(sv);
+
+    memcpy(copy_field(s, w, size), lily_string_raw(sv), size);
+}
+
+/**
+foreign class RowStream {
+    layout {
+        struct stream_ring_ *ring;
+        PGresult *current;
+        uint64_t current_row;
+        struct lily_postgres_Conn_ *conn_value;
+    }
+}
+
+A `RowStream` reads the rows of a query while the query is still running. It is
+made by `Conn.stream`. A thread that is not running Lily reads results from the
+server and parses them, and passes them to the Lily thread through a small
+queue. Rows can be used as soon as they arrive, while the next ones are read.
+
+The `Conn` that made a `RowStream` cannot run other queries until every row has
+been read, or until the stream is cancelled or destroyed.
+*/
+
+/* The queue between the I/O thread and the Lily thread holds this many
+   results. The I/O thread waits when it is full. */
+#define STREAM_RING_SIZE 256
+
+/* With chunked mode, each result holds up to this many rows. */
+#define STREAM_CHUNK_ROWS 256
+
+/* Results are passed from the I/O thread (which only moves `head`) to the Lily
+   thread (which only moves `tail`), without a lock. A side that has to wait
+   sleeps on `wake`, and the other side only takes the lock if someone is
+   asleep. The I/O thread ends by pushing NULL. If `stop` is set, it clears
+   the results it reads instead of pushing them. */
+typedef struct stream_ring_ {
+    PGresult *results[STREAM_RING_SIZE];
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    _Atomic int stop;
+    _Atomic int sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    PGconn *conn;
+    PGcancel *cancel;
+    /* Set by the Lily thread once it has taken the NULL. */
+    int done;
+} stream_ring;
+
+/* Sleep until the other side moves `index` away from `value`. */
+void stream_wait(stream_ring *ring, _Atomic uint64_t *index, uint64_t value)
+{
+    pthread_mutex_lock(&ring->lock);
+    atomic_fetch_add(&ring->sleepers, 1);
+
+    while (atomic_load(index) == value)
+        pthread_cond_wait(&ring->wake, &ring->lock);
+
+    atomic_fetch_sub(&ring->sleepers, 1);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void stream_wake(stream_ring *ring)
+{
+    if (atomic_load(&ring->sleepers) == 0)
+        return;
+
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_broadcast(&ring->wake);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void stream_push(stream_ring *ring, PGresult *raw_result)
+{
+    uint64_t head = atomic_load(&ring->head);
+    uint64_t tail;
+
+    while (head - (tail = atomic_load(&ring->tail)) == STREAM_RING_SIZE)
+        stream_wait(ring, &ring->tail, tail);
+
+    ring->results[head % STREAM_RING_SIZE] = raw_result;
+    atomic_store(&ring->head, head + 1);
+    stream_wake(ring);
+}
+
+PGresult *stream_pop(stream_ring *ring)
+{
+    uint64_t tail = atomic_load(&ring->tail);
+    uint64_t head;
+
+    while ((head = atomic_load(&ring->head)) == tail)
+        stream_wait(ring, &ring->head, head);
+
+    PGresult *raw_result = ring->results[tail % STREAM_RING_SIZE];
+
+    atomic_store(&ring->tail, tail + 1);
+    stream_wake(ring);
+    return raw_result;
+}
+
+/* The I/O thread. It owns the connection until it pushes NULL. */
+void *stream_read(void *data)
+{
+    stream_ring *ring = data;
+    PGresult *raw_result;
+    int copied = 0;
+
+    /* A COPY would keep the connection busy forever, since nothing sends or
+       reads its data. The copy is ended here, and its result is passed on
+       so that RowStream.next can raise. The results that follow are only
+       about ending the copy. */
+    while ((raw_result = PQgetResult(ring->conn)) != NULL) {
+        int copy = end_copy(ring->conn, raw_result);
+
+        if (copied || atomic_load(&ring->stop))
+            PQclear(raw_result);
+        else
+            stream_push(ring, raw_result);
+
+        copied |= copy;
+    }
+
+    stream_push(ring, NULL);
+    return NULL;
+}
+
+/* Wait for the I/O thread to finish, then give the connection back. If
+   `cancel` is set, the server is asked to stop the query first. */
+void stream_end(lily_postgres_RowStream *rs, int cancel)
+{
+    stream_ring *ring = rs->ring;
+
+    if (ring == NULL)
+        return;
+
+    if (cancel) {
+        char error_buffer[256];
+
+        atomic_store(&ring->stop, 1);
+        PQcancel(ring->cancel, error_buffer, sizeof(error_buffer));
+    }
+
+    PGresult *raw_result;
+
+    if (ring->done == 0)
+        while ((raw_result = stream_pop(ring)) != NULL)
+            PQclear(raw_result);
+
+    pthread_join(ring->thread, NULL);
+    pthread_cond_destroy(&ring->wake);
+    pthread_mutex_destroy(&ring->lock);
+    PQfreeCancel(ring->cancel);
+    free(ring);
+    PQclear(rs->current);
+    rs->ring = NULL;
+    rs->current = NULL;
+
+    if (rs->conn_value) {
+        rs->conn_value->stream = NULL;
+        rs->conn_value = NULL;
+    }
+}
+
+void destroy_RowStream(lily_postgres_RowStream *rs)
+{
+    stream_end(rs, 1);
+}
+
+/**
+define RowStream.cancel
+
+Stop reading rows. If the query is still running, the server is asked to
+cancel it. The `Conn` that made `self` can be used again once this returns.
+Calling `RowStream.next` afterward returns `None`.
+*/
+void lily_postgres_RowStream_cancel(lily_state *s)
+{
+    stream_end(ARG_RowStream(s, 0), 1);
+}
+
+/**
+define RowStream.next: Option[List[String]]
+
+Returns the next row of the query, waiting for it to arrive if it has not yet.
+Once every row has been returned, this returns `None` and the `Conn` that made
+`self` can be used again. Rows are the same as the ones that `Cursor.each_row`
+sends.
+
+# Errors
+
+* `RuntimeError` if the query fails partway through. The message is the one
+  from the server. Rows returned before the failure are not taken back.
+
+* `RuntimeError` if the query is a `COPY` that reads from or writes to the
+  client. The copy is ended without sending or reading any data.
+*/
+void lily_postgres_RowStream_next(lily_state *s)
+{
+    lily_postgres_RowStream *rs = ARG_RowStream(s, 0);
+
+    while (1) {
+        if (rs->ring == NULL) {
+            lily_return_none(s);
+            return;
+        }
+
+        PGresult *raw_result = rs->current;
+
+        if (raw_result && rs->current_row < PQntuples(raw_result))
+            break;
+
+        PQclear(raw_result);
+        rs->current = NULL;
+        raw_result = stream_pop(rs->ring);
+
+        if (raw_result == NULL) {
+            rs->ring->done = 1;
+            stream_end(rs, 0);
+            continue;
+        }
+
+        if (result_failed(raw_result)) {
+            lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+
+            lily_mb_add(msgbuf, PQresultErrorMessage(raw_result));
+            PQclear(raw_result);
+            stream_end(rs, 0);
+            lily_RuntimeError(s, "%s", lily_mb_raw(msgbuf));
+        }
+
+        if (result_copying(raw_result)) {
+            PQclear(raw_result);
+            stream_end(rs, 0);
+            lily_RuntimeError(s, "COPY is not supported by stream.\n");
+        }
+
+        rs->current = raw_result;
+        rs->current_row = 0;
+    }
+
+    PGresult *raw_result = rs->current;
+    int row = (int)rs->current_row;
+    int column_count = PQnfields(raw_result);
+    lily_container_val *variant = lily_push_some(s);
+    lily_container_val *lv = lily_push_list(s, column_count);
+    int col;
+
+    for (col = 0;col < column_count;col++) {
+        char *field_text = "(null)";
+
+        if (PQgetisnull(raw_result, row, col) == 0)
+            field_text = PQgetvalue(raw_result, row, col);
+
+        lily_push_string(s, field_text);
+        lily_con_set_from_stack(s, lv, col);
+    }
+
+    lily_con_set_from_stack(s, variant, 0);
+    rs->current_row++;
+    lily_return_top(s);
+}
+
+/**
+foreign class Conn {
+    layout {
+        uint64_t is_open;
+        PGconn *conn;
+        struct lily_postgres_CopyWriter_ *copy_writer;
+        struct type_registry_ *types;
+        struct lily_postgres_RowStream_ *stream;
+        char *pool_key;
+    }
+}
+
+The `Conn` class represents a connection to a postgres server.
+
+A `Conn` made by `Conn.borrow` holds a connection from a pool that every
+interpreter in the process shares. `Conn.release` gives it back. This lets
+interpreters on different threads share a few connections instead of each
+holding their own. A connection is only ever held by one `Conn` at a time.
+*/
+
+/* Connections given back by Conn.release wait here until Conn.borrow takes
+   them again. Each connection is either on this list or in one Conn, so no two
+   threads ever use the same one. `key` holds the values it was opened with.
+   The lock is only held to move entries on or off the list. */
+typedef struct pool_entry_ {
+    struct pool_entry_ *next;
+    char *key;
+    PGconn *conn;
+    struct type_registry_ *types;
+} pool_entry;
+
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pool_entry *pool_idle = NULL;
+uint64_t pool_idle_count = 0;
+uint64_t pool_idle_limit = 8;
+
+/* These are for Conn.pool_stats, and are only changed with the lock held. */
+uint64_t pool_borrow_count = 0;
+uint64_t pool_reuse_count = 0;
+uint64_t pool_contended_count = 0;
+uint64_t pool_wait_ns = 0;
+
+/* Take the pool's lock, counting how often and how long threads wait for it. */
+void pool_acquire(void)
+{
+    if (pthread_mutex_trylock(&pool_lock) == 0)
+        return;
+
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&pool_lock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pool_contended_count++;
+    pool_wait_ns += (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 +
+                    end.tv_nsec - start.tv_nsec;
+}
+
+void free_pool_entry(pool_entry *entry)
+{
+    PQfinish(entry->conn);
+    free_type_registry(entry->types);
+    free(entry->key);
+    free(entry);
+}
+
+/* Take an idle connection opened with `key` off the list, or return NULL. */
+pool_entry *pool_take(const char *key)
+{
+    pool_entry **link;
+    pool_entry *entry = NULL;
+
+    pool_acquire();
+    pool_borrow_count++;
+
+    for (link = &pool_idle;*link;link = &(*link)->next) {
+        if (strcmp((*link)->key, key) == 0) {
+            entry = *link;
+            *link = entry->next;
+            pool_idle_count--;
+            pool_reuse_count++;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+    return entry;
+}
+
+/* Put `entry` on the list. Returns 0 if the list is full, in which case the
+   caller still owns `entry`. */
+int pool_put(pool_entry *entry)
+{
+    int kept = 0;
+
+    pool_acquire();
+
+    if (pool_idle_count < pool_idle_limit) {
+        entry->next = pool_idle;
+        pool_idle = entry;
+        pool_idle_count++;
+        kept = 1;
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+    return kept;
+}
+
+/* Give the connection of `conn_value` back to the pool, and close
+   `conn_value`. A connection is only kept if it is idle and `DISCARD ALL`
+   works, so that the next borrower gets a clean session. */
+void pool_release(lily_postgres_Conn *conn_value)
+{
+    PGconn *conn = conn_value->conn;
+    int keep = 1;
+
+    if (conn_value->stream)
+        stream_end(conn_value->stream, 1);
+
+    if (conn_value->copy_writer) {
+        copy_unlink(conn_value->copy_writer);
+        keep = 0;
+    }
+
+    if (keep &&
+        (PQstatus(conn) != CONNECTION_OK ||
+         PQtransactionStatus(conn) != PQTRANS_IDLE))
+        keep = 0;
+
+    if (keep) {
+        PGresult *raw_result = PQexec(conn, "DISCARD ALL");
+
+        keep = (PQresultStatus(raw_result) == PGRES_COMMAND_OK);
+        PQclear(raw_result);
+    }
+
+    pool_entry *entry = malloc(sizeof(*entry));
+
+    entry->key = conn_value->pool_key;
+    entry->conn = conn;
+    entry->types = conn_value->types;
+
+    if (keep == 0 || pool_put(entry) == 0)
+        free_pool_entry(entry);
+
+    conn_value->is_open = 0;
+    conn_value->conn = NULL;
+    conn_value->types = NULL;
+    conn_value->pool_key = NULL;
+}
+
+void destroy_Conn(lily_postgres_Conn *conn_value)
+{
+    if (conn_value->pool_key) {
+        pool_release(conn_value);
+        return;
+    }
+
+    if (conn_value->copy_writer)
+        conn_value->copy_writer->conn_value = NULL;
+
+    if (conn_value->stream)
+        stream_end(conn_value->stream, 1);
+
+    free_type_registry(conn_value->types);
+    PQfinish(conn_value->conn);
+}
+
+/* Returns the type registry of `conn_value`, loading it if it has not been
+   loaded or is older than `oid`. Returns NULL if it cannot be loaded right now,
+   such as during a copy or in a failed transaction. */
+type_registry *conn_types(lily_postgres_Conn *conn_value, Oid oid)
+{
+    type_registry *r = conn_value->types;
+
+    if (r && (r->count == 0 || r->entries[r->count - 1].oid >= oid))
+        return r;
+
+    if (conn_value->is_open == 0 || conn_value->copy_writer ||
+        conn_value->stream ||
+        PQtransactionStatus(conn_value->conn) == PQTRANS_INERROR)
+        return r;
+
+    type_registry *new_r = load_type_registry(conn_value->conn);
+
+    if (new_r) {
+        free_type_registry(r);
+        conn_value->types = r = new_r;
+    }
+
+    return r;
+}
+
+/* If `conn_value` has been released, or a RowStream or CopyWriter is using it,
+   return a Failure and 1. The stream's thread owns the connection until the
+   stream ends. A query sent during a copy would end the copy, and the rows
+   already written would be lost. */
+int conn_unavailable(lily_state *s, lily_postgres_Conn *conn_value)
+{
+    if (conn_value->is_open == 0)
+        return_failure(s, "Conn is closed.\n");
+    else if (conn_value->stream)
+        return_failure(s, "A stream is in progress.\n");
+    else if (conn_value->copy_writer)
+        return_failure(s, "A copy is already in progress.\n");
+    else
+        return 0;
+
+    return 1;
+}
+
+/* If the memory limit has been reached, return a Failure and 1. */
+int result_limit_reached(lily_state *s)
+{
+    if (result_byte_limit == 0 || live_result_bytes < result_byte_limit)
+        return 0;
+
+    lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+
+    lily_mb_add_fmt(msgbuf,
+            "Results already use %ld bytes of the %ld byte limit.",
+            (long)live_result_bytes, (long)result_byte_limit);
+    return_failure(s, lily_mb_raw(msgbuf));
+    return 1;
+}
+
+/* Reserve the bytes of `raw_result`, and return 0. If that would pass the
+   memory limit, free it, return a Failure, and return 1. */
+int result_over_limit(lily_state *s, PGresult *raw_result)
+{
+    uint64_t size = PQresultMemorySize(raw_result);
+
+    if (reserve_result_bytes(size))
+        return 0;
+
+    lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+
+    lily_mb_add_fmt(msgbuf,
+            "Result of %ld bytes would pass the %ld byte limit (%ld in use).",
+            (long)size, (long)result_byte_limit, (long)live_result_bytes);
+    PQclear(raw_result);
+    return_failure(s, lily_mb_raw(msgbuf));
+    return 1;
+}
+
+void return_result(lily_state *s, lily_postgres_Conn *conn_value,
+        PGresult *raw_result)
+{
+    if (result_failed(raw_result)) {
+        PQclear(raw_result);
+        return_failure(s, PQerrorMessage(conn_value->conn));
+        return;
+    }
+
+    if (result_over_limit(s, raw_result))
+        return;
+
+    lily_container_val *variant = lily_push_success(s);
+
+    push_cursor_for(s, conn_value, raw_result, NULL);
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+void exec_query(lily_state *s, lily_postgres_Conn *conn_value,
+        const char *query_string)
+{
+    if (conn_unavailable(s, conn_value) || result_limit_reached(s))
+        return;
+
+    return_result(s, conn_value, PQexec(conn_value->conn, query_string));
+}
+
+/* These are the names that copy_in_binary accepts for column types. */
+Oid copy_type_for_name(const char *name)
+{
+    if (strcmp(name, "int8") == 0 || strcmp(name, "bigint") == 0)
+        return INT8OID;
+    else if (strcmp(name, "int4") == 0 || strcmp(name, "integer") == 0)
+        return INT4OID;
+    else if (strcmp(name, "int2") == 0 || strcmp(name, "smallint") == 0)
+        return INT2OID;
+    else if (strcmp(name, "float8") == 0 ||
+             strcmp(name, "double precision") == 0)
+        return FLOAT8OID;
+    else if (strcmp(name, "float4") == 0 || strcmp(name, "real") == 0)
+        return FLOAT4OID;
+    else if (strcmp(name, "bool") == 0 || strcmp(name, "boolean") == 0)
+        return BOOLOID;
+    else if (strcmp(name, "bytea") == 0)
+        return BYTEAOID;
+    else if (strcmp(name, "text") == 0)
+        return TEXTOID;
+
+    return 0;
+}
+
+/**
+define Conn.compile(format: String): Template
+
+Search `format` for `"?"` values once, and return a `Template` that can be
+passed to `Conn.query_template` any number of times.
+*/
+void lily_postgres_Conn_compile(lily_state *s)
+{
+    lily_string_val *fmt_val = lily_arg_string(s, 1);
+    char *fmt = lily_string_raw(fmt_val);
+    uint64_t fmt_size = lily_string_length(fmt_val);
+    uint64_t count = 0, i;
+
+    for (i = 0;i < fmt_size;i++) {
+        if (fmt[i] == '?')
+            count++;
+    }
+
+    lily_postgres_Template *t = INIT_Template(s);
+    t->placeholder_count = count;
+    t->fmt_size = fmt_size;
+    t->buffer_size = 0;
+    t->buffer = NULL;
+    t->fmt = malloc(fmt_size + 1);
+    t->offsets = malloc((count + 1) * sizeof(*t->offsets));
+    t->value_sizes = malloc((count + 1) * sizeof(*t->value_sizes));
+    memcpy(t->fmt, fmt, fmt_size + 1);
+
+    count = 0;
+    for (i = 0;i < fmt_size;i++) {
+        if (fmt[i] == '?') {
+            t->offsets[count] = i;
+            count++;
+        }
+    }
+
+    lily_return_top(s);
+}
+
+/**
+define Conn.copy_in_binary(table: String, column_types: List[String]): Result[String, CopyWriter]
+
+Begin copying rows into `table` using the binary `COPY` format. `table` may
+include a column list, such as `"metrics (at, value)"`.
+
+`column_types` has the type of each column that will be written, in order. The
+types that can be used are `"int2"`, `"int4"`, `"int8"`, `"float4"`,
+`"float8"`, `"bool"`, `"bytea"`, and `"text"`. Binary data must match the
+column type exactly, so the writer uses these to check and encode each field.
+
+On success, the result is a `Success` containing a `CopyWriter`.
+
+On failure, the result is a `Failure` containing a `String` describing the
+error.
+*/
+void lily_postgres_Conn_copy_in_binary(lily_state *s)
+{
+    lily_postgres_Conn *conn_value = ARG_Conn(s, 0);
+    char *table = lily_arg_string_raw(s, 1);
+    lily_container_val *type_lv = lily_arg_container(s, 2);
+    int column_count = lily_con_size(type_lv);
+    lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+
+    if (conn_unavailable(s, conn_value))
+        return;
+
+    if (column_count == 0) {
+        return_failure(s, "No column types given.\n");
+        return;
+    }
+
+    Oid *column_types = malloc(column_count * sizeof(*column_types));
+    int i;
+
+    for (i = 0;i < column_count;i++) {
+        char *name = lily_as_string_raw(lily_con_get(type_lv, i));
+        Oid type = copy_type_for_name(name);
+
+        if (type == 0) {
+            free(column_types);
+            lily_mb_add_fmt(msgbuf, "Cannot copy type '%s'.\n", name);
+            return_failure(s, lily_mb_raw(msgbuf));
+            return;
+        }
+
+        column_types[i] = type;
+    }
+
+    lily_mb_add_fmt(msgbuf, "COPY %s FROM STDIN (FORMAT binary)", table);
+
+    PGresult *raw_result = PQexec(conn_value->conn, lily_mb_raw(msgbuf));
+
+    if (PQresultStatus(raw_result) != PGRES_COPY_IN) {
+        free(column_types);
+        PQclear(raw_result);
+        return_failure(s, PQerrorMessage(conn_value->conn));
+        return;
+    }
+
+    PQclear(raw_result);
+
+    lily_container_val *variant = lily_push_success(s);
+    lily_postgres_CopyWriter *w = INIT_CopyWriter(s);
+
+    w->column_count = column_count;
+    w->column = 0;
+    w->row_count = 0;
+    w->buffer_pos = 0;
+    w->buffer_size = COPY_BUFFER_SIZE;
+    w->column_types = column_types;
+    w->buffer = malloc(COPY_BUFFER_SIZE);
+    w->conn_value = conn_value;
+    conn_value->copy_writer = w;
+
+    /* Signature, flags, then the length of the (empty) header extension. */
+    char *out = copy_reserve(s, w, 19);
+
+    memcpy(out, "PGCOPY\n\377\r\n\0", 11);
+    write_be32(out + 11, 0);
+    write_be32(out + 15, 0);
+
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/* Build the query for `fmt`, replacing each "?" with the next entry from
+   `vararg_lv`. Returns NULL if there are not enough entries. */
+const char *expand_format(lily_state *s, char *fmt,
+        lily_container_val *vararg_lv)
+{
+    int arg_pos = 0, fmt_index = 0, text_start = 0, text_stop = 0;
+    lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+
+    int num_values = lily_con_size(vararg_lv);
+
+    while (1) {
+        char ch = fmt[fmt_index];
+
+        if (ch == '?') {
+            if (arg_pos == num_values)
+                return NULL;
+
+            lily_mb_add_slice(msgbuf, fmt, text_start, text_stop);
+            text_start = fmt_index + 1;
+            text_stop = text_start;
+
+            lily_value *v = lily_con_get(vararg_lv, arg_pos);
+            lily_mb_add(msgbuf, lily_as_string_raw(v));
+            arg_pos++;
+        }
+        else {
+            if (ch == '\0')
+                break;
+
+            text_stop++;
+        }
+
+        fmt_index++;
+    }
+
+    /* If there are no ?'s in the format string, then it can be used as-is. */
+    if (text_start == 0)
+        return fmt;
+
+    lily_mb_add_slice(msgbuf, fmt, text_start, text_stop);
+    return lily_mb_raw(msgbuf);
+}
+
+/**
+define Conn.query(format: String, values: String...): Result[String, Cursor]
+
+Perform a query using `format`. Any `"?"` value found within `format` will be
+replaced with an entry from `values`.
+
+On success, the result is a `Success` containing a `Cursor`.
+
+On failure, the result is a `Failure` containing a `String` describing the error.
+*/
+void lily_postgres_Conn_query(lily_state *s)
+{
+    lily_postgres_Conn *conn_value = ARG_Conn(s, 0);
+    char *fmt = lily_arg_string_raw(s, 1);
+    lily_container_val *vararg_lv = lily_arg_container(s, 2);
+    const char *query_string = expand_format(s, fmt, vararg_lv);
+
+    if (query_string == NULL) {
+        return_failure(s, "Not enough arguments for format.\n");
+        return;
+    }
+
+    exec_query(s, conn_value, query_string);
+}
+
+/**
+define Conn.query_spill(memory_limit: Integer, format: String, values: String...): Result[String, Cursor]
+
+Perform a query like `Conn.query`, but without holding the whole result in
+memory. Rows are read from the server one at a time, and copied into a compact
+row store. Once the rows held in memory reach `memory_limit` bytes, the rest
+are written to a temporary file, which is mapped into memory once the query
+finishes. Each row held in memory also counts 8 bytes for its place in an
+index. The index of the other rows is in a second temporary file. The limit
+covers the memory allocated for rows and the index, not only the part in use,
+so the store never holds more than `memory_limit` bytes, plus room for the
+row being written while rows spill. The resulting `Cursor` works the same way
+as any other.
+
+`format` should hold a single statement. A `COPY` statement that reads from or
+writes to the client is a failure, and its copy is ended without sending or
+keeping any data.
+
+On success, the result is a `Success` containing a `Cursor`.
+
+On failure, the result is a `Failure` containing a `String` describing the error.
+*/
+void lily_postgres_Conn_query_spill(lily_state *s)
+{
+    lily_postgres_Conn *conn_value = ARG_Conn(s, 0);
+    int64_t memory_limit = lily_arg_integer(s, 1);
+    char *fmt = lily_arg_string_raw(s, 2);
+    lily_container_val *vararg_lv = lily_arg_container(s, 3);
+    const char *query_string = expand_format(s, fmt, vararg_lv);
+    PGconn *conn = conn_value->conn;
+
+    if (query_string == NULL) {
+        return_failure(s, "Not enough arguments for format.\n");
+        return;
+    }
+
+    if (conn_unavailable(s, conn_value))
+        return;
+
+    if (memory_limit < 0)
+        memory_limit = 0;
+
+    if (PQsendQuery(conn, query_string) == 0) {
+        return_failure(s, PQerrorMessage(conn));
+        return;
+    }
+
+    PQsetSingleRowMode(conn);
+
+    /* The query has been sent, so the msgbuf can hold errors instead. */
+    lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+    row_store *store = NULL;
+    PGresult *raw_result;
+    int failed = 0;
+
+    /* Every result must be collected, even after an error, or the connection
+       will not accept the next query. */
+    while ((raw_result = PQgetResult(conn)) != NULL) {
+        ExecStatusType status = PQresultStatus(raw_result);
+
+        if (end_copy(conn, raw_result)) {
+            if (failed == 0)
+                lily_mb_add(msgbuf, "COPY is not supported by query_spill.\n");
+
+            failed = 1;
+        }
+        else if (failed)
+            ;
+        else if (result_failed(raw_result)) {
+            lily_mb_add(msgbuf, PQresultErrorMessage(raw_result));
+            failed = 1;
+        }
+        else if (status == PGRES_SINGLE_TUPLE || status == PGRES_TUPLES_OK) {
+            if (store == NULL)
+                store = new_row_store(raw_result, memory_limit);
+
+            if (status == PGRES_SINGLE_TUPLE &&
+                row_store_add(store, raw_result) == 0) {
+                lily_mb_add(msgbuf, "Unable to write to temporary file.\n");
+                failed = 1;
+            }
+        }
+
+        PQclear(raw_result);
+    }
+
+    /* Commands that do not return rows still get a Cursor, with no rows. */
+    if (store == NULL)
+        store = new_row_store(NULL, memory_limit);
+
+    if (failed == 0 && row_store_finish(store) == 0) {
+        lily_mb_add(msgbuf, "Unable to map temporary file.\n");
+        failed = 1;
+    }
+
+    if (failed) {
+        free_row_store(store);
+        return_failure(s, lily_mb_raw(msgbuf));
+        return;
+    }
+
+    lily_container_val *variant = lily_push_success(s);
+
+    push_cursor_for(s, conn_value, NULL, store);
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/**
+define Conn.query_all(sql: String): Result[String, List[Cursor]]
+
+Send `sql`, which may contain several statements separated by `";"`, to the
+server in a single round trip. Unlike `Conn.query`, the result of every
+statement is kept instead of only the last one.
+
+On success, the result is a `Success` containing a `Cursor` for each statement,
+in the order that the statements were written.
+
+On failure, the result is a `Failure` containing a `String` describing the
+first error. Results from statements that ran before the error are discarded.
+A `COPY` statement that reads from or writes to the client is a failure, and
+its copy is ended without sending or keeping any data.
+*/
+void lily_postgres_Conn_query_all(lily_state *s)
+{
+    lily_postgres_Conn *conn_value = ARG_Conn(s, 0);
+    char *sql = lily_arg_string_raw(s, 1);
+    PGconn *conn = conn_value->conn;
+
+    if (conn_unavailable(s, conn_value) || result_limit_reached(s))
+        return;
+
+    if (PQsendQuery(conn, sql) == 0) {
+        return_failure(s, PQerrorMessage(conn));
+        return;
+    }
+
+    int result_count = 0, result_size = 4, failed = 0;
+    uint64_t total_bytes = 0;
+    PGresult **results = malloc(result_size * sizeof(*results));
+    PGresult *raw_result;
+    lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+
+    /* Every result must be collected, even after an error, or the connection
+       will not accept the next query. */
+    while ((raw_result = PQgetResult(conn)) != NULL) {
+        if (end_copy(conn, raw_result)) {
+            if (failed == 0)
+                lily_mb_add(msgbuf, "COPY is not supported by query_all.\n");
+
+            PQclear(raw_result);
+            failed = 1;
+            continue;
+        }
+
+        if (failed) {
+            PQclear(raw_result);
+            continue;
+        }
+
+        if (result_failed(raw_result)) {
+            lily_mb_add(msgbuf, PQresultErrorMessage(raw_result));
+            PQclear(raw_result);
+            failed = 1;
+            continue;
+        }
+
+        /* Each result is reserved as it arrives, and the whole reservation
+           is given back if the query fails. */
+        uint64_t size = PQresultMemorySize(raw_result);
+
+        if (reserve_result_bytes(size) == 0) {
+            lily_mb_add_fmt(msgbuf,
+                    "Results of %ld bytes would pass the %ld byte limit "
+                    "(%ld in use).", (long)(total_bytes + size),
+                    (long)result_byte_limit,
+                    (long)(live_result_bytes - total_bytes));
+            PQclear(raw_result);
+            failed = 1;
+            continue;
+        }
+
+        total_bytes += size;
+
+        if (result_count == result_size) {
+            result_size *= 2;
+            results = realloc(results, result_size * sizeof(*results));
+        }
+
+        results[result_count] = raw_result;
+        result_count++;
+    }
+
+    if (failed) {
+        int i;
+        for (i = 0;i < result_count;i++)
+            PQclear(results[i]);
+
+        live_result_bytes -= total_bytes;
+        free(results);
+        return_failure(s, lily_mb_raw(msgbuf));
+        return;
+    }
+
+    lily_container_val *variant = lily_push_success(s);
+    lily_container_val *lv = lily_push_list(s, result_count);
+
+    int i;
+    for (i = 0;i < result_count;i++) {
+        push_cursor_for(s, conn_value, results[i], NULL);
+        lily_con_set_from_stack(s, lv, i);
+    }
+
+    free(results);
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/**
+define Conn.query_params(sql: String, params: Params): Result[String, Cursor]
+
+Perform a query using `sql`, with `$1`, `$2`, and so on replaced by the values
+in `params`. The values are sent separately from `sql`, so they do not need to
+be escaped.
+
+On success, the result is a `Success` containing a `Cursor`.
+
+On failure, the result is a `Failure` containing a `String` describing the error.
+*/
+void lily_postgres_Conn_query_params(lily_state *s)
+{
+    lily_postgres_Conn *conn_value = ARG_Conn(s, 0);
+    char *sql = lily_arg_string_raw(s, 1);
+    lily_postgres_Params *p = ARG_Params(s, 2);
+
+    if (conn_unavailable(s, conn_value) || result_limit_reached(s))
+        return;
+
+    PGresult *raw_result = PQexecParams(conn_value->conn, sql, (int)p->count,
+            p->types, (const char * const *)p->values, p->lengths, p->formats,
+            0);
+
+    return_result(s, conn_value, raw_result);
+}
+
+/**
+define Conn.query_template(template: Template, values: String...): Result[String, Cursor]
+
+Perform a query using `template`, which was made by `Conn.compile`. Each `"?"`
+in the template is replaced by an entry from `values`.
+
+On success, the result is a `Success` containing a `Cursor`.
+
+On failure, the result is a `Failure` containing a `String` describing the
+error. The number of `values` must match the number of `"?"` in `template`, or
+the query is not sent.
+*/
+void lily_postgres_Conn_query_template(lily_state *s)
+{
+    lily_postgres_Conn *conn_value = ARG_Conn(s, 0);
+    lily_postgres_Template *t = ARG_Template(s, 1);
+    lily_container_val *vararg_lv = lily_arg_container(s, 2);
+    uint64_t count = t->placeholder_count;
+
+    if (lily_con_size(vararg_lv) != count) {
+        return_failure(s, "Wrong number of arguments for template.\n");
+        return;
+    }
+
+    if (count == 0) {
+        exec_query(s, conn_value, t->fmt);
+        return;
+    }
+
+    uint64_t total = t->fmt_size - count + 1;
+    uint64_t i;
+
+    for (i = 0;i < count;i++) {
+        lily_value *v = lily_con_get(vararg_lv, i);
+        uint64_t size = strlen(lily_as_string_raw(v));
+
+        t->value_sizes[i] = size;
+        total += size;
+    }
+
+    if (t->buffer_size < total) {
+        free(t->buffer);
+        t->buffer = malloc(total);
+        t->buffer_size = total;
+    }
+
+    char *out = t->buffer;
+    uint64_t text_start = 0;
+
+    for (i = 0;i < count;i++) {
+        uint64_t text_size = t->offsets[i] - text_start;
+        uint64_t value_size = t->value_sizes[i];
+
+        memcpy(out, t->fmt + text_start, text_size);
+        out += text_size;
+        memcpy(out, lily_as_string_raw(lily_con_get(vararg_lv, i)),
+               value_size);
+        out += value_size;
+        text_start = t->offsets[i] + 1;
+    }
+
+    memcpy(out, t->fmt + text_start, t->fmt_size - text_start + 1);
+    exec_query(s, conn_value, t->buffer);
+}
+
+/**
+define Conn.stream(format: String, values: String...): Result[String, RowStream]
+
+Perform a query like `Conn.query`, but read its rows through a `RowStream`
+instead of waiting for all of them. A separate thread reads and parses results
+while Lily works through the rows that have already arrived. Only a few hundred
+results are read ahead of `RowStream.next`, so a long scan does not need to fit
+in memory.
+
+`format` should hold a single statement. `self` cannot run other queries while
+the stream is open.
+
+On success, the result is a `Success` containing a `RowStream`.
+
+On failure, the result is a `Failure` containing a `String` describing the error.
+Errors that happen after the query starts are raised by `RowStream.next`.
+*/
+void lily_postgres_Conn_stream(lily_state *s)
+{
+    lily_postgres_Conn *conn_value = ARG_Conn(s, 0);
+    char *fmt = lily_arg_string_raw(s, 1);
+    lily_container_val *vararg_lv = lily_arg_container(s, 2);
+    const char *query_string = expand_format(s, fmt, vararg_lv);
+    PGconn *conn = conn_value->conn;
+
+    if (query_string == NULL) {
+        return_failure(s, "Not enough arguments for format.\n");
+        return;
+    }
+
+    if (conn_unavailable(s, conn_value))
+        return;
+
+    if (PQsendQuery(conn, query_string) == 0) {
+        return_failure(s, PQerrorMessage(conn));
+        return;
+    }
+
+#ifdef LIBPQ_HAS_CHUNK_MODE
+    PQsetChunkedRowsMode(conn, STREAM_CHUNK_ROWS);
+#else
+    PQsetSingleRowMode(conn);
+#endif
+
+    stream_ring *ring = calloc(1, sizeof(*ring));
+
+    ring->conn = conn;
+    ring->cancel = PQgetCancel(conn);
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->wake, NULL);
+
+    if (pthread_create(&ring->thread, NULL, stream_read, ring) != 0) {
+        PGresult *raw_result;
+
+        while ((raw_result = PQgetResult(conn)) != NULL) {
+            end_copy(conn, raw_result);
+            PQclear(raw_result);
+        }
+
+        pthread_cond_destroy(&ring->wake);
+        pthread_mutex_destroy(&ring->lock);
+        PQfreeCancel(ring->cancel);
+        free(ring);
+        return_failure(s, "Unable to start a thread for the stream.\n");
+        return;
+    }
+
+    lily_container_val *variant = lily_push_success(s);
+    lily_postgres_RowStream *rs = INIT_RowStream(s);
+
+    rs->ring = ring;
+    rs->current = NULL;
+    rs->current_row = 0;
+    rs->conn_value = conn_value;
+    conn_value->stream = rs;
+    lily_con_set_from_stack(s, variant, 0);
+    lily_return_top(s);
+}
+
+/**
+define Conn.release
+
+Give the connection of `self`, which was made by `Conn.borrow`, back to the
+pool, then close `self`. Queries on a closed `Conn` return a `Failure`. If
+`self` has a `RowStream` running, the stream is cancelled first.
+
+Before a connection goes back, `DISCARD ALL` is run on it so that settings,
+temporary tables, and prepared statements don't carry over to the next
+borrower. A connection in a transaction or a copy is closed instead, as is
+one that would pass the limit of `Conn.set_pool_size`.
+
+If `self` was made by `Conn.open`, or is already closed, this does nothing.
+*/
+void lily_postgres_Conn_release(lily_state *s)
+{
+    lily_postgres_Conn *conn_value = ARG_Conn(s, 0);
+
+    if (conn_value->pool_key)
+        pool_release(conn_value);
+}
+
+/* Read the optional arguments that Conn.open and Conn.borrow take into `args`
+   (host, port, dbname, name, pass). Those not given are NULL. */
+void conn_args(lily_state *s, const char **args)
+{
+    int count = lily_arg_count(s);
+    int i;
+
+    for (i = 0;i < 5;i++)
+        args[i] = i < count ? lily_arg_string_raw(s, i) : NULL;
+}
+
+PGconn *connect_args(const char **args)
+{
+    /* Time fields are parsed in fixed formats, so pin the styles that make
+       them. Passing options replaces PGOPTIONS, so those are sent first, and
+       the pinned styles come last to win over any that PGOPTIONS sets. */
+    const char *pinned = "-c DateStyle=ISO,MDY -c IntervalStyle=postgres";
+    const char *env_options = getenv("PGOPTIONS");
+
+    if (env_options == NULL)
+        env_options = "";
+
+    char *options = malloc(strlen(env_options) + strlen(pinned) + 2);
+
+    strcpy(options, env_options);
+    strcat(options, " ");
+    strcat(options, pinned);
+
+    PGconn *conn = PQsetdbLogin(args[0], args[1], options, NULL, args[2],
+            args[3], args[4]);
+
+    free(options);
+    return conn;
+}
+
+/* Push a Success with a new Conn for `conn`, or a Failure with its error if it
+   did not connect. */
+void push_conn_result(lily_state *s, PGconn *conn, char *pool_key,
+        type_registry *types)
+{
+    lily_container_val *variant;
+
+    if (PQstatus(conn) != CONNECTION_OK) {
+        variant = lily_push_failure(s);
+        lily_push_string(s, PQerrorMessage(conn));
+        lily_con_set_from_stack(s, variant, 0);
+        PQfinish(conn);
+        free_type_registry(types);
+        free(pool_key);
+        return;
+    }
+
+    variant = lily_push_success(s);
+
+    lily_postgres_Conn *new_val = INIT_Conn(s);
+
+    new_val->is_open = 1;
+    new_val->conn = conn;
+    new_val->copy_writer = NULL;
+    new_val->types = types;
+    new_val->stream = NULL;
+    new_val->pool_key = pool_key;
+    lily_con_set_from_stack(s, variant, 0);
+}
+
+/**
+static define Conn.borrow(
+    host: *String="",
+    port: *String="",
+    dbname: *String="",
+    name: *String="",
+    pass: *String=""): Result[String, Conn]
+
+Take a connection from the process-wide pool, or connect like `Conn.open` if
+the pool has none that were opened with the same values. The pool is shared by
+every interpreter in the process, and is safe to use from any thread.
+
+The `Conn` should be given back with `Conn.release` once it is no longer
+needed. A `Conn` that is destroyed without being released is given back then.
+
+If able to connect, the result is a `Success` containing the `Conn`.
+
+Otherwise, the result is a `Failure` containing an error message.
+*/
+void lily_postgres_Conn_borrow(lily_state *s)
+{
+    const char *args[5];
+    lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+    int i;
+
+    conn_args(s, args);
+
+    /* The key is the values, each ended by a unit separator. */
+    for (i = 0;i < 5;i++) {
+        if (args[i])
+            lily_mb_add(msgbuf, args[i]);
+
+        lily_mb_add_char(msgbuf, '\x1f');
+    }
+
+    char *key = strdup(lily_mb_raw(msgbuf));
+    pool_entry *entry = pool_take(key);
+    PGconn *conn;
+    type_registry *types = NULL;
+
+    if (entry && PQstatus(entry->conn) == CONNECTION_OK) {
+        conn = entry->conn;
+        types = entry->types;
+        free(entry->key);
+        free(entry);
+    }
+    else {
+        if (entry)
+            free_pool_entry(entry);
+
+        conn = connect_args(args);
+    }
+
+    push_conn_result(s, conn, key, types);
+    lily_return_top(s);
+}
+
+/**
+static define Conn.open(
+    host: *String="",
+    port: *String="",
+    dbname: *String="",
+    name: *String="",
+    pass: *String=""): Result[String, Conn]
+
+Attempt to connect to the postgres server, using the values provided.
+
+If able to connect, the result is a `Success` containing the `Conn`.
+
+Otherwise, the result is a `Failure` containing an error message.
+
+The connection uses the `ISO` `DateStyle` and the `postgres` `IntervalStyle`,
+which `Cursor.get_epoch_micros` and similar methods need. Changing either
+setting will make those methods fail. Options from the `PGOPTIONS` environment
+variable are still sent, but these two styles are always set over them.
+*/
+void lily_postgres_Conn_open(lily_state *s)
+{
+    const char *args[5];
+
+    conn_args(s, args);
+    push_conn_result(s, connect_args(args), NULL, NULL);
+    lily_return_top(s);
+}
+
+/**
+static define Conn.pool_stats: Tuple[Integer, Integer, Integer, Integer, Integer]
+
+Returns numbers about the pool that `Conn.borrow` uses, counted since the
+process started. In order, they are:
+
+* How many times `Conn.borrow` was called.
+
+* How many of those were given a connection from the pool.
+
+* How many connections are in the pool now.
+
+* How many times a thread had to wait for another to finish with the pool.
+
+* How long threads have waited in total, in microseconds.
+*/
+void lily_postgres_Conn_pool_stats(lily_state *s)
+{
+    uint64_t stats[5];
+    int i;
+
+    pool_acquire();
+    stats[0] = pool_borrow_count;
+    stats[1] = pool_reuse_count;
+    stats[2] = pool_idle_count;
+    stats[3] = pool_contended_count;
+    stats[4] = pool_wait_ns / 1000;
+    pthread_mutex_unlock(&pool_lock);
+
+    lily_container_val *tuple = lily_push_tuple(s, 5);
+
+    for (i = 0;i < 5;i++) {
+        lily_push_integer(s, (int64_t)stats[i]);
+        lily_con_set_from_stack(s, tuple, i);
+    }
+
+    lily_return_top(s);
+}
+
+/**
+static define Conn.set_pool_size(size: Integer)
+
+Set how many idle connections the pool that `Conn.borrow` uses can hold. The
+default is 8. Connections given back when the pool is full are closed, and
+if the pool already holds more than `size`, the extra ones are closed now.
+This does not limit how many connections can be borrowed at once.
+
+# Errors
+
+* `ValueError` if `size` is negative.
+*/
+void lily_postgres_Conn_set_pool_size(lily_state *s)
+{
+    int64_t size = lily_arg_integer(s, 0);
+
+    if (size < 0)
+        lily_ValueError(s, "size must not be negative.");
+
+    pool_entry *extra = NULL;
+
+    pool_acquire();
+    pool_idle_limit = (uint64_t)size;
+
+    while (pool_idle_count > pool_idle_limit) {
+        pool_entry *entry = pool_idle;
+
+        pool_idle = entry->next;
+        pool_idle_count--;
+        entry->next = extra;
+        extra = entry;
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+
+    /* Closing talks to the server, so it is done without the lock. */
+    while (extra) {
+        pool_entry *next = extra->next;
+
+        free_pool_entry(extra);
+        extra = next;
+    }
 }